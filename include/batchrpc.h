@@ -52,6 +52,8 @@ struct slrpc_batch_rep;
 
 struct slrpc_batch_req_handler {
 	int	(*bqh_cbf)(struct slrpc_batch_rep *, void *, void *);
+	/* optional, run before the items of a batch with their count */
+	void	(*bqh_startf)(struct slrpc_batch_rep *, int);
 	int	  bqh_qlen;
 	int	  bqh_plen;
 	int	  bqh_snd_ptl:16;	/* bulk RPC portal */
@@ -103,6 +105,7 @@ struct slrpc_batch_rep {
 
 	struct pscrpc_request		 *bp_rq;
 	struct slrpc_cservice		 *bp_csvc;
+	struct pscrpc_export		 *bp_exp;		/* peer, for callbacks */
 	int				  bp_refcnt;
 	int				  bp_flags;
 	int				  bp_rc;
@@ -145,6 +148,7 @@ int	slrpc_batch_req_add(struct sl_resource *,
 void	slrpc_batches_init(int, int, const char *);
 void	slrpc_batches_destroy(void);
 void	slrpc_batches_drop(struct sl_resource *res);
+void	slrpc_batches_flush(struct sl_resource *, int32_t);
 
 void	slrpc_batch_rep_decref(struct slrpc_batch_rep *, int);
 
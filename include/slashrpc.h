@@ -195,6 +195,8 @@ enum {
 	SRMT_CTL,				/* 51: generic control */
 
 	SRMT_FILECB,				/* 52: file callback */
+	SRMT_RESERVE_FID,			/* 53: reserve FIDs for async creates */
+	SRMT_GETBMAPS,				/* 54: get client leases for a range of bmaps */
 
 	SRMT_TOTAL
 };
@@ -489,6 +491,39 @@ struct srm_leasebmap_rep {
 	struct srt_inode	ino;		/* if SRM_LEASEBMAPF_GETINODE */
 } __packed;
 
+/*
+ * Leases for up to SRM_LEASEBMAPS_MAX consecutive bmaps in one RPC.
+ * The MDS stops at the first bmap it cannot lease; ents[nbmaps]
+ * reports why when nbmaps < count.  The count is bounded so that the
+ * reply stays within SLM_RMC_REPSZ.
+ */
+#define SRM_LEASEBMAPS_MAX	8
+
+struct srm_leasebmaps_req {
+	struct sl_fidgen	fg;
+	sl_ios_id_t		prefios[NPREFIOS];/* client's preferred IOS ID */
+	sl_bmapno_t		bmapno;		/* first bmap index number */
+	 int32_t		count;		/* # of bmaps wanted */
+	 int32_t		rw;		/* 'enum rw' value for access */
+	uint32_t		flags;		/* see SRM_LEASEBMAPF_* */
+} __packed;
+
+struct srm_leasebmaps_ent {
+	struct srt_bmapdesc	sbd;		/* descriptor for bmap */
+	uint8_t			repls[SL_REPLICA_NBYTES];
+	 int32_t		rc;
+	 int32_t		_pad;
+} __packed;
+
+struct srm_leasebmaps_rep {
+	 int32_t		rc;		/* 0 if any lease was granted */
+	 int32_t		nbmaps;		/* # of leases granted */
+	uint32_t		flags;		/* return SRM_LEASEBMAPF_* success */
+	 int32_t		_pad;
+	struct srt_inode	ino;		/* if SRM_LEASEBMAPF_GETINODE */
+	struct srm_leasebmaps_ent ents[SRM_LEASEBMAPS_MAX];
+} __packed;
+
 struct srm_leasebmapext_req {
 	struct srt_bmapdesc	sbd;
 } __packed;
@@ -800,6 +835,7 @@ struct srm_create_req {
 	sl_ios_id_t		prefios[NPREFIOS];/* preferred I/O system ID */
 	uint32_t		flags;		/* see SRM_BMAPF_* flags */
 	 int32_t		_pad;
+	uint64_t		fid;		/* FID from SRMT_RESERVE_FID or 0 */
 } __packed;
 
 struct srm_create_rep {
@@ -814,6 +850,17 @@ struct srm_create_rep {
 	struct srt_bmapdesc	sbd;
 } __packed;
 
+struct srm_reserve_fid_req {
+	 int32_t		count;		/* # of FIDs wanted */
+	 int32_t		_pad;
+} __packed;
+
+struct srm_reserve_fid_rep {
+	uint64_t		fid;		/* first FID of the range */
+	 int32_t		count;		/* # of FIDs granted */
+	 int32_t		rc;
+} __packed;
+
 struct srm_getattr_req {
 	struct sl_fidgen	fg;
 	sl_ios_id_t		iosid;
@@ -21,9 +21,12 @@
 #include <acl/libacl.h>
 
 #include "pfl/acl.h"
+#include "pfl/alloc.h"
 #include "pfl/cdefs.h"
 #include "pfl/fs.h"
+#include "pfl/opstats.h"
 
+#include "fidc_cli.h"
 #include "fidcache.h"
 #include "mount_slash.h"
 
@@ -31,11 +34,49 @@
 #define ACL_EA_ACCESS	"system.posix_acl_access"
 
 /*
- * Pull POSIX ACLs from an fcmh via RPCs to MDS.
+ * A POSIX ACL flattened out of its libacl representation so access
+ * checks are a walk over a small array, plus a direct-mapped cache of
+ * recent decisions.  It is only valid for the ctime and generation the
+ * ACL was fetched under, as every chmod, chown, or setxattr bumps the
+ * ctime on the MDS.
  */
-acl_t
-slc_acl_get_fcmh(struct pscfs_req *pfr, __unusedx const struct pscfs_creds *pcr,
-    struct fidc_membh *f)
+#define SLC_ACL_NDECISIONS	8
+
+/*
+ * Decisions are keyed on the exact credentials they were made for;
+ * callers with more supplementary groups than fit are never cached.
+ */
+#define SLC_ACL_DECISION_NGID	16
+
+struct slc_acl_ent {
+	acl_tag_t		 sae_tag;
+	uint32_t		 sae_id;	/* ACL_USER/ACL_GROUP only */
+	int			 sae_perm;	/* R_OK | W_OK | X_OK */
+};
+
+struct slc_acl_decision {
+	uint32_t		 sad_uid;
+	uint32_t		 sad_gid;
+	int			 sad_ngid;
+	int			 sad_accmode;	/* 0 means unused */
+	int			 sad_rc;
+	gid_t			 sad_gidv[SLC_ACL_DECISION_NGID];
+};
+
+struct slc_acl {
+	struct pfl_timespec	 sa_ctim;
+	uint64_t		 sa_gen;
+	int			 sa_nents;	/* 0 means no ACL */
+	struct slc_acl_decision	 sa_decisions[SLC_ACL_NDECISIONS];
+	struct slc_acl_ent	 sa_ents[0];
+};
+
+/*
+ * Pull POSIX ACLs from an fcmh via RPCs to MDS.  *rcp is set to
+ * ENODATA if the file has no ACL.
+ */
+static acl_t
+slc_acl_fetch(struct pscfs_req *pfr, struct fidc_membh *f, int *rcp)
 {
 	char trybuf[ACL_DEF_SIZE] = { 0 };
 	void *buf = NULL;
@@ -66,66 +107,122 @@ slc_acl_get_fcmh(struct pscfs_req *pfr, __unusedx const struct pscfs_creds *pcr,
 
  out:
 
-	if (!rc)
+	if (!rc) {
 		a = pfl_acl_from_xattr(buf, retsz);
+		if (a == NULL)
+			rc = EINVAL;
+	}
 
 	if (buf != trybuf)
 		PSCFREE(buf);
+	*rcp = rc;
 	return (a);
 }
 
+acl_t
+slc_acl_get_fcmh(struct pscfs_req *pfr, __unusedx const struct pscfs_creds *pcr,
+    struct fidc_membh *f)
+{
+	int rc;
+
+	return (slc_acl_fetch(pfr, f, &rc));
+}
+
+static int
+slc_acl_permset(acl_entry_t e)
+{
+	acl_permset_t set;
+	int perm = 0;
+
+	if (acl_get_permset(e, &set) == -1) {
+		psclog_error("acl_get_permset");
+		return (0);
+	}
+	if (acl_get_perm(set, ACL_READ) == 1)
+		perm |= R_OK;
+	if (acl_get_perm(set, ACL_WRITE) == 1)
+		perm |= W_OK;
+	if (acl_get_perm(set, ACL_EXECUTE) == 1)
+		perm |= X_OK;
+	return (perm);
+}
+
+/*
+ * Flatten an ACL into a slc_acl.  A NULL @a yields the no-ACL marker.
+ */
+static struct slc_acl *
+slc_acl_compile(acl_t a)
+{
+	struct slc_acl_ent *sae;
+	struct slc_acl *sa;
+	acl_entry_t e;
+	int wh, n, rc;
+	void *q;
+
+	n = a ? acl_entries(a) : 0;
+	if (n < 0)
+		n = 0;
+	sa = PSCALLOC(sizeof(*sa) + n * sizeof(*sae));
+	if (a == NULL)
+		return (sa);
+
+	wh = ACL_FIRST_ENTRY;
+	while (sa->sa_nents < n &&
+	    (rc = acl_get_entry(a, wh, &e)) == 1) {
+		wh = ACL_NEXT_ENTRY;
+
+		sae = &sa->sa_ents[sa->sa_nents];
+		if (acl_get_tag_type(e, &sae->sae_tag) == -1) {
+			psclog_error("acl_get_tag_type");
+			continue;
+		}
+		if (sae->sae_tag == ACL_USER ||
+		    sae->sae_tag == ACL_GROUP) {
+			q = acl_get_qualifier(e);
+			if (q == NULL) {
+				psclog_error("acl_get_qualifier");
+				continue;
+			}
+			sae->sae_id = sae->sae_tag == ACL_USER ?
+			    *(uid_t *)q : *(gid_t *)q;
+			acl_free(q);
+		}
+		sae->sae_perm = slc_acl_permset(e);
+		sa->sa_nents++;
+	}
+	return (sa);
+}
+
 #define ACL_SET_PRECEDENCE(level, prec, e, authz)			\
 	if ((level) < (prec)) {						\
 		(authz) = (e);						\
 		(prec) = (level);					\
 	}
 
-#define ACL_PERM(set, perm)	(acl_get_perm(set, perm) < 1)
-
 #define ACL_AUTH(e, mode)						\
-	_PFL_RVSTART {							\
-		acl_permset_t _set;					\
-		int _rv = EACCES;					\
-									\
-		if (acl_get_permset((e), &_set) == -1) {		\
-			psclog_error("acl_get_permset");		\
-		} else if (						\
-		    (((mode) & R_OK) && ACL_PERM(_set, ACL_READ)) ||	\
-		    (((mode) & W_OK) && ACL_PERM(_set, ACL_WRITE)) ||	\
-		    (((mode) & X_OK) && ACL_PERM(_set, ACL_EXECUTE))) {	\
-		} else							\
-			_rv = 0;					\
-		(_rv);							\
-	} _PFL_RVEND
+	(((mode) & ~(e)->sae_perm & (R_OK | W_OK | X_OK)) ? EACCES : 0)
 
 /* subtle: || 1 is there in case gid is zero to avoid premature exit */
 #define FOREACH_GROUP(g, i, pcrp)					\
 	for ((i) = 0; (i) <= (pcrp)->pcr_ngid && (((g) = (i) == 0 ?	\
 	    (pcrp)->pcr_gid : (pcrp)->pcr_gidv[(i) - 1]) || 1); (i)++)
 
-int
-sl_checkacls(acl_t a, struct srt_stat *sstb,
+static int
+sl_checkacls(const struct slc_acl *sa, struct srt_stat *sstb,
     const struct pscfs_creds *pcrp, int accmode)
 {
-	int wh, rv = EACCES, i, rc, prec = 6;
-	acl_entry_t e, authz = NULL, mask = NULL;
-	acl_tag_t tag;
-	gid_t *gp, g;
-	uid_t *up;
+	const struct slc_acl_ent *e, *authz = NULL, *mask = NULL;
+	int rv = EACCES, i, j, prec = 6;
+	gid_t g;
 
-	wh = ACL_FIRST_ENTRY;
-	while ((rc = acl_get_entry(a, wh, &e)) == 1) {
-		wh = ACL_NEXT_ENTRY;
-
-		rc = acl_get_tag_type(e, &tag);
-		switch (tag) {
+	for (j = 0, e = sa->sa_ents; j < sa->sa_nents; j++, e++) {
+		switch (e->sae_tag) {
 		case ACL_USER_OBJ:
 			if (sstb->sst_uid == pcrp->pcr_uid)
 				ACL_SET_PRECEDENCE(1, prec, e, authz);
 			break;
 		case ACL_USER:
-			up = acl_get_qualifier(e);
-			if (*up == pcrp->pcr_uid)
+			if (e->sae_id == pcrp->pcr_uid)
 				ACL_SET_PRECEDENCE(2, prec, e, authz);
 			break;
 
@@ -138,9 +235,8 @@ sl_checkacls(acl_t a, struct srt_stat *sstb,
 				}
 			break;
 		case ACL_GROUP:
-			gp = acl_get_qualifier(e);
 			FOREACH_GROUP(g, i, pcrp)
-				if (g == *gp) {
+				if (g == e->sae_id) {
 					ACL_SET_PRECEDENCE(4, prec, e,
 					    authz);
 					break;
@@ -160,9 +256,7 @@ sl_checkacls(acl_t a, struct srt_stat *sstb,
 			break;
 		}
 	}
-	if (rc == -1)
-		psclog_error("acl_get_entry");
-	else if (authz) {
+	if (authz) {
 		rv = ACL_AUTH(authz, accmode);
 		if (prec != 1 && prec != 5 &&
 		    rv == 0 && mask)
@@ -175,23 +269,124 @@ sl_checkacls(acl_t a, struct srt_stat *sstb,
 	return (rv);
 }
 
+/* Only picks a decision slot; matches compare the full credentials. */
+static uint32_t
+slc_acl_grphash(const struct pscfs_creds *pcrp)
+{
+	uint32_t h = 0;
+	int i;
+	gid_t g;
+
+	FOREACH_GROUP(g, i, pcrp)
+		h = h * 31 + g;
+	return (h ^ pcrp->pcr_ngid);
+}
+
+static __inline int
+slc_acl_decision_match(const struct slc_acl_decision *sad,
+    const struct pscfs_creds *pcrp, int accmode)
+{
+	int i;
+
+	if (sad->sad_accmode != accmode ||
+	    sad->sad_uid != pcrp->pcr_uid ||
+	    sad->sad_gid != pcrp->pcr_gid ||
+	    sad->sad_ngid != pcrp->pcr_ngid)
+		return (0);
+	for (i = 0; i < sad->sad_ngid; i++)
+		if (sad->sad_gidv[i] != pcrp->pcr_gidv[i])
+			return (0);
+	return (1);
+}
+
+static __inline int
+slc_acl_current(const struct slc_acl *sa, const struct fidc_membh *f)
+{
+	return (sa->sa_gen == fcmh_2_gen(f) &&
+	    sa->sa_ctim.tv_sec == f->fcmh_sstb.sst_ctime &&
+	    sa->sa_ctim.tv_nsec == f->fcmh_sstb.sst_ctime_ns);
+}
+
+/*
+ * Evaluate an access check against a compiled ACL, answering from the
+ * decision cache when possible.  The fcmh must be locked.
+ */
+static int
+slc_acl_decide(struct slc_acl *sa, struct fidc_membh *f,
+    const struct pscfs_creds *pcrp, uint32_t grphash, int accmode)
+{
+	struct slc_acl_decision *sad;
+	int i, rc;
+
+	sad = &sa->sa_decisions[(pcrp->pcr_uid ^ grphash ^ accmode) %
+	    SLC_ACL_NDECISIONS];
+	if (slc_acl_decision_match(sad, pcrp, accmode)) {
+		OPSTAT_INCR("msl.acl-decision-hit");
+		return (sad->sad_rc);
+	}
+
+	if (sa->sa_nents)
+		rc = sl_checkacls(sa, &f->fcmh_sstb, pcrp, accmode);
+	else {
+		/*
+		 * If there is no ACL entries, we revert to traditional
+		 * Unix mode bits for permission checking.
+		 *
+		 * I have seen small ACL with 28 bytes that does not
+		 * refer to other group or user. Should we consider
+		 * such a case as no ACL as well?
+		 */
+#ifdef SLOPT_POSIX_ACLS_REVERT
+		rc = checkcreds(&f->fcmh_sstb, pcrp, accmode);
+#else
+		rc = EACCES;
+#endif
+	}
+
+	if (accmode == 0 || pcrp->pcr_ngid > SLC_ACL_DECISION_NGID) {
+		OPSTAT_INCR("msl.acl-decision-nocache");
+		return (rc);
+	}
+	sad->sad_uid = pcrp->pcr_uid;
+	sad->sad_gid = pcrp->pcr_gid;
+	sad->sad_ngid = pcrp->pcr_ngid;
+	for (i = 0; i < pcrp->pcr_ngid; i++)
+		sad->sad_gidv[i] = pcrp->pcr_gidv[i];
+	sad->sad_accmode = accmode;
+	sad->sad_rc = rc;
+	return (rc);
+}
+
 int
 sl_fcmh_checkacls(struct fidc_membh *f, struct pscfs_req *pfr,
     const struct pscfs_creds *pcrp, int accmode)
 {
+	struct fcmh_cli_info *fci;
+	struct pfl_timespec ctim;
+	struct slc_acl *sa;
+	uint32_t grphash;
 	int locked, rc;
+	uint64_t gen;
 	acl_t a;
 
-	a = slc_acl_get_fcmh(pfr, pcrp, f);
-	/*
-	 * If there is no ACL entries, we revert to traditional
-	 * Unix mode bits for permission checking.
-	 *
-	 * I have seen small ACL with 28 bytes that does not
-	 * refer to other group or user. Should we consider
-	 * such a case as no ACL as well?
-	 */
-	if (a == NULL) {
+	fci = fcmh_2_fci(f);
+	grphash = slc_acl_grphash(pcrp);
+
+	locked = FCMH_RLOCK(f);
+	sa = fci->fci_acl;
+	if (sa && slc_acl_current(sa, f)) {
+		rc = slc_acl_decide(sa, f, pcrp, grphash, accmode);
+		FCMH_URLOCK(f, locked);
+		return (rc);
+	}
+	ctim = f->fcmh_sstb.sst_ctim;
+	gen = fcmh_2_gen(f);
+	FCMH_URLOCK(f, locked);
+
+	OPSTAT_INCR("msl.acl-compile");
+	a = slc_acl_fetch(pfr, f, &rc);
+	if (a == NULL && rc != ENODATA) {
+		/* do not cache transient failures */
 #ifdef SLOPT_POSIX_ACLS_REVERT
 		locked = FCMH_RLOCK(f);
 		rc = checkcreds(&f->fcmh_sstb, pcrp, accmode);
@@ -201,10 +396,17 @@ sl_fcmh_checkacls(struct fidc_membh *f, struct pscfs_req *pfr,
 #endif
 		return (rc);
 	}
+	sa = slc_acl_compile(a);
+	if (a)
+		acl_free(a);
+	sa->sa_ctim = ctim;
+	sa->sa_gen = gen;
+
 	locked = FCMH_RLOCK(f);
-	rc = sl_checkacls(a, &f->fcmh_sstb, pcrp, accmode);
+	PSCFREE(fci->fci_acl);
+	fci->fci_acl = sa;
+	rc = slc_acl_decide(sa, f, pcrp, grphash, accmode);
 	FCMH_URLOCK(f, locked);
-	acl_free(a);
 	return (rc);
 }
 
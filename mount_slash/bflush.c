@@ -31,7 +31,9 @@
 #include <sys/types.h>
 
 #include <stdlib.h>
+#include <unistd.h>
 
+#include "pfl/alloc.h"
 #include "pfl/cdefs.h"
 #include "pfl/completion.h"
 #include "pfl/ctlsvr.h"
@@ -57,7 +59,7 @@
 
 struct timespec			 msl_bflush_timeout = { 2, 0L };
 struct timespec			 msl_bflush_maxage = { 0, 10000000L };	/* 10 milliseconds */
-struct psc_listcache		 msl_bmapflushq;
+struct psc_dynarray		 msl_bmapflushqs = DYNARRAY_INIT;	/* per-IOS */
 struct psc_listcache		 msl_bmaptimeoutq;
 
 int				 msl_max_nretries = 256;
@@ -67,6 +69,7 @@ int				 msl_max_nretries = 256;
 struct pfl_waitq		 slc_bflush_waitq = PFL_WAITQ_INIT("bflush");
 psc_spinlock_t			 slc_bflush_lock = SPINLOCK_INIT;
 int				 slc_bflush_tmout_flags;
+int				 slc_bflush_dead;
 
 psc_atomic32_t			 slc_write_coalesce_max;
 
@@ -78,6 +81,15 @@ bmap_flush_biorq_expired(const struct bmpc_ioreq *a, int force)
 	if (force && (a->biorq_flags & BIORQ_EXPIRE))
 		return (1);
 
+	/*
+	 * Write back without waiting for age only once writers are
+	 * being throttled; below the high watermark let the low
+	 * watermark kick flush aged requests so small writes can still
+	 * coalesce.
+	 */
+	if (force && msl_dirty_over_hiwat())
+		return (1);
+
 	PFL_GETTIMESPEC(&ts);
 	/* XXX timespeccmp(&a->biorq_expire, &ts, <) */
 	if ((a->biorq_expire.tv_sec < ts.tv_sec ||
@@ -147,10 +159,13 @@ bmap_free_all_locked(struct fidc_membh *f)
 
 
 /*
- * Pin (mark read-only) all pages attached to a bmap write coalescer.
+ * Close the current write window of all pages attached to a bmap write
+ * coalescer right before they are put on the wire.  Writers are free
+ * to dirty the pages again, in a copy of the buffer we record here;
+ * their biorqs go out in the next window.
  */
 void
-bwc_pin_pages(struct bmpc_write_coalescer *bwc)
+bwc_wnd_close(struct bmpc_write_coalescer *bwc)
 {
 	struct bmap_pagecache_entry *pg;
 	int i;
@@ -158,26 +173,36 @@ bwc_pin_pages(struct bmpc_write_coalescer *bwc)
 	for (i = 0; i < bwc->bwc_nbmpces; i++) {
 		pg = bwc->bwc_bmpces[i];
 		BMPCE_LOCK(pg);
-		pg->bmpce_pins++;
+		pfl_assert(!BMPCE_WND_BUSY(pg));
+		pg->bmpce_wseq++;
+		pg->bmpce_wnd_entry = pg->bmpce_entry;
 		BMPCE_ULOCK(pg);
 	}
 }
 
 /*
- * Unpin (release) all pages attached to a bmap write coalescer.
+ * Mark the write window of all pages attached to a bmap write
+ * coalescer as processed, opening the pages to the next RPC.  Buffers
+ * replaced by writers while on the wire are released.
  */
 void
-bwc_unpin_pages(struct bmpc_write_coalescer *bwc)
+bwc_wnd_done(struct bmpc_write_coalescer *bwc)
 {
 	struct bmap_pagecache_entry *pg;
+	struct bmap_page_entry *old;
 	int i;
 
 	for (i = 0; i < bwc->bwc_nbmpces; i++) {
 		pg = bwc->bwc_bmpces[i];
 		BMPCE_LOCK(pg);
-		pg->bmpce_pins--;
-		BMPCE_WAKE(pg);
+		pg->bmpce_wdone = pg->bmpce_wseq;
+		old = pg->bmpce_wnd_entry;
+		if (old == pg->bmpce_entry)
+			old = NULL;
+		pg->bmpce_wnd_entry = NULL;
 		BMPCE_ULOCK(pg);
+		if (old)
+			msl_pgcache_put(old);
 	}
 }
 
@@ -186,23 +211,127 @@ bmap_flushq_wake(int reason)
 {
 	int wake = 0;
 
-	if (slc_bflush_tmout_flags & BMAPFLSH_RPCWAIT) {
+	if (slc_bflush_tmout_flags & BMAPFLSH_RPCWAIT)
 		wake = 1;
-		if (reason == BMAPFLSH_EXPIRE)
-			pfl_waitq_wakeall(&slc_bflush_waitq);
-		else
-			pfl_waitq_wakeone(&slc_bflush_waitq);
-	}
 
+	/*
+	 * Idle flush workers sleep here whether or not they have any
+	 * RPCs in flight, so always kick the waitq.
+	 */
 	if (reason == BMAPFLSH_EXPIRE)
-		pfl_waitq_wakeall(&msl_bmapflushq.plc_wq_empty);
+		pfl_waitq_wakeall(&slc_bflush_waitq);
 	else
-		pfl_waitq_wakeone(&msl_bmapflushq.plc_wq_empty);
+		pfl_waitq_wakeone(&slc_bflush_waitq);
 
 	psclog_diag("wakeup flusher: reason=%x wake=%d", reason, wake);
 	(void)wake;
 }
 
+__static struct msl_flushq *
+bmap_flushq_lookup(struct bmap *b)
+{
+	struct sl_resm *m;
+
+	m = libsl_ios2resm(bmap_2_ios(b));
+	pfl_assert(res2rpci(m->resm_res)->rpci_flushq);
+	return (res2rpci(m->resm_res)->rpci_flushq);
+}
+
+/*
+ * Queue a bmap with pending writes on the flush queue of the IOS that
+ * holds its write lease.
+ */
+void
+bmap_flushq_add(struct bmap *b)
+{
+	struct bmap_cli_info *bci = bmap_2_bci(b);
+
+	BMAP_LOCK_ENSURE(b);
+	pfl_assert(!(b->bcm_flags & BMAPF_FLUSHQ));
+
+	b->bcm_flags |= BMAPF_FLUSHQ;
+	bci->bci_flushq = bmap_flushq_lookup(b);
+	lc_addtail(&bci->bci_flushq->mfq_bmaps, b);
+}
+
+void
+bmap_flushq_remove(struct bmap *b)
+{
+	struct bmap_cli_info *bci = bmap_2_bci(b);
+
+	BMAP_LOCK_ENSURE(b);
+	pfl_assert(b->bcm_flags & BMAPF_FLUSHQ);
+
+	b->bcm_flags &= ~BMAPF_FLUSHQ;
+	lc_remove(&bci->bci_flushq->mfq_bmaps, b);
+	bci->bci_flushq = NULL;
+}
+
+/*
+ * If the write lease of a queued bmap was reassigned to another IOS,
+ * move the bmap over so it is flushed under that IOS's credits.
+ * Returns whether the bmap was moved.
+ */
+int
+bmap_flushq_requeue(struct bmap *b)
+{
+	struct bmap_cli_info *bci = bmap_2_bci(b);
+	struct msl_flushq *q;
+
+	BMAP_LOCK_ENSURE(b);
+	if (!(b->bcm_flags & BMAPF_FLUSHQ))
+		return (0);
+	q = bmap_flushq_lookup(b);
+	if (q == bci->bci_flushq)
+		return (0);
+	lc_remove(&bci->bci_flushq->mfq_bmaps, b);
+	bci->bci_flushq = q;
+	lc_addtail(&q->mfq_bmaps, b);
+	OPSTAT_INCR("msl.bmap-flush-requeue");
+	return (1);
+}
+
+int
+bmap_flushq_nitems(void)
+{
+	struct msl_flushq *q;
+	int i, n = 0;
+
+	DYNARRAY_FOREACH(q, i, &msl_bmapflushqs)
+		n += lc_nitems(&q->mfq_bmaps);
+	return (n);
+}
+
+/*
+ * Stop the flush workers once every queue has drained.
+ */
+void
+bmap_flushq_drain(void)
+{
+	spinlock(&slc_bflush_lock);
+	slc_bflush_dead = 1;
+	freelock(&slc_bflush_lock);
+
+	while (bmap_flushq_nitems()) {
+		bmap_flushq_wake(BMAPFLSH_EXPIRE);
+		usleep(1000);
+	}
+	bmap_flushq_wake(BMAPFLSH_EXPIRE);
+}
+
+void
+bmap_flushq_destroy(void)
+{
+	struct msl_flushq *q;
+	int i;
+
+	DYNARRAY_FOREACH(q, i, &msl_bmapflushqs) {
+		pfl_listcache_destroy_registered(&q->mfq_bmaps);
+		PSCFREE(q);
+	}
+	psc_dynarray_free(&msl_bmapflushqs);
+}
+
 /*
  * Callback run after a WRITE is recieved by an IOS.
  */
@@ -224,7 +353,7 @@ msl_ric_bflush_cb(struct pscrpc_request *rq,
 	    bwc, m->resm_res_id, rpci->rpci_infl_rpcs, rc);
 	(void)rpci;
 
-	bwc_unpin_pages(bwc);
+	bwc_wnd_done(bwc);
 
 	DYNARRAY_FOREACH(r, i, &bwc->bwc_biorqs) {
 		if (rc) {
@@ -239,6 +368,9 @@ msl_ric_bflush_cb(struct pscrpc_request *rq,
 	bwc_free(bwc);
 	sl_csvc_decref(csvc);
 
+	/* let biorqs held back for the next window go out */
+	bmap_flushq_wake(BMAPFLSH_RPCWAIT);
+
 	return (0);
 }
 
@@ -280,7 +412,7 @@ bmap_flush_create_rpc(struct bmpc_write_coalescer *bwc,
 	    m->resm_res_id, SLPRI_FG_ARGS(&mq->sbd.sbd_fg), mq->offset,
 	    mq->size, bmap_2_ios(b), rpci->rpci_infl_rpcs);
 
-	bwc_pin_pages(bwc);
+	bwc_wnd_close(bwc);
 
 	rq->rq_interpret_reply = msl_ric_bflush_cb;
 	rq->rq_async_args.pointer_arg[MSL_CBARG_CSVC] = csvc;
@@ -290,7 +422,7 @@ bmap_flush_create_rpc(struct bmpc_write_coalescer *bwc,
 	if (!rc)
 		return (0);
 
-	bwc_unpin_pages(bwc);
+	bwc_wnd_done(bwc);
 
  out:
 	if (rq)
@@ -649,6 +781,18 @@ bmap_flush_trycoalesce(const struct psc_dynarray *biorqs, int *indexp)
 
 	pfl_assert(psc_dynarray_len(biorqs) > *indexp);
 
+	/*
+	 * Skip over biorqs whose pages are still on the wire.  They
+	 * are picked up, together with any later writes to the same
+	 * pages, once the pending window is acknowledged.
+	 */
+	while (bmpc_biorq_wnd_busy(psc_dynarray_getpos(biorqs,
+	    *indexp))) {
+		OPSTAT_INCR("msl.bmap-flush-wait-window");
+		if (++*indexp == psc_dynarray_len(biorqs))
+			return (NULL);
+	}
+
 	bwc = bwc_alloc();
 
 	for (idx = 0; idx + *indexp < psc_dynarray_len(biorqs);
@@ -659,6 +803,10 @@ bmap_flush_trycoalesce(const struct psc_dynarray *biorqs, int *indexp)
 			OPSTAT_INCR("msl.bmap-flush-wait-retry");
 			break;
 		}
+		if (idx && bmpc_biorq_wnd_busy(curr)) {
+			OPSTAT_INCR("msl.bmap-flush-wait-window");
+			break;
+		}
 
 		/*
 		 * If any member is expired then we'll push everything
@@ -747,20 +895,28 @@ bmap_flush_trycoalesce(const struct psc_dynarray *biorqs, int *indexp)
 
 
 /*
- * Send out SRMT_WRITE RPCs to the I/O server.
+ * Pick bmaps to flush from one per-IOS queue.  The number taken is
+ * bounded by the RPC credits the IOS has left, so a throttled sliod
+ * contributes nothing and is skipped instead of stalling the worker.
  */
-__static int
-bmap_flush(struct psc_dynarray *reqs, struct psc_dynarray *bmaps)
+__static void
+bmap_flushq_gather(struct msl_flushq *q, struct psc_dynarray *bmaps)
 {
-	struct bmpc_write_coalescer *bwc;
-	struct bmap_pagecache *bmpc;
-	struct bmpc_ioreq *r;
 	struct bmap *b, *tmpb;
-	int i, j, rc, didwork = 0;
 	struct sl_resm *m;
+	int rc, n = 0, share;
 
-	LIST_CACHE_LOCK(&msl_bmapflushq);
-	LIST_CACHE_FOREACH_SAFE(b, tmpb, &msl_bmapflushq) {
+	if (!lc_nitems(&q->mfq_bmaps))
+		return;
+
+	share = msl_resm_throttle_avail(q->mfq_resm);
+	if (!share) {
+		OPSTAT_INCR("msl.bmap-flush-ios-throttled");
+		return;
+	}
+
+	LIST_CACHE_LOCK(&q->mfq_bmaps);
+	LIST_CACHE_FOREACH_SAFE(b, tmpb, &q->mfq_bmaps) {
 
 		DEBUG_BMAP(PLL_DIAG, b, "flushable?");
 
@@ -778,6 +934,7 @@ bmap_flush(struct psc_dynarray *reqs, struct psc_dynarray *bmaps)
 			b->bcm_flags |= BMAPF_SCHED;
 			psc_dynarray_add(bmaps, b);
 			bmap_op_start_type(b, BMAP_OPCNT_FLUSH);
+			n++;
 			goto add;
 		}
 
@@ -787,13 +944,51 @@ bmap_flush(struct psc_dynarray *reqs, struct psc_dynarray *bmaps)
 			b->bcm_flags |= BMAPF_SCHED;
 			psc_dynarray_add(bmaps, b);
 			bmap_op_start_type(b, BMAP_OPCNT_FLUSH);
+			n++;
 		}
  add:
 		BMAP_ULOCK(b);
-		if (psc_dynarray_len(bmaps) >= msl_ios_max_inflight_rpcs)
+		if (n >= share ||
+		    psc_dynarray_len(bmaps) >= msl_ios_max_inflight_rpcs)
 			break;
 	}
-	LIST_CACHE_ULOCK(&msl_bmapflushq);
+	LIST_CACHE_ULOCK(&q->mfq_bmaps);
+}
+
+/*
+ * Send out SRMT_WRITE RPCs to the I/O server.  Each pass services a
+ * single IOS: the worker's home queue if it has flushable bmaps,
+ * otherwise the first other queue that does (work stealing).  This
+ * way a worker blocked on one sliod's credits only delays bmaps bound
+ * for that sliod.
+ */
+__static int
+bmap_flush(struct msflush_thread *mflt, struct psc_dynarray *reqs,
+    struct psc_dynarray *bmaps)
+{
+	struct bmpc_write_coalescer *bwc;
+	struct bmap_pagecache *bmpc;
+	struct msl_flushq *q;
+	struct bmpc_ioreq *r;
+	struct bmap *b;
+	int i, j, k, n, rc, didwork = 0;
+
+	n = psc_dynarray_len(&msl_bmapflushqs);
+	for (k = 0; k < n && !psc_dynarray_len(bmaps); k++) {
+		q = psc_dynarray_getpos(&msl_bmapflushqs,
+		    (mflt->mflt_home + k) % n);
+		bmap_flushq_gather(q, bmaps);
+		if (k && psc_dynarray_len(bmaps))
+			OPSTAT_INCR("msl.bmap-flush-steal");
+	}
+
+	/*
+	 * With more IOSes than workers, rotate the home queues so each
+	 * IOS gets a dedicated worker from time to time.
+	 */
+	if (n > NUM_BMAP_FLUSH_THREADS)
+		mflt->mflt_home = (mflt->mflt_home +
+		    NUM_BMAP_FLUSH_THREADS) % n;
 
 	for (i = 0; i < psc_dynarray_len(bmaps); i++) {
 		b = psc_dynarray_getpos(bmaps, i);
@@ -830,6 +1025,7 @@ bmap_flush(struct psc_dynarray *reqs, struct psc_dynarray *bmaps)
 		psc_dynarray_reset(reqs);
 
  next:
+		bmap_flushq_requeue(b);
 		b->bcm_flags &= ~BMAPF_SCHED;
 		bmap_op_done_type(b, BMAP_OPCNT_FLUSH);
 	}
@@ -857,13 +1053,19 @@ msflushthr_main(struct psc_thread *thr)
 		mflt->mflt_failcnt = 1;
 
 		/* wait until some work appears */
-		if (lc_peekheadwait(&msl_bmapflushq) == NULL)
-			break;
+		if (!bmap_flushq_nitems()) {
+			if (slc_bflush_dead)
+				break;
+			spinlock(&slc_bflush_lock);
+			pfl_waitq_waitrel_ts(&slc_bflush_waitq,
+			    &slc_bflush_lock, &msl_bflush_timeout);
+			continue;
+		}
 
 		OPSTAT_INCR("msl.bmap-flush");
 
 		PFL_GETTIMESPEC(&tmp1);
-		while (bmap_flush(&reqs, &bmaps))
+		while (bmap_flush(mflt, &reqs, &bmaps))
 			;
 		PFL_GETTIMESPEC(&tmp2);
 
@@ -910,13 +1112,24 @@ void
 msbmapthr_spawn(void)
 {
 	struct msflush_thread *mflt;
+	struct msl_flushq *q;
 	struct psc_thread *thr;
+	struct sl_resource *r;
+	struct sl_site *s;
 	int i;
 
 	pfl_waitq_init(&slc_bflush_waitq, "bmap-flush");
 
-	lc_reginit(&msl_bmapflushq, struct bmap,
-	    bcm_lentry, "bmapflushq");
+	CONF_FOREACH_RES(s, r, i) {
+		if (r->res_type == SLREST_MDS)
+			continue;
+		q = PSCALLOC(sizeof(*q));
+		q->mfq_resm = res_getmemb(r);
+		lc_reginit(&q->mfq_bmaps, struct bmap, bcm_lentry,
+		    "bmapflushq-%s", r->res_name);
+		res2rpci(r)->rpci_flushq = q;
+		psc_dynarray_add(&msl_bmapflushqs, q);
+	}
 
 	lc_reginit(&msl_bmaptimeoutq, struct bmap_cli_info,
 	    bci_lentry, "bmaptimeout");
@@ -925,6 +1138,9 @@ msbmapthr_spawn(void)
 		thr = pscthr_init(MSTHRT_FLUSH, msflushthr_main,
 		    sizeof(struct msflush_thread), "msflushthr%d", i);
 		mflt = msflushthr(thr);
+		mflt->mflt_home = i;
+		if (psc_dynarray_len(&msl_bmapflushqs))
+			mflt->mflt_home %= psc_dynarray_len(&msl_bmapflushqs);
 		pfl_multiwait_init(&mflt->mflt_mw, "%s",
 		    thr->pscthr_name);
 		pscthr_setready(thr);
@@ -30,6 +30,7 @@
 #include "pfl/random.h"
 #include "pfl/rpc.h"
 
+#include "batchrpc.h"
 #include "bmap_cli.h"
 #include "fidc_cli.h"
 #include "mount_slash.h"
@@ -61,8 +62,19 @@ enum {
 	MSL_BMLGET_CBARG_CSVC
 };
 
+enum {
+	MSL_BMLGETS_CBARG_BMAPS,
+	MSL_BMLGETS_CBARG_CSVC
+};
+
 int slc_bmap_max_cache = BMAP_CACHE_MAX;
 
+/*
+ * Lease extensions sent per batch RPC by the bmap watcher thread, zero
+ * sends one RPC per bmap.
+ */
+int msl_bmap_extend_batch = 256;
+
 /*
  * Easy debugging with separate lock/wait combo.
  */
@@ -146,7 +158,19 @@ slc_reptbl_cmp(const void *a, const void *b, void *arg)
 	/* try degraded IOS */
 	xv = res2rpci(xr)->rpci_flags & RPCIF_AVOID ? 1 : -1;
 	yv = res2rpci(yr)->rpci_flags & RPCIF_AVOID ? 1 : -1;
-	return (CMP(xv, yv));
+	rc = CMP(xv, yv);
+	if (rc)
+		return (rc);
+
+	/* try reachable IOS */
+	xv = msl_res_isdown(xr) ? 1 : -1;
+	yv = msl_res_isdown(yr) ? 1 : -1;
+	rc = CMP(xv, yv);
+	if (rc)
+		return (rc);
+
+	/* try the fastest IOS, or one whose estimate is stale */
+	return (CMP(msl_res_cost(xr), msl_res_cost(yr)));
 }
 
 /*
@@ -407,6 +431,153 @@ msl_bmap_retrieve(struct bmap *b, int flags)
 	return (rc);
 }
 
+__static int
+msl_bmap_lease_ahead_cb(struct pscrpc_request *rq,
+    struct pscrpc_async_args *args)
+{
+	struct slrpc_cservice *csvc =
+	    args->pointer_arg[MSL_BMLGETS_CBARG_CSVC];
+	struct psc_dynarray *a = args->pointer_arg[MSL_BMLGETS_CBARG_BMAPS];
+	struct srm_leasebmaps_rep *mp;
+	struct srm_leasebmaps_ent *e;
+	struct bmap_cli_info *bci;
+	struct fidc_membh *f;
+	struct bmap *b;
+	int i, rc, n = 0;
+
+	SL_GET_RQ_STATUS(csvc, rq, mp, rc);
+
+	if (!rc) {
+		n = MIN(mp->nbmaps, psc_dynarray_len(a));
+		b = psc_dynarray_getpos(a, 0);
+		f = b->bcm_fcmh;
+		FCMH_LOCK(f);
+		msl_fcmh_stash_inode(f, &mp->ino);
+		FCMH_ULOCK(f);
+	}
+
+	DYNARRAY_FOREACH(b, i, a) {
+		e = i < n ? &mp->ents[i] : NULL;
+		if (e && e->sbd.sbd_bmapno == b->bcm_bmapno) {
+			bci = bmap_2_bci(b);
+			BMAP_LOCK(b);
+			msl_bmap_stash_lease(b, &e->sbd, "get-ahead");
+			memcpy(bci->bci_repls, e->repls, sizeof(e->repls));
+			msl_bmap_reap_init(b);
+
+			b->bcm_flags |= BMAPF_LOADED;
+		} else {
+			/* whoever needs it will retrieve it on its own */
+			msl_bmap_cache_rls(b);
+			BMAP_LOCK(b);
+		}
+		b->bcm_flags &= ~BMAPF_LOADING;
+		bmap_op_done_type(b, BMAP_OPCNT_ASYNC);
+	}
+	OPSTAT_ADD("msl.bmap-lease-ahead-got", n);
+
+	psc_dynarray_free(a);
+	PSCFREE(a);
+	sl_csvc_decref(csvc);
+	return (0);
+}
+
+/*
+ * Retrieve in the background, with a single SRMT_GETBMAPS, the leases
+ * of up to @n bmaps starting at @bno that are not cached yet.  Cached
+ * bmaps at the start of the range are skipped and the range stops at
+ * the next cached one, so a sequential stream that keeps calling this
+ * ahead of itself only asks for what it has not got.
+ *
+ * @f: file.
+ * @bno: first bmap of the range.
+ * @n: number of bmaps in the range.
+ * @rw: read or write access.
+ */
+void
+msl_bmap_lease_ahead(struct fidc_membh *f, sl_bmapno_t bno, int n,
+    enum rw rw)
+{
+	struct slrpc_cservice *csvc = NULL;
+	struct pscrpc_request *rq = NULL;
+	struct srm_leasebmaps_req *mq;
+	struct srm_leasebmaps_rep *mp;
+	struct fcmh_cli_info *fci;
+	struct psc_dynarray *a;
+	struct bmap *b;
+	int i, rc;
+
+	a = PSCALLOC(sizeof(*a));
+	psc_dynarray_init(a);
+	for (i = 0; i < n &&
+	    psc_dynarray_len(a) < SRM_LEASEBMAPS_MAX; i++) {
+		rc = bmap_getf(f, bno + i, rw, BMAPGETF_CREATE |
+		    BMAPGETF_NORETRIEVE | BMAPGETF_NONBLOCK, &b);
+		if (rc)
+			break;
+		if (b->bcm_flags & (BMAPF_LOADING | BMAPF_LOADED)) {
+			bmap_op_done(b);
+			if (psc_dynarray_len(a))
+				break;
+			continue;
+		}
+		b->bcm_flags |= BMAPF_LOADING;
+		bmap_op_start_type(b, BMAP_OPCNT_ASYNC);
+		bmap_op_done(b);
+		psc_dynarray_add(a, b);
+	}
+	if (!psc_dynarray_len(a)) {
+		OPSTAT_INCR("msl.bmap-lease-ahead-cached");
+		rc = 0;
+		goto out;
+	}
+
+	fci = fcmh_2_fci(f);
+	rc = slc_rmc_getcsvc(fci->fci_resm, &csvc, 0);
+	if (!rc && csvc == NULL)
+		rc = ENOTCONN;
+	if (rc)
+		goto out;
+	rc = SL_RSX_NEWREQ(csvc, SRMT_GETBMAPS, rq, mq, mp);
+	if (rc)
+		goto out;
+
+	b = psc_dynarray_getpos(a, 0);
+	mq->fg = f->fcmh_fg;
+	mq->prefios[0] = msl_pref_ios;
+	mq->bmapno = b->bcm_bmapno;
+	mq->count = psc_dynarray_len(a);
+	mq->rw = rw;
+	mq->flags = SRM_LEASEBMAPF_GETINODE | SRM_LEASEBMAPF_NODIO;
+
+	DEBUG_FCMH(PLL_DIAG, f, "retrieving bmaps (bmapno=%u count=%d)",
+	    mq->bmapno, mq->count);
+
+	rq->rq_async_args.pointer_arg[MSL_BMLGETS_CBARG_BMAPS] = a;
+	rq->rq_async_args.pointer_arg[MSL_BMLGETS_CBARG_CSVC] = csvc;
+	rq->rq_interpret_reply = msl_bmap_lease_ahead_cb;
+	rc = SL_NBRQSET_ADD(csvc, rq);
+	if (!rc) {
+		OPSTAT_INCR("msl.bmap-lease-ahead");
+		return;
+	}
+
+ out:
+	if (rq)
+		pscrpc_req_finished(rq);
+	if (csvc)
+		sl_csvc_decref(csvc);
+	DYNARRAY_FOREACH(b, i, a) {
+		BMAP_LOCK(b);
+		b->bcm_flags &= ~BMAPF_LOADING;
+		bmap_op_done_type(b, BMAP_OPCNT_ASYNC);
+	}
+	psc_dynarray_free(a);
+	PSCFREE(a);
+	if (rc)
+		OPSTAT_INCR("msl.bmap-lease-ahead-err");
+}
+
 __static int
 msl_bmap_lease_extend_cb(struct pscrpc_request *rq,
     struct pscrpc_async_args *args)
@@ -583,6 +754,123 @@ msl_bmap_lease_extend(struct bmap *b, int blocking)
 	return (rc);
 }
 
+struct msl_extend_pending {
+	struct bmap		*xp_bmap;
+	struct timespec		 xp_start;	/* when it was queued */
+};
+
+/*
+ * Apply the reply to one lease extension of a batch, or fail it.
+ */
+void
+msl_bmap_lease_extend_batch_cb(__unusedx void *req, void *rep,
+    void *scratch, int rc)
+{
+	struct msl_extend_pending *xp = scratch;
+	struct srm_leasebmapext_rep *mp = rep;
+	struct bmap *b = xp->xp_bmap;
+	struct bmap_cli_info *bci = bmap_2_bci(b);
+	struct timespec ts;
+
+	if (!rc && mp == NULL)
+		rc = EINVAL;
+	if (!rc)
+		rc = -mp->rc;
+
+	PFL_GETTIMESPEC(&ts);
+	timespecsub(&ts, &xp->xp_start, &ts);
+	OPSTAT_ADD("msl.bmap-extend-batch-usecs",
+	    ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+
+	BMAP_LOCK(b);
+	pfl_assert(b->bcm_flags & BMAPF_LEASEEXTREQ);
+	if (!rc) {
+		msl_bmap_stash_lease(b, &mp->sbd, "extend");
+		lc_move2tail(&msl_bmaptimeoutq, bci);
+		OPSTAT_INCR("msl.bmap-extend-batch-ok");
+	} else {
+		msl_bmap_cache_rls(b);
+		OPSTAT_INCR("msl.bmap-extend-batch-err");
+	}
+	b->bcm_flags &= ~(BMAPF_LEASEEXTREQ | BMAPF_LOADING);
+	bmap_op_done_type(b, BMAP_OPCNT_ASYNC);
+}
+
+struct slrpc_batch_rep_handler msl_batch_rep_extendbmapls = {
+	msl_bmap_lease_extend_batch_cb,
+	sizeof(struct srm_leasebmapext_req),
+	sizeof(struct srm_leasebmapext_rep)
+};
+
+/*
+ * Queue the extension of a bmap lease on the batch RPC to its MDS, for
+ * msbwatchthr_main() which renews all the leases nearing expiry at
+ * once.  @size is the number of extensions the caller is about to
+ * queue, so that the last batch goes out as soon as it fills up.
+ *
+ * Called with the bmap locked; returns with it unlocked.
+ */
+void
+msl_bmap_lease_extend_batch(struct bmap *b, int size)
+{
+	struct slrpc_cservice *csvc = NULL;
+	struct srm_leasebmapext_req mq;
+	struct msl_extend_pending *xp;
+	struct timespec ts;
+	struct sl_resm *m;
+	int rc;
+
+	BMAP_LOCK_ENSURE(b);
+	if (!msl_bmap_extend_batch) {
+		msl_bmap_lease_extend(b, 0);
+		return;
+	}
+
+	/* see msl_bmap_lease_extend() */
+	if (b->bcm_flags & (BMAPF_LEASEEXTREQ | BMAPF_MODECHNG |
+	    BMAPF_LOADING)) {
+		BMAP_ULOCK(b);
+		return;
+	}
+	PFL_GETTIMESPEC(&ts);
+	if (bmap_2_bci(b)->bci_etime.tv_sec - ts.tv_sec >=
+	    BMAP_CLI_EXTREQSECS && !(b->bcm_flags & BMAPF_LEASEEXPIRE)) {
+		BMAP_ULOCK(b);
+		return;
+	}
+	b->bcm_flags |= BMAPF_LEASEEXTREQ | BMAPF_LOADING;
+	bmap_op_start_type(b, BMAP_OPCNT_ASYNC);
+	BMAP_ULOCK(b);
+
+	memset(&mq, 0, sizeof(mq));
+	mq.sbd = *bmap_2_sbd(b);
+	pfl_assert(mq.sbd.sbd_fg.fg_fid == fcmh_2_fid(b->bcm_fcmh));
+
+	/* the batch owns this until the reply */
+	xp = PSCALLOC(sizeof(*xp));
+	xp->xp_bmap = b;
+	xp->xp_start = ts;
+
+	m = fcmh_2_fci(b->bcm_fcmh)->fci_resm;
+	rc = slc_rmc_getcsvc(m, &csvc, 0);
+	if (!rc && csvc == NULL)
+		rc = ENOTCONN;
+	if (!rc)
+		rc = slrpc_batch_req_add(m->resm_res, &msl_batch_workq,
+		    csvc, SRMT_EXTENDBMAPLS, SRCM_BULK_PORTAL,
+		    SRMC_BULK_PORTAL, &mq, sizeof(mq), xp,
+		    &msl_batch_rep_extendbmapls, 1,
+		    MIN(msl_bmap_extend_batch, size));
+	if (rc) {
+		if (csvc)
+			sl_csvc_decref(csvc);
+		msl_bmap_lease_extend_batch_cb(NULL, NULL, xp, abs(rc));
+		PSCFREE(xp);
+		return;
+	}
+	OPSTAT_INCR("msl.bmap-extend-batch-add");
+}
+
 int
 msl_bmap_modeset_cb(struct pscrpc_request *rq,
     struct pscrpc_async_args *args)
@@ -772,18 +1060,26 @@ msl_bmap_lease_reassign_cb(struct pscrpc_request *rq,
 	struct slrpc_cservice *csvc = args->pointer_arg[MSL_CBARG_CSVC];
 	struct bmap *b = args->pointer_arg[MSL_CBARG_BMAP];
 	struct srm_reassignbmap_rep *mp;
-	int rc;
+	int rc, moved = 0;
 
 	BMAP_LOCK(b);
 	pfl_assert(b->bcm_flags & BMAPF_REASSIGNREQ);
 
 	SL_GET_RQ_STATUS(csvc, rq, mp, rc);
-	if (!rc)
+	if (!rc) {
 		msl_bmap_stash_lease(b, &mp->sbd, "reassign");
+		/*
+		 * Do not leave the bmap queued behind the IOS we just
+		 * moved away from; it may be throttled or dead.
+		 */
+		moved = bmap_flushq_requeue(b);
+	}
 
 	b->bcm_flags &= ~BMAPF_REASSIGNREQ;
 	bmap_op_done_type(b, BMAP_OPCNT_ASYNC);
 	sl_csvc_decref(csvc);
+	if (moved)
+		bmap_flushq_wake(BMAPFLSH_EXPIRE);
 
 	return (rc);
 }
@@ -880,13 +1176,14 @@ msl_bmap_cache_rls(struct bmap *b)
 	struct bmap_cli_info *bci = bmap_2_bci(b);
 	struct bmap_pagecache_entry *e;
 	struct psc_dynarray a = DYNARRAY_INIT;
+	int idx;
 
 	/*
- 	 * We need two loops because we don't have a safe version
- 	 * of RB_FOREACH().
+ 	 * We need two loops because bmpce_free() takes bci_rwlock
+ 	 * for writing to remove the page from the table.
  	 */
 	pfl_rwlock_rdlock(&bci->bci_rwlock);
-	RB_FOREACH(e, bmap_pagecachetree, &bmpc->bmpc_tree) {
+	BMPC_PT_FOREACH(e, bmpc, idx) {
 		BMPCE_LOCK(e);
 		e->bmpce_flags |= BMPCEF_DISCARD;
 		if (e->bmpce_ref || e->bmpce_flags & BMPCEF_TOFREE) {
@@ -896,9 +1193,7 @@ msl_bmap_cache_rls(struct bmap *b)
 		psclog_diag("Mark page free %p at %d\n", e, __LINE__);
 		e->bmpce_flags |= BMPCEF_TOFREE;
 
-		pfl_assert(e->bmpce_flags & BMPCEF_LRU);
-		pll_remove(&bmpc->bmpc_lru, e);
-		e->bmpce_flags &= ~BMPCEF_LRU;
+		bmpce_lru_remove(e, bmpc);
 		BMPCE_ULOCK(e);
 
 		psc_dynarray_add(&a, e);
@@ -1049,7 +1344,7 @@ msbwatchthr_main(struct psc_thread *thr)
 	struct timespec nto, ts;
 	struct bmap_cli_info *bci, *tmp;
 	struct bmapc_memb *b;
-	int exiting, i;
+	int exiting, i, n;
 	struct bmap_pagecache *bmpc;
 
 	/*
@@ -1102,11 +1397,11 @@ msbwatchthr_main(struct psc_thread *thr)
 			/*
 			 * Do not extend if we don't have any data.
 			 *
-			 * if bmpc->bmpc_pndg_writes, then bmpc_tree
+			 * if bmpc->bmpc_pndg_writes, then bmpc_pages
 			 * must not be empty.
 			 */
 			bmpc = bmap_2_bmpc(b);
-			if (RB_EMPTY(&bmpc->bmpc_tree)) {
+			if (bmpc_pt_empty(bmpc)) {
 				BMAP_ULOCK(b);
 				continue;
 			}
@@ -1115,18 +1410,22 @@ msbwatchthr_main(struct psc_thread *thr)
 			bmap_op_start_type(b, BMAP_OPCNT_ASYNC);
 			BMAP_ULOCK(b);
 
-			if (psc_dynarray_len(&bmaps) >= MAX_BMAP_RELEASE)
+			if (psc_dynarray_len(&bmaps) >=
+			    MAX(msl_bmap_extend_batch, MAX_BMAP_RELEASE))
 				break;
 		}
 		LIST_CACHE_ULOCK(&msl_bmaptimeoutq);
 
+		n = psc_dynarray_len(&bmaps);
+		if (n && msl_bmap_extend_batch)
+			OPSTAT_ADD("msl.bmap-extend-batch-items", n);
 		DYNARRAY_FOREACH(b, i, &bmaps) {
 		
 			/*
  			 * Investigate: what is we get a DIO bmap?
  			 */
 			BMAP_LOCK(b);
-			msl_bmap_lease_extend(b, 0);
+			msl_bmap_lease_extend_batch(b, n - i);
 			BMAP_LOCK(b);
 			b->bcm_flags &= ~BMAPF_LEASEEXTEND;
 			bmap_op_done_type(b, BMAP_OPCNT_ASYNC);
@@ -1316,7 +1615,7 @@ int
 msl_bmap_to_csvc(struct bmap *b, int exclusive, struct sl_resm **pm,
     struct slrpc_cservice **csvcp)
 {
-	int has_residency, i, j, locked, rc;
+	int has_residency, skipped, i, j, locked, rc;
 	struct fcmh_cli_info *fci;
 	struct sl_resm *m;
 
@@ -1349,7 +1648,8 @@ msl_bmap_to_csvc(struct bmap *b, int exclusive, struct sl_resm **pm,
 	fci = fcmh_get_pri(b->bcm_fcmh);
 
 	/*
-	 * Occasionally stir the order of replicas to distribute load.
+	 * Occasionally rerank the replicas by how fast they have been
+	 * serving reads lately.
 	 */
 	FCMH_LOCK(b->bcm_fcmh);
 	if (fci->fci_inode.nrepls > 1 && ++fci->fcif_mapstircnt >=
@@ -1361,25 +1661,35 @@ msl_bmap_to_csvc(struct bmap *b, int exclusive, struct sl_resm **pm,
 	FCMH_ULOCK(b->bcm_fcmh);
 
 	/*
-	 * Now try two iterations:
+	 * Now try three iterations:
 	 *
 	 *   (1) use any connections that are immediately available.
 	 *
-	 *   (2) if they aren't, the connection establishment is
-	 *	 non-blocking, so wait a short amount of time
-	 *	 (multiwait) until one wakes us up, after which we try
-	 *	 again and use that connection.
+	 *   (2) if they aren't, wait for the connection establishment
+	 *	 started by (1), in order of preference.  An IOS member
+	 *	 that cannot be reached is marked so that we do not wait
+	 *	 on it again for a while.
+	 *
+	 *   (3) if that skipped members marked earlier, wait on them
+	 *	 anyway; the mark may stem from a single transient
+	 *	 error and it could be our only replica.
 	 */
-	has_residency = 0;
-	for (i = 0; i < 2; i++) {
+	has_residency = skipped = 0;
+	for (i = 0; i < 3; i++) {
+		if (i == 2 && !skipped)
+			break;
 		/* fci->u.f.inode.nrepls */
 		for (j = 0; j < fci->fci_inode.nrepls; j++) {
 			rc = msl_try_get_replica_res(b,
 			    fci->fcif_idxmap[j], i ? has_residency : 1,
-			    pm, csvcp);
+			    (i ? MSL_REPLF_BLOCKING : 0) |
+			    (i == 2 ? MSL_REPLF_TRYDOWN : 0), pm, csvcp);
 			switch (rc) {
 			case 0:
 				return (0);
+			case -4: /* resident but marked down */
+				skipped = 1;
+				/* FALLTHROUGH */
 			case -1: /* resident but offline */
 				has_residency = 1;
 				break;
@@ -1388,19 +1698,6 @@ msl_bmap_to_csvc(struct bmap *b, int exclusive, struct sl_resm **pm,
 				break;
 			}
 		}
-		/*
-		 * We only sleep when we have a residency.
-		 * However, an IOS with residency might be
-		 * down while another IOS is up.
-		 *
- 		 * A quick fix so that we don't return 
- 		 * ETIMEDOUT when an IOS is contacted 
- 		 * first for an operation (e.g.,read 
- 		 * a file.
-		 */
-		if (has_residency && i == 0)
-			sleep(3);
-
 //		hasdataflag = !!(bmap_2_sbd(b)->sbd_flags &
 //		    SRM_LEASEBMAPF_DATA);
 	}
@@ -1434,7 +1731,7 @@ msl_bmap_final_cleanup(struct bmap *b)
 
 	pfl_assert(!(b->bcm_flags & BMAPF_FLUSHQ));
 
-	pfl_assert(RB_EMPTY(&bmpc->bmpc_tree));
+	pfl_assert(bmpc_pt_empty(bmpc));
 	pfl_assert(RB_EMPTY(&bmpc->bmpc_biorqs));
 	pfl_assert(pll_empty(&bmpc->bmpc_pndg_biorqs));
 
@@ -1445,6 +1742,7 @@ msl_bmap_final_cleanup(struct bmap *b)
 	pfl_assert(psclist_disjoint(&b->bcm_lentry));
 
 	lc_remove(&bmpcLru, bmpc);
+	bmpc_pt_destroy(bmpc);
 	DEBUG_BMAP(PLL_DIAG, b, "done freeing");
 }
 
@@ -40,6 +40,7 @@ struct bmap_cli_info {
 	int			 bci_nreassigns;	/* number of reassigns */
 	sl_ios_id_t		 bci_prev_sliods[SL_MAX_IOSREASSIGN];
 	struct psc_listentry	 bci_lentry;		/* bmap flushq */
+	struct msl_flushq	*bci_flushq;		/* per-IOS flushq */
 	uint8_t			 bci_repls[SL_REPLICA_NBYTES];
 };
 
@@ -80,6 +81,7 @@ bmap_2_bci(struct bmap *b)
 
 void	 msl_bmap_cache_rls(struct bmap *);
 int	 msl_bmap_lease_extend(struct bmap *, int);
+void	 msl_bmap_lease_extend_batch(struct bmap *, int);
 void	 msl_bmap_lease_reassign(struct bmap *);
 
 void	 bmap_biorq_expire(struct bmap *);
@@ -94,6 +96,7 @@ extern struct timespec msl_bmap_max_lease;
 extern struct timespec msl_bmap_timeo_inc;
 
 extern int slc_bmap_max_cache;
+extern int msl_bmap_extend_batch;
 
 static __inline struct bmap *
 bci_2_bmap(struct bmap_cli_info *bci)
@@ -65,6 +65,7 @@ slcfg_init_resm(struct sl_resm *resm)
 	struct resm_cli_info *rmci;
 
 	rmci = resm2rmci(resm);
+	INIT_SPINLOCK(&rmci->rmci_lock);
 	if (resm->resm_type == SLREST_ARCHIVAL_FS)
 		lc_reginit(&rmci->rmci_async_reqs, struct slc_async_req,
 		    car_lentry, "slash2/aiorq-%s:%d", r->res_name,
@@ -777,7 +777,7 @@ msctlrep_getbmpce(int fd, struct psc_ctlmsghdr *mh, void *m)
 	struct psc_hashbkt *hb;
 	struct fidc_membh *f;
 	struct bmap *b;
-	int rc = 1;
+	int idx, rc = 1;
 
 	PSC_HASHTBL_FOREACH_BUCKET(hb, &sl_fcmh_hashtbl) {
 		psc_hashbkt_lock(hb);
@@ -786,8 +786,7 @@ msctlrep_getbmpce(int fd, struct psc_ctlmsghdr *mh, void *m)
 			RB_FOREACH(b, bmaptree, &f->fcmh_bmaptree) {
 				bci = bmap_2_bci(b);
 				pfl_rwlock_rdlock(&bci->bci_rwlock);
-				RB_FOREACH(e, bmap_pagecachetree,
-				    &bmap_2_bmpc(b)->bmpc_tree) {
+				BMPC_PT_FOREACH(e, bmap_2_bmpc(b), idx) {
 					rc = msctlmsg_bmpce_send(fd, mh,
 					    mpce, b, e);
 					if (!rc)
@@ -922,6 +921,40 @@ mslctl_resfield_total_rpcs(int fd, struct psc_ctlmsghdr *mh,
 	    levels, nlevels, nbuf));
 }
 
+int
+mslctl_resfield_window(int fd, struct psc_ctlmsghdr *mh,
+    struct psc_ctlmsg_param *pcp, char **levels, int nlevels, int set,
+    struct sl_resource *r)
+{
+	struct resprof_cli_info *rpci;
+	char nbuf[16];
+
+	if (set)
+		return (psc_ctlsenderr(fd, mh, NULL,
+		    "window: field is read-only"));
+	rpci = res2rpci(r);
+	snprintf(nbuf, sizeof(nbuf), "%d", rpci->rpci_cc_window);
+	return (psc_ctlmsg_param_send(fd, mh, pcp, PCTHRNAME_EVERYONE,
+	    levels, nlevels, nbuf));
+}
+
+int
+mslctl_resfield_rpc_lat(int fd, struct psc_ctlmsghdr *mh,
+    struct psc_ctlmsg_param *pcp, char **levels, int nlevels, int set,
+    struct sl_resource *r)
+{
+	struct resprof_cli_info *rpci;
+	char nbuf[24];
+
+	if (set)
+		return (psc_ctlsenderr(fd, mh, NULL,
+		    "rpc_lat: field is read-only"));
+	rpci = res2rpci(r);
+	snprintf(nbuf, sizeof(nbuf), "%"PRIu64, rpci->rpci_cc_lat);
+	return (psc_ctlmsg_param_send(fd, mh, pcp, PCTHRNAME_EVERYONE,
+	    levels, nlevels, nbuf));
+}
+
 int
 mslctl_resfield_max_infl_rpcs(int fd, struct psc_ctlmsghdr *mh,
     struct psc_ctlmsg_param *pcp, char **levels, int nlevels, int set,
@@ -953,6 +986,8 @@ const struct slctl_res_field slctl_resmds_fields[] = {
 	{ "infl_rpcs",		mslctl_resfield_infl_rpcs },
 	{ "total_rpcs",		mslctl_resfield_total_rpcs },
 	{ "max_infl_rpcs",	mslctl_resfield_max_infl_rpcs },
+	{ "window",		mslctl_resfield_window },
+	{ "rpc_lat",		mslctl_resfield_rpc_lat },
 	{ "mtime",		mslctl_resfield_mtime },
 	{ NULL, NULL }
 };
@@ -963,6 +998,8 @@ const struct slctl_res_field slctl_resios_fields[] = {
 	{ "infl_rpcs",		mslctl_resfield_infl_rpcs },
 	{ "total_rpcs",		mslctl_resfield_total_rpcs },
 	{ "max_infl_rpcs",	mslctl_resfield_max_infl_rpcs },
+	{ "window",		mslctl_resfield_window },
+	{ "rpc_lat",		mslctl_resfield_rpc_lat },
 	{ "mtime",		mslctl_resfield_mtime },
 	{ NULL, NULL }
 };
@@ -1056,9 +1093,14 @@ msctlthr_spawn(void)
 
 	psc_ctlparam_register_var("sys.attr_timeout", PFLCTL_PARAMT_INT,
 	    PFLCTL_PARAMF_RDWR, &msl_attributes_timeout);
+	psc_ctlparam_register_var("sys.xattr_cache_timeout",
+	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR,
+	    &msl_xattr_cache_timeout);
 
 	psc_ctlparam_register_var("sys.bmap_max_cache",
 	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR, &slc_bmap_max_cache);
+	psc_ctlparam_register_var("sys.bmap_extend_batch",
+	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR, &msl_bmap_extend_batch);
 
 	psc_ctlparam_register_var("sys.bmap_reassign",
 	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR, &msl_bmap_reassign);
@@ -1067,14 +1109,34 @@ msctlthr_spawn(void)
 	psc_ctlparam_register_var("sys.datadir", PFLCTL_PARAMT_STR, 0,
 	    (char *)sl_datadir);
 
+	psc_ctlparam_register_var("sys.dirty_bytes", PFLCTL_PARAMT_UINT64,
+	    0, &msl_dirty_bytes);
+	psc_ctlparam_register_var("sys.dirty_hiwat", PFLCTL_PARAMT_INT,
+	    PFLCTL_PARAMF_RDWR, &msl_dirty_hiwat);
+	psc_ctlparam_register_var("sys.dirty_lowat", PFLCTL_PARAMT_INT,
+	    PFLCTL_PARAMF_RDWR, &msl_dirty_lowat);
+	psc_ctlparam_register_var("sys.dirty_maxpause", PFLCTL_PARAMT_INT,
+	    PFLCTL_PARAMF_RDWR, &msl_dirty_maxpause);
+
 	psc_ctlparam_register_var("sys.enable_namecache", PFLCTL_PARAMT_INT,
 	    PFLCTL_PARAMF_RDWR, &msl_enable_namecache);
 
+	psc_ctlparam_register_var("sys.namecache_neg_timeout",
+	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR,
+	    &msl_namecache_neg_timeout);
+
 	psc_ctlparam_register_var("sys.mountpoint", PFLCTL_PARAMT_STR,
 	    0, mountpoint);
 	psc_ctlparam_register_var("sys.offline_nretries",
 	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR, &msl_max_nretries);
 
+	psc_ctlparam_register_var("sys.pagecache_arenas", PFLCTL_PARAMT_INT,
+	    0, &msl_pgcache_narenas);
+	psc_ctlparam_register_var("sys.pagecache_hugepages",
+	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR, &msl_pgcache_hugepages);
+	psc_ctlparam_register_var("sys.pagecache_lru", PFLCTL_PARAMT_INT,
+	    PFLCTL_PARAMF_RDWR, &msl_pgcache_lru);
+
 	psc_ctlparam_register_simple("sys.pref_ios",
 	    msctlparam_prefios_get, msctlparam_prefios_set);
 	psc_ctlparam_register_simple("sys.mds", msctlparam_mds_get,
@@ -1085,6 +1147,22 @@ msctlthr_spawn(void)
 	psc_ctlparam_register_var("sys.force_dio",
 	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR, &msl_force_dio);
 
+	psc_ctlparam_register_var("sys.getattr_batch", PFLCTL_PARAMT_INT,
+	    PFLCTL_PARAMF_RDWR, &msl_getattr_batch);
+	psc_ctlparam_register_var("sys.attr_lease_renew",
+	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR, &msl_attr_lease_renew);
+
+	psc_ctlparam_register_var("sys.async_create", PFLCTL_PARAMT_INT,
+	    PFLCTL_PARAMF_RDWR, &msl_async_create);
+	psc_ctlparam_register_var("sys.async_create_batch",
+	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR,
+	    &msl_async_create_batch);
+	psc_ctlparam_register_var("sys.async_unlink", PFLCTL_PARAMT_INT,
+	    PFLCTL_PARAMF_RDWR, &msl_async_unlink);
+	psc_ctlparam_register_var("sys.async_unlink_batch",
+	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR,
+	    &msl_async_unlink_batch);
+
 	psc_ctlparam_register_simple("sys.map_enable",
 	    msctlparam_map_get, msctlparam_map_set);
 
@@ -1101,10 +1179,34 @@ msctlthr_spawn(void)
 	    slctlparam_max_pages_get, slctlparam_max_pages_set);
 	psc_ctlparam_register_var("sys.predio_pipe_size",
 	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR, &msl_predio_pipe_size);
+	psc_ctlparam_register_var("sys.predio_autotune",
+	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR, &msl_predio_autotune);
+	psc_ctlparam_register_var("sys.predio_window_max",
+	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR, &msl_predio_window_max);
+	psc_ctlparam_register_var("sys.predio_lease_ahead",
+	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR, &msl_predio_lease_ahead);
+	psc_ctlparam_register_var("sys.open_prefetch_size",
+	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR, &msl_open_prefetch_size);
+	psc_ctlparam_register_var("sys.repl_explore_secs",
+	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR, &msl_repl_explore_secs);
+	psc_ctlparam_register_var("sys.ios_down_secs",
+	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR, &msl_ios_down_secs);
+	psc_ctlparam_register_var("sys.hedge_reads",
+	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR, &msl_hedge_reads);
+	psc_ctlparam_register_var("sys.hedge_pct",
+	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR, &msl_hedge_pct);
+	psc_ctlparam_register_var("sys.hedge_min_usecs",
+	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR, &msl_hedge_min_usecs);
 
 	psc_ctlparam_register_var("sys.read_only", PFLCTL_PARAMT_INT,
 	    PFLCTL_PARAMF_RDWR, &msl_read_only);
 
+	psc_ctlparam_register_var("sys.readdir_ra_max",
+	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR, &msl_readdir_ra_max);
+	psc_ctlparam_register_var("sys.readdir_ra_maxpages",
+	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR,
+	    &msl_readdir_ra_maxpages);
+
 	psc_ctlparam_register_var("sys.repl_enable", PFLCTL_PARAMT_INT,
 	    PFLCTL_PARAMF_RDWR, &msl_repl_enable);
 
@@ -1132,6 +1234,15 @@ msctlthr_spawn(void)
 	psc_ctlparam_register_var("sys.mds_max_inflight_rpcs",
 	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR,
 	    &msl_mds_max_inflight_rpcs);
+	psc_ctlparam_register_var("sys.rpc_window_adapt",
+	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR,
+	    &msl_rpc_window_adapt);
+	psc_ctlparam_register_var("sys.rpc_window_min",
+	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR,
+	    &msl_rpc_window_min);
+	psc_ctlparam_register_var("sys.rpc_window_init",
+	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR,
+	    &msl_rpc_window_init);
 
 	psc_ctlparam_register_var("sys.enable_sillyrename", PFLCTL_PARAMT_INT,
 	    PFLCTL_PARAMF_RDWR, &msl_enable_sillyrename);
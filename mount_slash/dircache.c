@@ -34,6 +34,7 @@
 #include <string.h>
 
 #include "pfl/alloc.h"
+#include "pfl/atomic.h"
 #include "pfl/ctlsvr.h"
 #include "pfl/dynarray.h"
 #include "pfl/fs.h"
@@ -61,6 +62,21 @@ struct psc_lockedlist	 msl_dircache_pages_lru;
 int	msl_enable_namecache = 1;
 int	msl_enable_sillyrename = 1;
 
+/*
+ * Lifetime in seconds of a negative entry, i.e. a name the MDS told
+ * us does not exist.  Zero disables negative caching.
+ */
+int	msl_namecache_neg_timeout = 5;
+
+/*
+ * Readdir-ahead: how many pages a sequential reader may have loaded or
+ * loading ahead of it per directory, and how many such pages may be
+ * cached unread over all directories.
+ */
+int		msl_readdir_ra_max = 8;
+int		msl_readdir_ra_maxpages = 256;
+psc_atomic32_t	msl_readdir_ra_npages = PSC_ATOMIC32_INIT(0);
+
 #define	DCACHE_ENTRY_LIFETIME		30
 
 /*
@@ -79,6 +95,9 @@ dircache_init(struct fidc_membh *d)
 
 	INIT_LISTHEAD(&fci->fcid_entlist);
 	INIT_LISTHEAD(&fci->fci_dc_pages);
+	fci->fcid_ra_window = 1;
+	fci->fcid_ra_size = 0;
+	fci->fcid_ra_off = 0;
 	
 	pfl_rwlock_init(&fci->fcid_dircache_rwlock);
 }
@@ -144,8 +163,11 @@ dircache_free_page(struct fidc_membh *d, struct dircache_page *p)
 
 	p->dcp_flags |= DIRCACHEPGF_FREEING;
 
-	if ((p->dcp_flags & DIRCACHEPGF_READ) == 0)
+	if ((p->dcp_flags & DIRCACHEPGF_READ) == 0) {
 		OPSTAT_INCR("msl.dircache-unused-page");
+		if (p->dcp_flags & DIRCACHEPGF_RA)
+			psc_atomic32_dec(&msl_readdir_ra_npages);
+	}
 
 	psclist_del(&p->dcp_lentry, &fci->fci_dc_pages);
 
@@ -154,6 +176,25 @@ dircache_free_page(struct fidc_membh *d, struct dircache_page *p)
 	psc_pool_return(dircache_page_pool, p);
 }
 
+/*
+ * Find the page, loaded or loading, that starts at a directory cookie.
+ * @d: directory handle, locked.
+ * @off: getdents(2) cookie.
+ */
+struct dircache_page *
+dircache_find_page(struct fidc_membh *d, off_t off)
+{
+	struct fcmh_cli_info *fci;
+	struct dircache_page *p;
+
+	fci = fcmh_2_fci(d);
+	psclist_for_each_entry(p, &fci->fci_dc_pages, dcp_lentry)
+		if (p->dcp_off == off &&
+		    (p->dcp_flags & DIRCACHEPGF_FREEING) == 0)
+			return (p);
+	return (NULL);
+}
+
 /*
  * Perform an operation on each cached dirent referenced by an fcmh.
  *
@@ -294,6 +335,31 @@ dircache_ent_cmp(const void *a, const void *b)
 		strncmp(da->dce_name, db->dce_name, da->dce_namelen) == 0); 
 }
 
+/*
+ * Remove an entry from its directory list and from the name cache.
+ * @d: directory handle, write locked.
+ * @b: hash bucket of @dce, locked.
+ * @dce: entry to remove.
+ */
+static void
+dircache_ent_zap(struct fidc_membh *d, struct psc_hashbkt *b,
+    struct dircache_ent *dce)
+{
+	struct fcmh_cli_info *fci = fcmh_get_pri(d);
+
+	DIRCACHE_WR_ENSURE(d);
+	fci->fcid_count--;
+	pfl_assert(fci->fcid_count >= 0);
+	pfl_assert(dce->dce_flag & DIRCACHE_F_LIST);
+	pfl_assert(dce->dce_flag & DIRCACHE_F_HASH);
+	psclist_del(&dce->dce_entry, &fci->fcid_entlist);
+	psc_hashbkt_del_item(&msl_namecache_hashtbl, b, dce);
+	if (!(dce->dce_flag & DIRCACHE_F_SHORT))
+		PSCFREE(dce->dce_name);
+	dce->dce_flag = 0;
+	psc_pool_return(dircache_ent_pool, dce);
+}
+
 void
 dircache_trim(struct fidc_membh *d, int force)
 {
@@ -328,7 +394,9 @@ void
 dircache_reg_ents(struct fidc_membh *d, struct dircache_page *p,
     int nents, void *base, size_t size, int eof, int32_t lease)
 {
-	int i, rc;
+	struct psc_dynarray stale = DYNARRAY_INIT;
+	struct sl_fidgen *stalefgs = NULL;
+	int i, rc, nstale = 0;
 	off_t adj;
 	void *ebase;
 	struct timeval now;
@@ -400,6 +468,12 @@ dircache_reg_ents(struct fidc_membh *d, struct dircache_page *p,
 
 		tmpdce = _psc_hashbkt_search(&msl_namecache_hashtbl, b, 0,
 			dircache_ent_cmp, dce, NULL, NULL, &dce->dce_key);
+		if (tmpdce && tmpdce->dce_flag & DIRCACHE_F_NEG) {
+			/* the name has shown up since */
+			OPSTAT_INCR("msl.dircache-neg-readdir");
+			dircache_ent_zap(d, b, tmpdce);
+			tmpdce = NULL;
+		}
 		if (!tmpdce) {
 			psc_hashbkt_add_item(&msl_namecache_hashtbl, b, dce);
 			dce->dce_flag |= DIRCACHE_F_HASH;
@@ -441,6 +515,14 @@ dircache_reg_ents(struct fidc_membh *d, struct dircache_page *p,
 
 		if (rc) {
 			OPSTAT_INCR("msl.readdir-fcmh-exist");
+			/*
+			 * The readdir page may go away once the lock
+			 * is dropped, so keep our own copy of the FID.
+			 */
+			if (stalefgs == NULL)
+				stalefgs = PSCALLOC(nents *
+				    sizeof(*stalefgs));
+			stalefgs[nstale++] = *fgp;
 			continue;
 		}
 		FCMH_LOCK(f);
@@ -469,20 +551,47 @@ dircache_reg_ents(struct fidc_membh *d, struct dircache_page *p,
 	p->dcp_expire = now.tv_sec + lease;
 	p->dcp_flags |= eof ? DIRCACHEPGF_EOF : 0;
 	p->dcp_nextoff = dirent ? (off_t)dirent->pfd_off : p->dcp_off;
+
 	DIRCACHE_ULOCK(d);
+
+	/*
+	 * The attributes of files we already had are not taken from
+	 * the reply (see above), so refresh the expired ones in bulk.
+	 * This may block on the MDS connection, so it is done after
+	 * the directory lock is released.
+	 */
+	if (nstale) {
+		for (i = 0; i < nstale; i++)
+			psc_dynarray_add(&stale, &stalefgs[i]);
+		msl_getattr_batch_add(&stale);
+		psc_dynarray_free(&stale);
+		PSCFREE(stalefgs);
+	}
 }
 
 
-void
+
+/*
+ * Look up a name in the name cache.
+ * @d: directory handle.
+ * @name: basename to look up.
+ * @ino: value-result inode number, zero if not cached.
+ *
+ * Returns ENOENT if the name is cached as not existing: the negative
+ * entry is only honored while its lease holds and the directory
+ * generation has not moved since it was added.
+ */
+int
 dircache_lookup(struct fidc_membh *d, const char *name, uint64_t *ino)
 {
-	int len;
+	int len, rc = 0;
+	struct timeval now;
 	struct psc_hashbkt *b;
 	struct dircache_ent *dce, tmpdce;
 
 	*ino = 0;
 	if (!msl_enable_namecache)
-		return;
+		return (0);
 
 	DIRCACHE_WRLOCK(d);
 	dircache_trim(d, 0);
@@ -497,7 +606,17 @@ dircache_lookup(struct fidc_membh *d, const char *name, uint64_t *ino)
 
 	dce = _psc_hashbkt_search(&msl_namecache_hashtbl, b, 0,
 		dircache_ent_cmp, &tmpdce, NULL, NULL, &tmpdce.dce_key);
-	if (dce) {
+	if (dce && dce->dce_flag & DIRCACHE_F_NEG) {
+		PFL_GETTIMEVAL(&now);
+		if (dce->dce_expire > now.tv_sec &&
+		    dce->dce_dirgen == fcmh_2_gen(d)) {
+			OPSTAT_INCR("msl.dircache-neg-hit");
+			rc = ENOENT;
+		} else {
+			OPSTAT_INCR("msl.dircache-neg-stale");
+			dircache_ent_zap(d, b, dce);
+		}
+	} else if (dce) {
 		pfl_assert(dce->dce_flag & DIRCACHE_F_LIST);
 		pfl_assert(dce->dce_flag & DIRCACHE_F_HASH);
 		*ino = dce->dce_ino;
@@ -505,19 +624,23 @@ dircache_lookup(struct fidc_membh *d, const char *name, uint64_t *ino)
 	psc_hashbkt_put(&msl_namecache_hashtbl, b);
 
 	DIRCACHE_ULOCK(d);
+	return (rc);
 }
 
 /*
- * Add a name after a successful lookup.
+ * Add a name to the name cache, replacing any entry, positive or
+ * negative, already there.
+ * @ino: inode number, or zero for a negative entry.
  */
-void
-dircache_insert(struct fidc_membh *d, const char *name, uint64_t ino, int32_t lease)
+static void
+_dircache_insert(struct fidc_membh *d, const char *name, uint64_t ino,
+    int32_t lease)
 {
 	int len;
 	struct timeval now;
 	struct psc_hashbkt *b;
 	struct fcmh_cli_info *fci;
-	struct dircache_ent *dce, *tmpdce;
+	struct dircache_ent *dce, *tmpdce, tmp;
 
 	if (!msl_enable_namecache)
 		return;
@@ -529,6 +652,20 @@ dircache_insert(struct fidc_membh *d, const char *name, uint64_t ino, int32_t le
 
 	if (fci->fcid_count >= msl_max_namecache_per_directory) {
 		OPSTAT_INCR("dircache-limit");
+
+		/* still drop what we know to be outdated */
+		len = strlen(name);
+		tmp.dce_name = (char *)name;
+		tmp.dce_namelen = len;
+		tmp.dce_pino = fcmh_2_fid(d);
+		tmp.dce_key = dircache_hash(tmp.dce_pino, name, len);
+		b = psc_hashbkt_get(&msl_namecache_hashtbl, &tmp.dce_key);
+		tmpdce = _psc_hashbkt_search(&msl_namecache_hashtbl, b,
+		    0, dircache_ent_cmp, &tmp, NULL, NULL, &tmp.dce_key);
+		if (tmpdce)
+			dircache_ent_zap(d, b, tmpdce);
+		psc_hashbkt_put(&msl_namecache_hashtbl, b);
+
 		DIRCACHE_ULOCK(d);
 		return;
 	}
@@ -550,9 +687,11 @@ dircache_insert(struct fidc_membh *d, const char *name, uint64_t ino, int32_t le
 
 	strncpy(dce->dce_name, name, dce->dce_namelen);
 
-	/* fuse treats zero node ID as ENOENT */
-	pfl_assert(ino);
 	dce->dce_ino = ino;
+	if (!ino) {
+		dce->dce_flag |= DIRCACHE_F_NEG;
+		dce->dce_dirgen = fcmh_2_gen(d);
+	}
 	dce->dce_expire = now.tv_sec + lease;
 	dce->dce_pino = fcmh_2_fid(d);
 	dce->dce_key = dircache_hash(dce->dce_pino, dce->dce_name, 
@@ -564,17 +703,8 @@ dircache_insert(struct fidc_membh *d, const char *name, uint64_t ino, int32_t le
 	    dircache_ent_cmp, dce, NULL, NULL, &dce->dce_key);
 
 	if (tmpdce) {
-		fci->fcid_count--;
-		pfl_assert(fci->fcid_count >= 0);
-		pfl_assert(tmpdce->dce_flag & DIRCACHE_F_LIST);
-		pfl_assert(tmpdce->dce_flag & DIRCACHE_F_HASH);
 		OPSTAT_INCR("msl.dircache-update");
-		psclist_del(&tmpdce->dce_entry, &fci->fcid_entlist);
-		psc_hashbkt_del_item(&msl_namecache_hashtbl, b, tmpdce);
-		if (!(tmpdce->dce_flag & DIRCACHE_F_SHORT))
-			PSCFREE(tmpdce->dce_name);
-		tmpdce->dce_flag = 0;
-		psc_pool_return(dircache_ent_pool, tmpdce);
+		dircache_ent_zap(d, b, tmpdce);
 	}
 
 	fci->fcid_count++;
@@ -590,6 +720,34 @@ dircache_insert(struct fidc_membh *d, const char *name, uint64_t ino, int32_t le
 	DIRCACHE_ULOCK(d);
 }
 
+/*
+ * Add a name after a successful lookup.
+ */
+void
+dircache_insert(struct fidc_membh *d, const char *name, uint64_t ino,
+    int32_t lease)
+{
+	/* fuse treats zero node ID as ENOENT */
+	pfl_assert(ino);
+	_dircache_insert(d, name, ino, lease);
+}
+
+/*
+ * Remember that a name does not exist after a lookup failed with
+ * ENOENT, so that repeated probes (include paths, $PATH, Python
+ * imports) are answered locally.  Any later local create or rename
+ * into the name replaces the entry, and a directory callback from the
+ * MDS purges it along with the rest of the directory.
+ */
+void
+dircache_insert_neg(struct fidc_membh *d, const char *name)
+{
+	if (!msl_namecache_neg_timeout)
+		return;
+	OPSTAT_INCR("msl.dircache-neg-insert");
+	_dircache_insert(d, name, 0, msl_namecache_neg_timeout);
+}
+
 void
 dircache_delete(struct fidc_membh *d, const char *name)
 {
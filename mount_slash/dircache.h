@@ -67,6 +67,8 @@ struct fidc_membh;
 
 #define DIRCACHEPG_SOFT_TIMEO	30		/* expiration regardless if read or not */
 
+#define MSL_READDIR_RA_MAXSIZE	(64 * 1024)	/* largest readdir-ahead READDIR */
+
 /*
  * This consitutes a block of 'struct dirent' members (dircache_ent)
  * belonging to a READDIR request, which may be one of many for
@@ -93,6 +95,7 @@ struct dircache_page {
 #define DIRCACHEPGF_WAIT	(1 << 3)	/* someone is waiting */
 #define DIRCACHEPGF_ASYNC	(1 << 4)	/* asynchronous readdir */
 #define DIRCACHEPGF_FREEING	(1 << 5)	/* a thread is trying to free */
+#define DIRCACHEPGF_RA		(1 << 6)	/* loaded by readdir-ahead */
 
 #define DIRCACHE_WRLOCK(d)	pfl_rwlock_wrlock(fcmh_2_dc_rwlock(d))
 #define DIRCACHE_RDLOCK(d)	pfl_rwlock_rdlock(fcmh_2_dc_rwlock(d))
@@ -133,6 +136,7 @@ struct dircache_page {
 #define	DIRCACHE_F_SHORT	0x01
 #define	DIRCACHE_F_LIST		0x02		/* debug */
 #define	DIRCACHE_F_HASH		0x04		/* debug */
+#define	DIRCACHE_F_NEG		0x08		/* name does not exist */
 
 struct dircache_ent {
 	uint64_t		 dce_key;	/* hash table key */
@@ -142,6 +146,7 @@ struct dircache_ent {
 	struct psc_listentry	 dce_entry;     /* per directory linkage */
 	uint64_t		 dce_pino;
 	uint64_t		 dce_ino;
+	uint64_t		 dce_dirgen;	/* parent gen, negative only */
 	uint32_t		 dce_namelen;
 	long			 dce_expire;
 	int			 dce_flag;
@@ -153,6 +158,8 @@ struct dircache_page *
 	dircache_new_page(struct fidc_membh *, off_t, int);
 int	dircache_hasoff(struct dircache_page *, off_t);
 void	dircache_free_page(struct fidc_membh *, struct dircache_page *);
+struct dircache_page *
+	dircache_find_page(struct fidc_membh *, off_t);
 void	dircache_mgr_destroy(void);
 void	dircache_mgr_init(void);
 void	dircache_init(struct fidc_membh *);
@@ -166,8 +173,9 @@ int	dircache_ent_cmp(const void *, const void *);
 void	dircache_walk(struct fidc_membh *, void (*)(struct dircache_page *,
 	    struct dircache_ent *, void *), void *);
 
-void	dircache_lookup(struct fidc_membh *, const char *, uint64_t *);
+int	dircache_lookup(struct fidc_membh *, const char *, uint64_t *);
 void	dircache_insert(struct fidc_membh *, const char *, uint64_t, int32_t);
+void	dircache_insert_neg(struct fidc_membh *, const char *);
 void	dircache_delete(struct fidc_membh *, const char *);
 void	dircache_trim(struct fidc_membh *, int);
 
@@ -51,6 +51,8 @@
 
 extern struct pfl_waitq		 msl_bmap_waitq;
 
+int				 msl_xattr_cache_timeout = FCMH_ATTR_TIMEO;
+
 /*
  * If we fully truncate a file and then write to it in a loop, this 
  * will trigger get bmap RPC repeatedly.
@@ -197,7 +199,8 @@ slc_fcmh_setattrf(struct fidc_membh *f, struct srt_stat *sstb,
 
 	COPY_SSTB(sstb, &f->fcmh_sstb);
 	f->fcmh_flags |= FCMH_HAVE_ATTRS;
-	f->fcmh_flags &= ~FCMH_GETTING_ATTRS;
+	if ((flags & FCMH_SETATTRF_RENEW) == 0)
+		f->fcmh_flags &= ~FCMH_GETTING_ATTRS;
 
 	if (fcmh_isdir(f))
 		dircache_init(f);
@@ -240,6 +243,9 @@ msl_fcmh_fetch_inode(struct fidc_membh *f)
 	int rc;
 
 	fci = fcmh_2_fci(f);
+	rc = msl_nsop_wait(f);
+	if (rc)
+		goto out;
 	rc = slc_rmc_getcsvc(fci->fci_resm, &csvc, 0);
 	if (rc)
 		goto out;
@@ -277,6 +283,7 @@ slc_fcmh_ctor(struct fidc_membh *f, __unusedx int flags)
 
 	fci = fcmh_get_pri(f);
 	INIT_PSC_LISTENTRY(&fci->fci_lentry);
+	INIT_LISTHEAD(&fci->fci_xattrs);
 	siteid = FID_GET_SITEID(fcmh_2_fid(f));
 
 	pfl_assert(f->fcmh_flags & FCMH_INITING);
@@ -326,6 +333,7 @@ slc_fcmh_dtor(struct fidc_membh *f)
 		dircache_purge(f);
 		DIRCACHE_ULOCK(f);
 	}
+	msl_xattr_cache_purge(f);
 
 	DEBUG_FCMH(PLL_DEBUG, f, "dtor");
 }
@@ -333,11 +341,186 @@ slc_fcmh_dtor(struct fidc_membh *f)
 void
 msl_fcmh_stash_xattrsize(struct fidc_membh *f, uint32_t xattrsize)
 {
+	struct fcmh_cli_info *fci;
+
 	FCMH_LOCK_ENSURE(f);
-	fcmh_2_fci(f)->fci_xattrsize = xattrsize;
+	fci = fcmh_2_fci(f);
+	/*
+	 * A change in the total size means someone else modified the
+	 * xattrs, so whatever values we hold are suspect.
+	 */
+	if ((f->fcmh_flags & FCMH_CLI_XATTR_INFO) == 0 ||
+	    fci->fci_xattrsize != xattrsize)
+		msl_xattr_cache_purge(f);
+	fci->fci_xattrsize = xattrsize;
 	f->fcmh_flags |= FCMH_CLI_XATTR_INFO;
 }
 
+static void
+msl_xattr_ent_free(struct fcmh_cli_info *fci, struct msl_xattr_ent *xe)
+{
+	psclist_del(&xe->xe_lentry, &fci->fci_xattrs);
+	fci->fci_nxattrs--;
+	PSCFREE(xe->xe_value);
+	PSCFREE(xe);
+}
+
+/*
+ * Find a cached xattr, or the listxattr(2) name list if @name is NULL.
+ * Returns nonzero on a hit, in which case *rcp holds the result to hand
+ * back: ENODATA for a cached absence, ERANGE if @size is too small, or
+ * zero with *retsz and, for a nonzero @size, @buf filled in.
+ */
+int
+msl_xattr_cache_lookup(struct fidc_membh *f, const char *name,
+    void *buf, size_t size, size_t *retsz, int *rcp)
+{
+	struct msl_xattr_ent *xe, *next;
+	struct fcmh_cli_info *fci;
+	struct timeval now;
+	int locked, hit = 0;
+
+	fci = fcmh_2_fci(f);
+	PFL_GETTIMEVAL(&now);
+	locked = FCMH_RLOCK(f);
+	psclist_for_each_entry_safe(xe, next, &fci->fci_xattrs,
+	    xe_lentry) {
+		if (name ? (xe->xe_flags & MSL_XATTRF_LIST) ||
+		    strcmp(xe->xe_name, name) :
+		    (xe->xe_flags & MSL_XATTRF_LIST) == 0)
+			continue;
+		if (now.tv_sec >= xe->xe_expire) {
+			OPSTAT_INCR("msl.xattr-cache-expire");
+			msl_xattr_ent_free(fci, xe);
+			break;
+		}
+		hit = 1;
+		if (xe->xe_flags & MSL_XATTRF_NEG) {
+			OPSTAT_INCR("msl.xattr-cache-hit-neg");
+			*rcp = ENODATA;
+		} else if (size && size < xe->xe_len) {
+			*rcp = ERANGE;
+		} else {
+			OPSTAT_INCR("msl.xattr-cache-hit");
+			if (size)
+				memcpy(buf, xe->xe_value, xe->xe_len);
+			*retsz = xe->xe_len;
+			*rcp = 0;
+		}
+		/* keep the most recently used at the head */
+		psclist_del(&xe->xe_lentry, &fci->fci_xattrs);
+		psclist_add_head(&xe->xe_lentry, &fci->fci_xattrs);
+		break;
+	}
+	FCMH_URLOCK(f, locked);
+	return (hit);
+}
+
+/*
+ * Sample the purge generation of the xattr cache before sending an RPC
+ * whose reply will be handed to msl_xattr_cache_add().
+ */
+uint32_t
+msl_xattr_cache_gen(struct fidc_membh *f)
+{
+	uint32_t gen;
+	int locked;
+
+	locked = FCMH_RLOCK(f);
+	gen = fcmh_2_fci(f)->fci_xattrgen;
+	FCMH_URLOCK(f, locked);
+	return (gen);
+}
+
+/*
+ * Remember the outcome of a GETXATTR (@name) or LISTXATTR (@name is
+ * NULL) RPC.  @rc is ENODATA to record that the attribute is absent;
+ * other errors are not cached.  Nothing is cached if the cache was
+ * purged since @gen was sampled, as the reply may predate the update
+ * that caused it.
+ */
+void
+msl_xattr_cache_add(struct fidc_membh *f, const char *name,
+    const void *value, size_t len, int rc, uint32_t gen)
+{
+	struct msl_xattr_ent *xe, *old, *next;
+	struct fcmh_cli_info *fci;
+	struct timeval now;
+	int locked;
+
+	if (msl_xattr_cache_timeout <= 0)
+		return;
+	if (rc && rc != ENODATA)
+		return;
+	if (!rc && len > MSL_XATTR_CACHE_VALMAX)
+		return;
+
+	xe = PSCALLOC(sizeof(*xe));
+	INIT_PSC_LISTENTRY(&xe->xe_lentry);
+	if (name)
+		strlcpy(xe->xe_name, name, sizeof(xe->xe_name));
+	else
+		xe->xe_flags |= MSL_XATTRF_LIST;
+	if (rc)
+		xe->xe_flags |= MSL_XATTRF_NEG;
+	else if (len) {
+		xe->xe_value = PSCALLOC(len);
+		memcpy(xe->xe_value, value, len);
+	}
+	xe->xe_len = rc ? 0 : len;
+	PFL_GETTIMEVAL(&now);
+	xe->xe_expire = now.tv_sec + msl_xattr_cache_timeout;
+
+	fci = fcmh_2_fci(f);
+	locked = FCMH_RLOCK(f);
+	if (fci->fci_xattrgen != gen) {
+		FCMH_URLOCK(f, locked);
+		OPSTAT_INCR("msl.xattr-cache-stale");
+		PSCFREE(xe->xe_value);
+		PSCFREE(xe);
+		return;
+	}
+	psclist_for_each_entry_safe(old, next, &fci->fci_xattrs,
+	    xe_lentry)
+		if (name ? (old->xe_flags & MSL_XATTRF_LIST) == 0 &&
+		    strcmp(old->xe_name, name) == 0 :
+		    (old->xe_flags & MSL_XATTRF_LIST) != 0) {
+			msl_xattr_ent_free(fci, old);
+			break;
+		}
+	if (fci->fci_nxattrs >= MSL_XATTR_CACHE_MAX) {
+		old = psclist_last_entry(&fci->fci_xattrs,
+		    struct msl_xattr_ent, xe_lentry);
+		msl_xattr_ent_free(fci, old);
+	}
+	psclist_add_head(&xe->xe_lentry, &fci->fci_xattrs);
+	fci->fci_nxattrs++;
+	FCMH_URLOCK(f, locked);
+}
+
+/*
+ * Drop every cached xattr of a file, along with the ACL compiled from
+ * them, e.g. after it was modified through us or the MDS revoked our
+ * callback.
+ */
+void
+msl_xattr_cache_purge(struct fidc_membh *f)
+{
+	struct msl_xattr_ent *xe, *next;
+	struct fcmh_cli_info *fci;
+	int locked;
+
+	fci = fcmh_2_fci(f);
+	locked = FCMH_RLOCK(f);
+	psclist_for_each_entry_safe(xe, next, &fci->fci_xattrs,
+	    xe_lentry)
+		msl_xattr_ent_free(fci, xe);
+	fci->fci_xattrgen++;
+	PSCFREE(fci->fci_acl);
+	fci->fci_acl = NULL;
+	FCMH_URLOCK(f, locked);
+}
+
 #if PFL_DEBUG > 0
 void
 dump_fcmh_flags(int flags)
@@ -21,6 +21,7 @@
 #ifndef _FIDC_CLI_H_
 #define _FIDC_CLI_H_
 
+#include "pfl/atomic.h"
 #include "pfl/list.h"
 #include "pfl/lock.h"
 
@@ -36,6 +37,9 @@ struct fcmh_cli_info_file {
 	struct srt_inode	 inode;
 	int			 idxmap[SL_MAX_REPLICAS];
 	int			 mapstircnt;
+	int			 ra_window;	/* readahead window in pages */
+	psc_atomic32_t		 ra_hits;	/* readahead pages consumed */
+	psc_atomic32_t		 ra_waste;	/* readahead pages reaped unused */
 };
 
 struct fcmh_cli_info_dir {
@@ -47,8 +51,32 @@ struct fcmh_cli_info_dir {
 	 */
 	struct psclist_head	 entlist;
 	struct pfl_rwlock	 dircache_rwlock;
+	int			 ra_window;	/* readdir-ahead depth in pages */
+	size_t			 ra_size;	/* READDIR size asked by pscfs */
+	off_t			 ra_off;	/* cookie the reader reached */
 };
 
+struct slc_acl;
+
+/*
+ * Cached extended attribute value, or the absence of one.  A single
+ * entry with MSL_XATTRF_LIST holds the listxattr(2) name list.
+ */
+struct msl_xattr_ent {
+	struct psc_listentry	 xe_lentry;	/* chain on fci_xattrs */
+	char			 xe_name[SL_NAME_MAX + 1];
+	int			 xe_flags;
+	long			 xe_expire;
+	size_t			 xe_len;
+	char			*xe_value;
+};
+
+#define MSL_XATTRF_NEG		(1 << 0)	/* attribute does not exist */
+#define MSL_XATTRF_LIST		(1 << 1)	/* name list, not a value */
+
+#define MSL_XATTR_CACHE_MAX	8		/* entries per file */
+#define MSL_XATTR_CACHE_VALMAX	1024		/* largest value cached */
+
 /*
  * slfile mount_slash specific data, comes after slfile in memory.
  * @fci_resm: MDS resource who owns this file.
@@ -61,6 +89,22 @@ struct fcmh_cli_info_dir {
  *	quick access.
  * @fcif_mapstircnt: how many times @idxmap has been used since last
  *	stir.
+ * @fcif_ra_window: auto-tuned readahead window; 0 until first used.
+ * @fcif_ra_hits: readahead pages consumed since the last window update.
+ * @fcif_ra_waste: readahead pages reaped unaccessed since the last
+ *	window update.
+ * @fci_xattrs: cached xattr values and negative results, most
+ *	recently used first.
+ * @fci_xattrgen: bumped on every purge of @fci_xattrs so that a reply
+ *	overtaken by a local update is not cached.
+ * @fci_acl: parsed POSIX ACL and recent access decisions.
+ * @fci_nsops: asynchronous creates and unlinks still pending in this
+ *	directory.
+ * @fci_nunlinks: how many of @fci_nsops are unlinks, which a new entry
+ *	of the same name must not overtake.
+ * @fci_nsop_rc: error from a failed asynchronous create of this file,
+ *	or from the first failed asynchronous unlink in this directory,
+ *	reported by the next rmdir, rename, readdir or fsync of it.
  * @fci_dc_pages: dircache pages.
  * @fci_lentry: cache membership.
  * @fci_etime: attribute expiration time.
@@ -73,18 +117,31 @@ struct fcmh_cli_info {
 	int                         	 fci_nopen;
 	char                            *fci_name;
 	uint32_t		 	 fci_xattrsize; /* for dir or regular file */
+	struct psclist_head		 fci_xattrs;
+	int				 fci_nxattrs;
+	uint32_t			 fci_xattrgen;
+	struct slc_acl			*fci_acl;	/* compiled POSIX ACL */
+	int				 fci_nsops;	/* pending async child ops */
+	int				 fci_nunlinks;
+	int				 fci_nsop_rc;
 
 	union {
 		struct fcmh_cli_info_file f;
 #define fci_inode		u.f.inode
 #define fcif_idxmap		u.f.idxmap
 #define fcif_mapstircnt		u.f.mapstircnt
+#define fcif_ra_window		u.f.ra_window
+#define fcif_ra_hits		u.f.ra_hits
+#define fcif_ra_waste		u.f.ra_waste
 
 		struct fcmh_cli_info_dir d;
 #define fci_dc_pages		u.d.pages
 #define fcid_entlist		u.d.entlist
 #define fcid_count		u.d.count
 #define fcid_dircache_rwlock	u.d.dircache_rwlock
+#define fcid_ra_window		u.d.ra_window
+#define fcid_ra_size		u.d.ra_size
+#define fcid_ra_off		u.d.ra_off
 	} u;
 	struct psc_listentry		 fci_lentry;	/* all fcmhs with dirty attributes */
 };
@@ -117,12 +174,15 @@ fci_2_fcmh(struct fcmh_cli_info *fci)
 #define FCMH_CLI_DIRTY_QUEUE		(_FCMH_FLGSHFT << 4)	/* on dirty queue */
 #define FCMH_CLI_XATTR_INFO		(_FCMH_FLGSHFT << 5)
 #define FCMH_CLI_SILLY_RENAME		(_FCMH_FLGSHFT << 6)
+#define FCMH_CLI_CREATING		(_FCMH_FLGSHFT << 7)	/* async create not yet on MDS */
+#define FCMH_CLI_RENEWING		(_FCMH_FLGSHFT << 8)	/* attr lease renewal queued */
 
 #define FCMH_CLI_DIRTY_ATTRS		(FCMH_CLI_DIRTY_DSIZE | FCMH_CLI_DIRTY_MTIME)
 
 /* slc_fcmh_setattr() flags */
 #define FCMH_SETATTRF_CLOBBER		(1 << 0)		/* overwrite any local updates (file size, etc) */
 #define FCMH_SETATTRF_HAVELOCK		(1 << 1)		/* fcmh spinlock doens't need to be obtained */
+#define FCMH_SETATTRF_RENEW		(1 << 2)		/* lease renewal: FCMH_GETTING_ATTRS is not ours */
 
 void	slc_fcmh_setattrf(struct fidc_membh *, struct srt_stat *, int, int32_t);
 
@@ -154,4 +214,11 @@ int	msl_fcmh_fetch_inode(struct fidc_membh *);
 void	msl_fcmh_stash_inode(struct fidc_membh *, struct srt_inode *);
 void	msl_fcmh_stash_xattrsize(struct fidc_membh *, uint32_t);
 
+int	msl_xattr_cache_lookup(struct fidc_membh *, const char *, void *,
+	    size_t, size_t *, int *);
+void	msl_xattr_cache_add(struct fidc_membh *, const char *,
+	    const void *, size_t, int, uint32_t);
+uint32_t msl_xattr_cache_gen(struct fidc_membh *);
+void	msl_xattr_cache_purge(struct fidc_membh *);
+
 #endif /* _FIDC_CLI_H_ */
@@ -67,7 +67,9 @@
 
 __static void	msl_biorq_complete_fsrq(struct bmpc_ioreq *);
 __static size_t	msl_pages_copyin(struct bmpc_ioreq *);
+__static void	msl_pages_copyout_done(struct msl_fsrqinfo *);
 __static void	msl_pages_schedflush(struct bmpc_ioreq *);
+__static void	msl_dirty_adjust(int64_t);
 
 __static void	msl_update_attributes(struct msl_fsrqinfo *);
 
@@ -79,6 +81,45 @@ struct timespec		 msl_bmap_timeo_inc = { BMAP_CLI_TIMEO_INC, 0 };
 
 int                      msl_predio_pipe_size = 256;
 int                      msl_predio_max_pages = 64;
+int                      msl_predio_autotune = 1;
+int                      msl_predio_window_max = SLASH_BMAP_SIZE / BMPC_BUFSZ / 2;
+int                      msl_predio_lease_ahead = 8;	/* bmaps leased ahead of a stream */
+int                      msl_open_prefetch_size = 256 * 1024;	/* whole-file prefetch on open */
+int                      msl_repl_explore_secs = 30;	/* age of a stale IOS estimate */
+int                      msl_ios_down_secs = 10;	/* skip an unreachable IOS this long */
+int                      msl_hedge_reads = 0;		/* hedge slow reads to another replica */
+int                      msl_hedge_pct = 95;		/* read latency percentile to hedge at */
+int                      msl_hedge_min_usecs = 1000;	/* never hedge sooner than this */
+
+struct psc_listcache     msl_hedgeq;			/* reads awaiting their hedge deadline */
+
+/*
+ * Histogram of read RPC latencies in power-of-two microsecond buckets,
+ * halved when it fills up so that it follows changes in load.
+ */
+#define MSL_RDLAT_NBUCKETS	32
+#define MSL_RDLAT_MINSAMPLES	64
+#define MSL_RDLAT_MAXSAMPLES	4096
+
+psc_spinlock_t           msl_rdlat_lock = SPINLOCK_INIT;
+uint64_t                 msl_rdlat_hist[MSL_RDLAT_NBUCKETS];
+uint64_t                 msl_rdlat_nsamples;
+
+#define MSL_PREDIO_WINDOW_MIN	8	/* pages */
+#define MSL_PREDIO_SAMPLE	16	/* readahead pages judged per update */
+
+/*
+ * Dirty memory controller.  Bytes of buffered writes not yet
+ * acknowledged by an IOS are accounted against the size of the page
+ * cache.  Past the low watermark the flusher stops waiting for biorqs
+ * to age; past the high watermark writers are delayed in proportion to
+ * how far the cache is over the mark.
+ */
+psc_spinlock_t		 msl_dirty_lock = SPINLOCK_INIT;
+uint64_t		 msl_dirty_bytes;
+int			 msl_dirty_lowat = 10;		/* % of page cache */
+int			 msl_dirty_hiwat = 40;		/* % of page cache */
+int			 msl_dirty_maxpause = 200;	/* msecs */
 
 struct pfl_opstats_grad	 slc_iosyscall_iostats_rd;
 struct pfl_opstats_grad	 slc_iosyscall_iostats_wr;
@@ -145,11 +186,12 @@ _msl_biorq_page_valid(struct bmpc_ioreq *r, int idx, int accounting)
 }
 
 /*
- * Enqueue some predictive I/O work.
+ * Enqueue some predictive I/O work.  @raflags are BMPCEF_RA_* bits
+ * recording which access pattern the pages are fetched for.
  */
 void
 predio_enqueue(const struct sl_fidgen *fgp, sl_bmapno_t bno,
-    enum rw rw, uint32_t off, int npages)
+    enum rw rw, uint32_t off, int npages, int raflags)
 {
 	struct readaheadrq *rarq;
 
@@ -163,9 +205,67 @@ predio_enqueue(const struct sl_fidgen *fgp, sl_bmapno_t bno,
 	rarq->rarq_bno = bno;
 	rarq->rarq_off = off;
 	rarq->rarq_npages = npages;
+	rarq->rarq_flags = raflags;
+	rarq->rarq_nbmaps = 0;
+	lc_add(&msl_readaheadq, rarq);
+}
+
+/*
+ * Enqueue the retrieval of the leases of @nbmaps bmaps starting at
+ * @bno, to be fetched with one RPC by msl_bmap_lease_ahead().
+ */
+void
+predio_enqueue_leases(const struct sl_fidgen *fgp, sl_bmapno_t bno,
+    enum rw rw, int nbmaps)
+{
+	struct readaheadrq *rarq;
+
+	pfl_assert(rw == SL_READ || rw == SL_WRITE);
+	rarq = psc_pool_tryget(slc_readaheadrq_pool);
+	if (rarq == NULL)
+		return;
+	INIT_PSC_LISTENTRY(&rarq->rarq_lentry);
+	rarq->rarq_rw = rw;
+	rarq->rarq_fg = *fgp;
+	rarq->rarq_bno = bno;
+	rarq->rarq_off = 0;
+	rarq->rarq_npages = 0;
+	rarq->rarq_flags = 0;
+	rarq->rarq_nbmaps = nbmaps;
 	lc_add(&msl_readaheadq, rarq);
 }
 
+/*
+ * Prefetch a small file that was just opened for reading: the lease on
+ * its only bmap goes out to the MDS right away, without waiting for the
+ * readahead thread, which then reads the whole file into the page cache
+ * once the lease arrives.  Called with the fcmh unlocked.
+ */
+void
+msl_open_prefetch(struct fidc_membh *f)
+{
+	struct bmap *b;
+	uint64_t fsz;
+	int rc;
+
+	fsz = fcmh_2_fsz(f);
+	if (!fsz || fsz > (uint64_t)msl_open_prefetch_size ||
+	    fsz > SLASH_BMAP_SIZE)
+		return;
+
+	rc = bmap_getf(f, 0, SL_READ, BMAPGETF_CREATE |
+	    BMAPGETF_NONBLOCK | BMAPGETF_NODIO, &b);
+	if (rc) {
+		OPSTAT_INCR("msl.open-prefetch-err");
+		return;
+	}
+	bmap_op_done(b);
+
+	OPSTAT_INCR("msl.open-prefetch");
+	predio_enqueue(&f->fcmh_fg, 0, SL_READ, 0,
+	    howmany(fsz, BMPC_BUFSZ), 0);
+}
+
 /*
  * Construct a request structure for an I/O issued on a bmap.
  * Notes: roff is bmap aligned.
@@ -247,15 +347,14 @@ msl_biorq_del(struct bmpc_ioreq *r)
 
 	if (r->biorq_flags & BIORQ_FLUSHRDY) {
 		pll_remove(&bmpc->bmpc_biorqs_exp, r);
+		msl_dirty_adjust(-(int64_t)r->biorq_len);
 		pfl_assert(bmpc->bmpc_pndg_writes > 0);
 		pfl_assert(b->bcm_flags & BMAPF_FLUSHQ);
 		bmpc->bmpc_pndg_writes--;
 		if (!bmpc->bmpc_pndg_writes) {
-			b->bcm_flags &= ~BMAPF_FLUSHQ;
 			// XXX locking violation
-			lc_remove(&msl_bmapflushq, b);
-			DEBUG_BMAP(PLL_DIAG, b,
-			    "remove from msl_bmapflushq");
+			bmap_flushq_remove(b);
+			DEBUG_BMAP(PLL_DIAG, b, "remove from flushq");
 		}
 	}
 
@@ -303,7 +402,7 @@ msl_biorq_destroy(struct bmpc_ioreq *r)
 	msl_biorq_del(r);
 
 	OPSTAT_INCR("msl.biorq-destroy");
-	psc_pool_return(msl_biorq_pool, r);
+	bmpc_biorq_free(r);
 }
 
 #define biorq_incref(r)		_biorq_incref(PFL_CALLERINFO(), (r))
@@ -370,6 +469,170 @@ msl_fhent_new(struct pscfs_req *pfr, struct fidc_membh *f)
 	return (mfh);
 }
 
+__static void
+msl_rdlat_record(uint64_t usecs)
+{
+	int i, n;
+
+	for (n = 0; n < MSL_RDLAT_NBUCKETS - 1 && usecs >> n > 1; n++)
+		;
+	spinlock(&msl_rdlat_lock);
+	if (++msl_rdlat_nsamples > MSL_RDLAT_MAXSAMPLES) {
+		msl_rdlat_nsamples = 0;
+		for (i = 0; i < MSL_RDLAT_NBUCKETS; i++) {
+			msl_rdlat_hist[i] /= 2;
+			msl_rdlat_nsamples += msl_rdlat_hist[i];
+		}
+		msl_rdlat_nsamples++;
+	}
+	msl_rdlat_hist[n]++;
+	freelock(&msl_rdlat_lock);
+}
+
+/*
+ * Return how long a read may take before it is hedged: the
+ * msl_hedge_pct percentile of recent read latencies, or zero until
+ * enough of them have been seen.
+ */
+__static uint64_t
+msl_hedge_delay(void)
+{
+	uint64_t sum = 0, want, usecs = 0;
+	int i;
+
+	spinlock(&msl_rdlat_lock);
+	if (msl_rdlat_nsamples >= MSL_RDLAT_MINSAMPLES) {
+		want = msl_rdlat_nsamples * msl_hedge_pct / 100;
+		for (i = 0; i < MSL_RDLAT_NBUCKETS; i++) {
+			sum += msl_rdlat_hist[i];
+			if (sum >= want)
+				break;
+		}
+		usecs = UINT64_C(2) << MIN(i, MSL_RDLAT_NBUCKETS - 1);
+	}
+	freelock(&msl_rdlat_lock);
+	if (!usecs)
+		return (0);
+	return (MAX(usecs, (uint64_t)msl_hedge_min_usecs));
+}
+
+/*
+ * Fold the outcome of a read RPC into the moving estimates of the
+ * latency and throughput of the IOS member that served it.  A transport
+ * error marks the member unreachable for msl_ios_down_secs instead.
+ */
+__static void
+msl_resm_sample(struct sl_resm *m, uint64_t usecs, uint32_t size,
+    int rc)
+{
+	struct resm_cli_info *rmci = resm2rmci(m);
+	struct timespec now;
+
+	PFL_GETTIMESPEC(&now);
+	spinlock(&rmci->rmci_lock);
+	switch (abs(rc)) {
+	case 0:
+		msl_rdlat_record(usecs);
+		if (!rmci->rmci_stamp) {
+			rmci->rmci_usecs = usecs;
+			rmci->rmci_bytes = size;
+		} else {
+			rmci->rmci_usecs = (rmci->rmci_usecs * 7 + usecs) / 8;
+			rmci->rmci_bytes = (rmci->rmci_bytes * 7 + size) / 8;
+		}
+		rmci->rmci_stamp = now.tv_sec;
+		rmci->rmci_down = 0;
+		break;
+	case ETIMEDOUT:
+	case ENOTCONN:
+	case ECONNREFUSED:
+	case ECONNRESET:
+	case EHOSTUNREACH:
+		rmci->rmci_down = now.tv_sec + msl_ios_down_secs;
+		OPSTAT_INCR("msl.ios-mark-down");
+		break;
+	}
+	freelock(&rmci->rmci_lock);
+}
+
+__static int
+msl_resm_isdown(struct sl_resm *m, time_t now)
+{
+	struct resm_cli_info *rmci = resm2rmci(m);
+	int down;
+
+	spinlock(&rmci->rmci_lock);
+	down = rmci->rmci_down > now;
+	freelock(&rmci->rmci_lock);
+	return (down);
+}
+
+__static void
+msl_resm_setdown(struct sl_resm *m)
+{
+	struct resm_cli_info *rmci = resm2rmci(m);
+	struct timespec now;
+
+	PFL_GETTIMESPEC(&now);
+	spinlock(&rmci->rmci_lock);
+	rmci->rmci_down = now.tv_sec + msl_ios_down_secs;
+	freelock(&rmci->rmci_lock);
+	OPSTAT_INCR("msl.ios-mark-down");
+}
+
+/*
+ * Return the estimated cost of reading from an IOS, in microseconds
+ * per MiB over its fastest member, for ranking replicas.  Zero means
+ * that some member has no estimate or one older than
+ * msl_repl_explore_secs, so the IOS ranks first and the next read
+ * refreshes it.
+ */
+uint64_t
+msl_res_cost(struct sl_resource *res)
+{
+	struct resm_cli_info *rmci;
+	uint64_t cost, best = UINT64_MAX;
+	struct timespec now;
+	struct sl_resm *m;
+	int i;
+
+	PFL_GETTIMESPEC(&now);
+	DYNARRAY_FOREACH(m, i, &res->res_members) {
+		rmci = resm2rmci(m);
+		spinlock(&rmci->rmci_lock);
+		if (rmci->rmci_down > now.tv_sec) {
+			freelock(&rmci->rmci_lock);
+			continue;
+		}
+		if (!rmci->rmci_bytes || rmci->rmci_stamp +
+		    msl_repl_explore_secs < now.tv_sec) {
+			freelock(&rmci->rmci_lock);
+			return (0);
+		}
+		cost = rmci->rmci_usecs * 1024 * 1024 / rmci->rmci_bytes;
+		freelock(&rmci->rmci_lock);
+		best = MIN(best, cost);
+	}
+	return (best);
+}
+
+/*
+ * Return whether every member of an IOS is marked unreachable.
+ */
+int
+msl_res_isdown(struct sl_resource *res)
+{
+	struct timespec now;
+	struct sl_resm *m;
+	int i;
+
+	PFL_GETTIMESPEC(&now);
+	DYNARRAY_FOREACH(m, i, &res->res_members)
+		if (!msl_resm_isdown(m, now.tv_sec))
+			return (0);
+	return (1);
+}
+
 /*
  * Obtain a csvc connection to an IOS that has residency for a given
  * bmap.
@@ -381,17 +644,24 @@ msl_fhent_new(struct pscfs_req *pfr, struct fidc_membh *f)
  *	connection to any IOS.  This is a hack as no RPC should take
  *	place at all...
  *	XXX This entire approach should be changed.
+ * @flags: MSL_REPLF_BLOCKING to wait for connection establishment and
+ *	mark the members that cannot be reached.  Members marked down are
+ *	tried after the others, and only without waiting unless
+ *	MSL_REPLF_TRYDOWN is given.  Returns -4 if members were skipped
+ *	for that reason.
  * @csvcp: value-result service handle.
  */
 int
 msl_try_get_replica_res(struct bmap *b, int iosidx, int require_valid,
-    struct sl_resm **pm, struct slrpc_cservice **csvcp)
+    int flags, struct sl_resm **pm, struct slrpc_cservice **csvcp)
 {
 	struct bmap_cli_info *bci = bmap_2_bci(b);
 	struct fcmh_cli_info *fci;
 	struct sl_resource *res;
 	struct rnd_iterator it;
+	struct timespec now;
 	struct sl_resm *m;
+	int blocking, down, trydown, skipped = 0;
 
 	if (require_valid && SL_REPL_GET_BMAP_IOS_STAT(bci->bci_repls,
 	    iosidx * SL_BITS_PER_REPLICA) != BREPLST_VALID)
@@ -411,18 +681,41 @@ msl_try_get_replica_res(struct bmap *b, int iosidx, int require_valid,
 		return (-2);
 	}
 
-	/* XXX not a real shuffle */
-	FOREACH_RND(&it, psc_dynarray_len(&res->res_members)) {
-		m = psc_dynarray_getpos(&res->res_members,
-		    it.ri_rnd_idx);
-		*csvcp = slc_geticsvc_nb(m, 0);
-		if (*csvcp) {
-			if (pm)
-				*pm = m;
-			return (0);
+	/*
+	 * The down mark only ranks members: reachable ones are tried
+	 * first, then the others if we are not going to block on them
+	 * or the caller has run out of alternatives.
+	 *
+	 * XXX not a real shuffle
+	 */
+	PFL_GETTIMESPEC(&now);
+	for (down = 0; down < 2; down++) {
+		FOREACH_RND(&it, psc_dynarray_len(&res->res_members)) {
+			m = psc_dynarray_getpos(&res->res_members,
+			    it.ri_rnd_idx);
+			if (msl_resm_isdown(m, now.tv_sec) != down)
+				continue;
+			blocking = flags & MSL_REPLF_BLOCKING;
+			trydown = flags & MSL_REPLF_TRYDOWN;
+			if (down && blocking && !trydown) {
+				OPSTAT_INCR("msl.ios-skip-down");
+				skipped = 1;
+				continue;
+			}
+			if (blocking)
+				*csvcp = slc_geticsvc(m, 0);
+			else
+				*csvcp = slc_geticsvc_nb(m, 0);
+			if (*csvcp) {
+				if (pm)
+					*pm = m;
+				return (0);
+			}
+			if (blocking)
+				msl_resm_setdown(m);
 		}
 	}
-	return (-1);
+	return (skipped ? -4 : -1);
 }
 
 #define msl_fsrq_aiowait_tryadd_locked(e, r)				\
@@ -687,6 +980,7 @@ msl_complete_fsrq(struct msl_fsrqinfo *q, size_t len,
 	}
 
 	PSCFREE(oiov);
+	msl_pages_copyout_done(q);
 
 	for (i = 0; i < MAX_BMAPS_REQ; i++) {
 		r = q->mfsrq_biorq[i];
@@ -835,6 +1129,399 @@ _msl_bmpce_read_rpc_done(const struct pfl_callerinfo *pci,
 	msl_bmpce_complete_biorq(e, rc);
 }
 
+/*
+ * A hedged read: a read RPC that, if it has not completed by
+ * mh_deadline, is sent again to another valid replica.  The first leg
+ * reads into the pages as usual, the second one into mh_buf, and the
+ * first successful reply completes the pages.  If the second leg wins,
+ * the pages are pinned (bmpce_rpins) so that writers wait until the
+ * bulk of the first leg has landed.
+ */
+struct msl_hedge {
+	psc_spinlock_t		 mh_lock;
+	struct psc_listentry	 mh_lentry;	/* msl_hedgeq membership */
+	int			 mh_refcnt;	/* legs and timer */
+	int			 mh_flags;
+	int			 mh_queued;	/* on msl_hedgeq */
+	int			 mh_rc;		/* first leg error */
+	struct timespec		 mh_deadline;
+	struct bmpc_ioreq	*mh_biorq;
+	struct psc_dynarray	*mh_pages;
+	struct sl_resm		*mh_resm;	/* serving the first leg */
+	uint32_t		 mh_off;
+	int			 mh_npages;
+	char			*mh_buf;
+};
+
+#define MHF_HEDGED		(1 << 0)	/* second leg sent */
+#define MHF_DONE		(1 << 1)	/* pages completed by a leg */
+#define MHF_PRIMARY_ERR		(1 << 2)	/* second leg completes the pages */
+#define MHF_HEDGE_ERR		(1 << 3)	/* second leg failed */
+
+__static void
+msl_hedge_rele(struct msl_hedge *mh)
+{
+	spinlock(&mh->mh_lock);
+	if (--mh->mh_refcnt) {
+		freelock(&mh->mh_lock);
+		return;
+	}
+	freelock(&mh->mh_lock);
+	if (mh->mh_pages) {
+		psc_dynarray_free(mh->mh_pages);
+		PSCFREE(mh->mh_pages);
+	}
+	PSCFREE(mh->mh_buf);
+	PSCFREE(mh);
+}
+
+/*
+ * Return whether another valid, non-archival and reachable replica than
+ * @res holds bmap @b.  If @csvcp is given, also connect to it without
+ * blocking.
+ */
+__static int
+msl_hedge_replica(struct bmap *b, struct sl_resource *res,
+    struct sl_resm **pm, struct slrpc_cservice **csvcp)
+{
+	struct fcmh_cli_info *fci = fcmh_2_fci(b->bcm_fcmh);
+	struct sl_resource *r;
+	int j, idx;
+
+	for (j = 0; j < fci->fci_inode.nrepls; j++) {
+		idx = fci->fcif_idxmap[j];
+		if (SL_REPL_GET_BMAP_IOS_STAT(bmap_2_bci(b)->bci_repls,
+		    idx * SL_BITS_PER_REPLICA) != BREPLST_VALID)
+			continue;
+		r = libsl_id2res(fci->fci_inode.reptbl[idx].bs_id);
+		if (r == NULL || r == res ||
+		    r->res_type == SLREST_ARCHIVAL_FS || msl_res_isdown(r))
+			continue;
+		if (csvcp == NULL)
+			return (1);
+		if (!msl_try_get_replica_res(b, idx, 1, 0, pm, csvcp))
+			return (1);
+	}
+	return (0);
+}
+
+/*
+ * Decide whether a read about to be sent to @m should be hedged and,
+ * if so, set up its hedge.  The caller arms it with msl_hedge_arm()
+ * once the RPC is on its way.
+ */
+__static struct msl_hedge *
+msl_hedge_new(struct bmpc_ioreq *r, struct sl_resm *m,
+    struct psc_dynarray *a, uint32_t off, int npages)
+{
+	struct bmap *b = r->biorq_bmap;
+	struct msl_hedge *mh;
+	struct timespec ts;
+	uint64_t usecs;
+
+	if (!msl_hedge_reads || r->biorq_flags & BIORQ_READAHEAD ||
+	    b->bcm_flags & BMAPF_WR ||
+	    m->resm_res->res_type == SLREST_ARCHIVAL_FS ||
+	    fcmh_2_fci(b->bcm_fcmh)->fci_inode.nrepls < 2)
+		return (NULL);
+	usecs = msl_hedge_delay();
+	if (!usecs || !msl_hedge_replica(b, m->resm_res, NULL, NULL))
+		return (NULL);
+
+	mh = PSCALLOC(sizeof(*mh));
+	INIT_SPINLOCK(&mh->mh_lock);
+	INIT_PSC_LISTENTRY(&mh->mh_lentry);
+	mh->mh_refcnt = 2;
+	mh->mh_biorq = r;
+	mh->mh_pages = a;
+	mh->mh_resm = m;
+	mh->mh_off = off;
+	mh->mh_npages = npages;
+
+	PFL_GETTIMESPEC(&ts);
+	ts.tv_sec += usecs / 1000000;
+	ts.tv_nsec += usecs % 1000000 * 1000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	mh->mh_deadline = ts;
+	return (mh);
+}
+
+__static void
+msl_hedge_arm(struct msl_hedge *mh)
+{
+	LIST_CACHE_LOCK(&msl_hedgeq);
+	mh->mh_queued = 1;
+	lc_add(&msl_hedgeq, mh);
+	LIST_CACHE_ULOCK(&msl_hedgeq);
+}
+
+/*
+ * Complete the pages of a hedged read on behalf of both legs.
+ */
+__static void
+msl_hedge_complete(struct msl_hedge *mh, int rc)
+{
+	struct bmpc_ioreq *r = mh->mh_biorq;
+	struct bmap_pagecache_entry *e;
+	int i;
+
+	DYNARRAY_FOREACH(e, i, mh->mh_pages)
+		msl_bmpce_read_rpc_done(e, rc);
+	if (rc)
+		mfsrq_seterr(r->biorq_fsrqi, rc);
+	else
+		pfl_opstats_grad_incr(&slc_iorpc_iostats_rd,
+		    mh->mh_npages * BMPC_BUFSZ);
+}
+
+/*
+ * Called when the first leg of a hedged read completes.  Returns
+ * nonzero if the pages are not to be completed by this leg, because
+ * the second leg already did it or is left to do it.
+ */
+__static int
+msl_hedge_primary_done(struct msl_hedge *mh, int rc)
+{
+	struct bmap_pagecache_entry *e;
+	int i, skip = 0;
+
+	LIST_CACHE_LOCK(&msl_hedgeq);
+	if (mh->mh_queued) {
+		mh->mh_queued = 0;
+		lc_remove(&msl_hedgeq, mh);
+		LIST_CACHE_ULOCK(&msl_hedgeq);
+		msl_hedge_rele(mh);
+	} else
+		LIST_CACHE_ULOCK(&msl_hedgeq);
+
+	spinlock(&mh->mh_lock);
+	if (mh->mh_flags & MHF_DONE) {
+		/* our bulk has landed, let writers at the pages */
+		freelock(&mh->mh_lock);
+		DYNARRAY_FOREACH(e, i, mh->mh_pages) {
+			BMPCE_LOCK(e);
+			pfl_assert(e->bmpce_rpins > 0);
+			if (--e->bmpce_rpins == 0)
+				BMPCE_WAKE(e);
+			BMPCE_ULOCK(e);
+		}
+		skip = 1;
+	} else if (rc && (mh->mh_flags &
+	    (MHF_HEDGED | MHF_HEDGE_ERR)) == MHF_HEDGED) {
+		mh->mh_flags |= MHF_PRIMARY_ERR;
+		mh->mh_rc = rc;
+		freelock(&mh->mh_lock);
+		skip = 1;
+	} else {
+		if (mh->mh_flags & MHF_HEDGED)
+			OPSTAT_INCR("msl.hedge-lost");
+		mh->mh_flags |= MHF_DONE;
+		mh->mh_pages = NULL;
+		freelock(&mh->mh_lock);
+	}
+	msl_hedge_rele(mh);
+	return (skip);
+}
+
+/*
+ * Called when the second leg of a hedged read completes, or could not
+ * be sent.
+ */
+__static void
+msl_hedge_done(struct msl_hedge *mh, int rc)
+{
+	struct bmap_pagecache_entry *e;
+	int i, pin;
+
+	spinlock(&mh->mh_lock);
+	if (mh->mh_flags & MHF_DONE) {
+		freelock(&mh->mh_lock);
+	} else if (!rc) {
+		mh->mh_flags |= MHF_DONE;
+		pin = !(mh->mh_flags & MHF_PRIMARY_ERR);
+		if (pin)
+			DYNARRAY_FOREACH(e, i, mh->mh_pages) {
+				BMPCE_LOCK(e);
+				e->bmpce_rpins++;
+				BMPCE_ULOCK(e);
+			}
+		freelock(&mh->mh_lock);
+
+		DYNARRAY_FOREACH(e, i, mh->mh_pages)
+			memcpy(e->bmpce_entry->page_buf,
+			    mh->mh_buf + i * BMPC_BUFSZ, BMPC_BUFSZ);
+		msl_hedge_complete(mh, 0);
+		OPSTAT_INCR("msl.hedge-won");
+	} else if (mh->mh_flags & MHF_PRIMARY_ERR) {
+		mh->mh_flags |= MHF_DONE | MHF_HEDGE_ERR;
+		freelock(&mh->mh_lock);
+		msl_hedge_complete(mh, mh->mh_rc);
+	} else {
+		mh->mh_flags |= MHF_HEDGE_ERR;
+		freelock(&mh->mh_lock);
+	}
+	msl_hedge_rele(mh);
+}
+
+int
+msl_hedge_read_cb(struct pscrpc_request *rq,
+    struct pscrpc_async_args *args)
+{
+	struct slrpc_cservice *csvc = args->pointer_arg[MSL_CBARG_CSVC];
+	struct msl_hedge *mh = args->pointer_arg[MSL_CBARG_HEDGE];
+	struct sl_resm *m = args->pointer_arg[MSL_CBARG_RESM];
+	struct bmpc_ioreq *r = mh->mh_biorq;
+	struct timespec ts;
+	int rc;
+
+	SL_GET_RQ_STATUS_TYPE(csvc, rq, struct srm_io_rep, rc);
+
+	PFL_GETTIMESPEC(&ts);
+	msl_resm_sample(m, ts.tv_sec * 1000000 + ts.tv_nsec / 1000 -
+	    args->space[MSL_CBARG_STIME], mh->mh_npages * BMPC_BUFSZ, rc);
+
+	msl_hedge_done(mh, rc);
+	msl_biorq_release(r);
+	PSCFREE(args->pointer_arg[MSL_CBARG_IOVS]);
+	sl_csvc_decref(csvc);
+	return (0);
+}
+
+/*
+ * The deadline of a hedged read has passed: send its second leg.
+ */
+__static void
+msl_hedge_fire(struct msl_hedge *mh)
+{
+	struct slrpc_cservice *csvc = NULL;
+	struct pscrpc_request *rq = NULL;
+	struct bmpc_ioreq *r = mh->mh_biorq;
+	struct iovec *iovs = NULL;
+	struct srm_io_req *mq;
+	struct srm_io_rep *mp;
+	struct timespec ts;
+	struct sl_resm *m;
+	int i, rc;
+
+	spinlock(&mh->mh_lock);
+	if (mh->mh_flags & MHF_DONE) {
+		freelock(&mh->mh_lock);
+		msl_hedge_rele(mh);
+		return;
+	}
+	mh->mh_flags |= MHF_HEDGED;
+	freelock(&mh->mh_lock);
+
+	/* the timer reference now belongs to the second leg */
+	if (!msl_hedge_replica(r->biorq_bmap, mh->mh_resm->resm_res, &m,
+	    &csvc)) {
+		OPSTAT_INCR("msl.hedge-noreplica");
+		PFL_GOTOERR(out, rc = -ENOTCONN);
+	}
+
+	rc = SL_RSX_NEWREQ(csvc, SRMT_READ, rq, mq, mp);
+	if (rc)
+		PFL_GOTOERR(out, rc);
+
+	mh->mh_buf = PSCALLOC(mh->mh_npages * BMPC_BUFSZ);
+	iovs = PSCALLOC(sizeof(*iovs) * mh->mh_npages);
+	for (i = 0; i < mh->mh_npages; i++) {
+		iovs[i].iov_base = mh->mh_buf + i * BMPC_BUFSZ;
+		iovs[i].iov_len = BMPC_BUFSZ;
+	}
+
+	rq->rq_bulk_abortable = 1;
+	rc = slrpc_bulkclient(rq, BULK_PUT_SINK, SRIC_BULK_PORTAL, iovs,
+	    mh->mh_npages);
+	if (rc)
+		PFL_GOTOERR(out, rc);
+
+	mq->offset = mh->mh_off;
+	mq->size = mh->mh_npages * BMPC_BUFSZ;
+	mq->op = SRMIOP_RD;
+	memcpy(&mq->sbd, bmap_2_sbd(r->biorq_bmap), sizeof(mq->sbd));
+
+	rq->rq_async_args.pointer_arg[MSL_CBARG_CSVC] = csvc;
+	rq->rq_async_args.pointer_arg[MSL_CBARG_HEDGE] = mh;
+	rq->rq_async_args.pointer_arg[MSL_CBARG_RESM] = m;
+	rq->rq_async_args.pointer_arg[MSL_CBARG_IOVS] = iovs;
+	PFL_GETTIMESPEC(&ts);
+	rq->rq_async_args.space[MSL_CBARG_STIME] = ts.tv_sec * 1000000 +
+	    ts.tv_nsec / 1000;
+	rq->rq_interpret_reply = msl_hedge_read_cb;
+
+	biorq_incref(r);
+	rc = SL_NBRQSET_ADD(csvc, rq);
+	if (rc) {
+		msl_biorq_release(r);
+		PFL_GOTOERR(out, rc);
+	}
+	OPSTAT_INCR("msl.hedge-issued");
+	return;
+
+ out:
+	if (rq)
+		pscrpc_req_finished(rq);
+	if (csvc)
+		sl_csvc_decref(csvc);
+	PSCFREE(iovs);
+	msl_hedge_done(mh, rc);
+}
+
+void
+mshedgethr_main(struct psc_thread *thr)
+{
+	struct psc_dynarray a = DYNARRAY_INIT;
+	struct msl_hedge *mh, *tmp;
+	struct timespec now, next;
+	int i;
+
+	while (pscthr_run(thr)) {
+		PFL_GETTIMESPEC(&now);
+		next = now;
+		next.tv_sec++;
+
+		LIST_CACHE_LOCK(&msl_hedgeq);
+		LIST_CACHE_FOREACH_SAFE(mh, tmp, &msl_hedgeq) {
+			if (timespeccmp(&mh->mh_deadline, &now, >)) {
+				if (timespeccmp(&mh->mh_deadline, &next,
+				    <))
+					next = mh->mh_deadline;
+				continue;
+			}
+			mh->mh_queued = 0;
+			lc_remove(&msl_hedgeq, mh);
+			psc_dynarray_add(&a, mh);
+		}
+		if (!psc_dynarray_len(&a)) {
+			pfl_waitq_waitabs(&msl_hedgeq.plc_wq_empty,
+			    &msl_hedgeq.plc_lock, &next);
+			continue;
+		}
+		LIST_CACHE_ULOCK(&msl_hedgeq);
+
+		DYNARRAY_FOREACH(mh, i, &a)
+			msl_hedge_fire(mh);
+		psc_dynarray_reset(&a);
+	}
+	psc_dynarray_free(&a);
+}
+
+void
+mshedgethr_spawn(void)
+{
+	struct psc_thread *thr;
+
+	lc_reginit(&msl_hedgeq, struct msl_hedge, mh_lentry, "hedgeq");
+
+	thr = pscthr_init(MSTHRT_HEDGE, mshedgethr_main, 0,
+	    "mshedgethr");
+	pscthr_setready(thr);
+}
+
 int
 msl_read_attempt_retry(struct msl_fsrqinfo *fsrqi, int rc0,
     struct pscrpc_async_args *args)
@@ -848,6 +1535,7 @@ msl_read_attempt_retry(struct msl_fsrqinfo *fsrqi, int rc0,
 	struct srm_io_req *mq;
 	struct srm_io_rep *mp;
 	struct bmap_pagecache_entry *e;
+	struct timespec ts;
 	int npages, rc = 0;
 	uint32_t off;
 	struct pscfs_req *pfr;
@@ -890,6 +1578,11 @@ msl_read_attempt_retry(struct msl_fsrqinfo *fsrqi, int rc0,
 	rq->rq_async_args.pointer_arg[MSL_CBARG_BIORQ] = r;
 	rq->rq_async_args.pointer_arg[MSL_CBARG_RESM] = m;
 	rq->rq_async_args.pointer_arg[MSL_CBARG_IOVS] = iovs;
+	rq->rq_async_args.pointer_arg[MSL_CBARG_HEDGE] =
+	    args->pointer_arg[MSL_CBARG_HEDGE];
+	PFL_GETTIMESPEC(&ts);
+	rq->rq_async_args.space[MSL_CBARG_STIME] = ts.tv_sec * 1000000 +
+	    ts.tv_nsec / 1000;
 	rq->rq_interpret_reply = msl_read_cb;
 
 	rc = SL_NBRQSET_ADD(csvc, rq);
@@ -921,10 +1614,13 @@ msl_read_cleanup(struct pscrpc_request *rq, int rc,
 	struct psc_dynarray *a = args->pointer_arg[MSL_CBARG_BMPCE];
 	struct bmpc_ioreq *r = args->pointer_arg[MSL_CBARG_BIORQ];
 	struct iovec *iovs = args->pointer_arg[MSL_CBARG_IOVS];
+	struct sl_resm *m = args->pointer_arg[MSL_CBARG_RESM];
 	struct bmap_pagecache_entry *e;
+	struct msl_hedge *mh;
 	struct srm_io_req *mq;
+	struct timespec ts;
 	struct bmap *b;
-	int i;
+	int i, hedged = 0;
 	char buf[PSCRPC_NIDSTR_SIZE];
 
 	b = r->biorq_bmap;
@@ -932,19 +1628,47 @@ msl_read_cleanup(struct pscrpc_request *rq, int rc,
 	pfl_assert(a);
 	pfl_assert(b);
 
-	if (rq)
+	if (rq) {
 		DEBUG_REQ(rc ? PLL_ERROR : PLL_DIAG, rq, buf,
 		    "bmap=%p biorq=%p", b, r);
 
+		/* feed replica selection in msl_bmap_to_csvc() */
+		mq = pscrpc_msg_buf(rq->rq_reqmsg, 0, sizeof(*mq));
+		PFL_GETTIMESPEC(&ts);
+		if (m && mq)
+			msl_resm_sample(m, ts.tv_sec * 1000000 +
+			    ts.tv_nsec / 1000 -
+			    args->space[MSL_CBARG_STIME], mq->size, rc);
+	}
+
 	pfl_fault_here_rc(&rc, EIO, "slash2/read_cb");
 
 	DEBUG_BMAP(rc ? PLL_ERROR : PLL_DIAG, b, "rc=%d "
 	    "sbd_seq=%"PRId64, rc, bmap_2_sbd(b)->sbd_seq);
 	DEBUG_BIORQ(rc ? PLL_ERROR : PLL_DIAG, r, "rc=%d", rc);
 
+	if (rc == -PFLERR_KEYEXPIRED) {
+		BMAP_LOCK(b);
+		b->bcm_flags |= BMAPF_LEASEEXPIRE;
+		BMAP_ULOCK(b);
+		OPSTAT_INCR("msl.bmap-read-expired");
+	}
+
+	/*
+	 * A hedged read that the second leg has already completed is
+	 * not worth retrying.  Otherwise the retry stays the first leg
+	 * of the same hedge.
+	 */
+	mh = args->pointer_arg[MSL_CBARG_HEDGE];
+	if (mh) {
+		spinlock(&mh->mh_lock);
+		hedged = mh->mh_flags & MHF_DONE;
+		freelock(&mh->mh_lock);
+	}
+
 if (!pfl_rpc_max_retry) {
 
-	if (rc && r->biorq_fsrqi) {
+	if (rc && r->biorq_fsrqi && !hedged) {
 		sl_csvc_decref(csvc);
 		csvc = NULL;
 		if (msl_read_attempt_retry(r->biorq_fsrqi, rc, args))
@@ -953,16 +1677,21 @@ if (!pfl_rpc_max_retry) {
 
 }
 
+	if (mh) {
+		args->pointer_arg[MSL_CBARG_HEDGE] = NULL;
+		if (msl_hedge_primary_done(mh, rc)) {
+			msl_biorq_release(r);
+			PSCFREE(iovs);
+			if (csvc)
+				sl_csvc_decref(csvc);
+			return (0);
+		}
+	}
+
 	DYNARRAY_FOREACH(e, i, a)
 		msl_bmpce_read_rpc_done(e, rc);
 
 	if (rc) {
-		if (rc == -PFLERR_KEYEXPIRED) {
-			BMAP_LOCK(b);
-			b->bcm_flags |= BMAPF_LEASEEXPIRE;
-			BMAP_ULOCK(b);
-			OPSTAT_INCR("msl.bmap-read-expired");
-		}
 		if ((r->biorq_flags & BIORQ_READAHEAD) == 0)
 			mfsrq_seterr(r->biorq_fsrqi, rc);
 	} else {
@@ -1254,6 +1983,73 @@ if (!pfl_rpc_max_retry) {
 	return (rc);
 }
 
+__static uint64_t
+msl_dirty_limit(int pct)
+{
+	return ((uint64_t)msl_bmpces_max * BMPC_BUFSZ * pct / 100);
+}
+
+int
+msl_dirty_over_hiwat(void)
+{
+	return (msl_dirty_bytes > msl_dirty_limit(msl_dirty_hiwat));
+}
+
+/*
+ * Account for buffered write bytes entering or leaving the page cache.
+ * Crossing the low watermark kicks the flusher.
+ */
+__static void
+msl_dirty_adjust(int64_t len)
+{
+	uint64_t lowat, old;
+
+	lowat = msl_dirty_limit(msl_dirty_lowat);
+
+	spinlock(&msl_dirty_lock);
+	old = msl_dirty_bytes;
+	pfl_assert(len > 0 || old >= (uint64_t)-len);
+	msl_dirty_bytes += len;
+	freelock(&msl_dirty_lock);
+
+	if (old < lowat && old + len >= lowat) {
+		OPSTAT_INCR("msl.dirty-lowat-kick");
+		bmap_flushq_wake(BMAPFLSH_EXPIRE);
+	}
+}
+
+/*
+ * Delay a writer while dirty memory is above the high watermark.  The
+ * pause grows linearly from nothing at the high watermark to
+ * msl_dirty_maxpause when the whole page cache is dirty.
+ */
+__static void
+msl_dirty_throttle(void)
+{
+	uint64_t dirty, hiwat, span;
+	long usecs;
+
+	hiwat = msl_dirty_limit(msl_dirty_hiwat);
+	dirty = msl_dirty_bytes;
+	if (dirty <= hiwat)
+		return;
+
+	span = msl_dirty_limit(100) - hiwat;
+	if (span == 0 || dirty - hiwat >= span)
+		usecs = msl_dirty_maxpause * 1000L;
+	else
+		usecs = msl_dirty_maxpause * 1000L *
+		    (dirty - hiwat) / span;
+
+	bmap_flushq_wake(BMAPFLSH_EXPIRE);
+	if (usecs <= 0)
+		return;
+
+	OPSTAT_INCR("msl.dirty-throttle");
+	OPSTAT_ADD("msl.dirty-throttle-usecs", usecs);
+	usleep(usecs);
+}
+
 __static void
 msl_pages_schedflush(struct bmpc_ioreq *r)
 {
@@ -1273,6 +2069,7 @@ msl_pages_schedflush(struct bmpc_ioreq *r)
 	biorq_incref(r);
 	r->biorq_flags |= BIORQ_FLUSHRDY | BIORQ_ONTREE;
 	bmpc->bmpc_pndg_writes++;
+	msl_dirty_adjust(r->biorq_len);
 	PSC_RB_XINSERT(bmpc_biorq_tree, &bmpc->bmpc_biorqs, r);
 	pll_addtail(&bmpc->bmpc_biorqs_exp, r);
 	DEBUG_BIORQ(PLL_DIAG, r, "sched flush");
@@ -1289,11 +2086,10 @@ msl_pages_schedflush(struct bmpc_ioreq *r)
 	BIORQ_ULOCK(r);
 
 	if (!(b->bcm_flags & BMAPF_FLUSHQ)) {
-		b->bcm_flags |= BMAPF_FLUSHQ;
-		lc_addtail(&msl_bmapflushq, b);
-		DEBUG_BMAP(PLL_DIAG, b, "add to msl_bmapflushq");
-	} else
-		bmap_flushq_wake(BMAPFLSH_TIMEOADD);
+		bmap_flushq_add(b);
+		DEBUG_BMAP(PLL_DIAG, b, "add to flushq");
+	}
+	bmap_flushq_wake(BMAPFLSH_TIMEOADD);
 
 	DEBUG_BMAP(PLL_DIAG, b, "biorq=%p list_empty=%d",
 	    r, pll_empty(&bmpc->bmpc_pndg_biorqs));
@@ -1315,6 +2111,8 @@ msl_read_rpc_launch(struct bmpc_ioreq *r, struct psc_dynarray *bmpces,
 	struct psc_dynarray *a = NULL;
 	struct srm_io_req *mq;
 	struct srm_io_rep *mp;
+	struct msl_hedge *mh;
+	struct timespec ts;
 	struct iovec *iovs;
 	struct sl_resm *m;
 	uint32_t off = 0;
@@ -1335,10 +2133,10 @@ msl_read_rpc_launch(struct bmpc_ioreq *r, struct psc_dynarray *bmpces,
 		BMPCE_LOCK(e);
 		/*
 		 * A read must wait until all pending writes are
-		 * flushed.  So we should never see a pinned down
-		 * page here.
+		 * flushed.  So we should never see a page that is
+		 * still on the wire here.
 		 */
-		pfl_assert(!e->bmpce_pins);
+		pfl_assert(!BMPCE_WND_BUSY(e));
 
 		pfl_assert(e->bmpce_flags & BMPCEF_FAULTING);
 		pfl_assert(!(e->bmpce_flags & BMPCEF_DATARDY));
@@ -1403,17 +2201,30 @@ msl_read_rpc_launch(struct bmpc_ioreq *r, struct psc_dynarray *bmpces,
 	rq->rq_async_args.pointer_arg[MSL_CBARG_BIORQ] = r;
 	rq->rq_async_args.pointer_arg[MSL_CBARG_RESM] = m;
 	rq->rq_async_args.pointer_arg[MSL_CBARG_IOVS] = iovs;
+	PFL_GETTIMESPEC(&ts);
+	rq->rq_async_args.space[MSL_CBARG_STIME] = ts.tv_sec * 1000000 +
+	    ts.tv_nsec / 1000;
 	rq->rq_interpret_reply = msl_read_cb;
 
+	mh = msl_hedge_new(r, m, a, off, npages);
+	rq->rq_async_args.pointer_arg[MSL_CBARG_HEDGE] = mh;
+
 	biorq_incref(r);
 
 	rc = SL_NBRQSET_ADD(csvc, rq);
 	if (rc) {
 		msl_biorq_release(r);
+		if (mh) {
+			mh->mh_pages = NULL;
+			msl_hedge_rele(mh);
+			msl_hedge_rele(mh);
+		}
 
 		OPSTAT_INCR("msl.read-add-req-fail");
 		PFL_GOTOERR(out, rc);
 	}
+	if (mh)
+		msl_hedge_arm(mh);
 
 	return (0);
 
@@ -1570,11 +2381,15 @@ msl_pages_fetch(struct bmpc_ioreq *r)
 	/* read-before-write will kill performance */
 	if (r->biorq_flags & BIORQ_READ) {
 		perfect_ra = 1;
+		if (r->biorq_flags & BIORQ_LAUNCHED)
+			goto wait;
+
 		rc = msl_launch_read_rpcs(r);
 		if (rc)
 			PFL_GOTOERR(out, rc);
 	}
 
+ wait:
 	PFL_GETTIMESPEC(&ts0);
 
 	DYNARRAY_FOREACH(e, i, &r->biorq_pages) {
@@ -1603,14 +2418,25 @@ msl_pages_fetch(struct bmpc_ioreq *r)
 		}
 
 		if (e->bmpce_flags & BMPCEF_READAHEAD) {
-			if (!(r->biorq_flags & BIORQ_READAHEAD))
-				/*
-				 * BMPC_BUFSZ here is a lie but often
-				 * true as the original size isn't
-				 * available.
-				 */
+			/*
+			 * BMPC_BUFSZ here is a lie but often true as
+			 * the original size isn't available.
+			 */
+			if (!(r->biorq_flags & BIORQ_READAHEAD)) {
+				if (!(e->bmpce_flags & BMPCEF_ACCESSED)) {
+					e->bmpce_flags |= BMPCEF_ACCESSED;
+					psc_atomic32_inc(&fcmh_2_fci(
+					    r->biorq_bmap->bcm_fcmh)->fcif_ra_hits);
+				}
 				OPSTAT2_ADD("msl.readahead-hit",
 				    BMPC_BUFSZ);
+				if (e->bmpce_flags & BMPCEF_RA_STRIDE)
+					OPSTAT_INCR("msl.readahead-hit-stride");
+				else if (e->bmpce_flags & BMPCEF_RA_REVERSE)
+					OPSTAT_INCR("msl.readahead-hit-reverse");
+				else
+					OPSTAT_INCR("msl.readahead-hit-seq");
+			}
 		} else
 			perfect_ra = 0;
 
@@ -1663,6 +2489,7 @@ __static size_t
 msl_pages_copyin(struct bmpc_ioreq *r)
 {
 	struct bmap_pagecache_entry *e;
+	struct bmap_page_entry *pg;
 	uint32_t toff, tsize, nbytes;
 	char *dest, *src;
 	int i;
@@ -1679,12 +2506,45 @@ msl_pages_copyin(struct bmpc_ioreq *r)
 		pfl_assert(tsize);
 
 		BMPCE_LOCK(e);
-		if (e->bmpce_pins) {
-			OPSTAT_INCR("msl.bmpce-copyin-wait");
-			do {
+		for (;;) {
+			/*
+			 * A read reply may still be referencing the
+			 * page.
+			 */
+			if (e->bmpce_rpins) {
+				OPSTAT_INCR("msl.bmpce-copyin-wait");
 				BMPCE_WAIT(e);
 				BMPCE_LOCK(e);
-			} while (e->bmpce_pins);
+				continue;
+			}
+
+			/*
+			 * If the page is on the wire, don't wait for
+			 * the RPC, but don't scribble over the buffer
+			 * the IOS is pulling from either: that could
+			 * store a page mixing old and new bytes that
+			 * was never written as a unit.  Give the page a
+			 * copy of the buffer instead; the old one is
+			 * released once the window is acknowledged.
+			 * The flusher holds our biorq back until then
+			 * and sends the copy in the next window.
+			 */
+			if (!BMPCE_WND_BUSY(e) ||
+			    e->bmpce_entry != e->bmpce_wnd_entry)
+				break;
+			BMPCE_ULOCK(e);
+			pg = msl_pgcache_get(1);
+			BMPCE_LOCK(e);
+			if (e->bmpce_rpins || !BMPCE_WND_BUSY(e) ||
+			    e->bmpce_entry != e->bmpce_wnd_entry) {
+				msl_pgcache_put(pg);
+				continue;
+			}
+			memcpy(pg->page_buf, e->bmpce_entry->page_buf,
+			    BMPC_BUFSZ);
+			e->bmpce_entry = pg;
+			OPSTAT_INCR("msl.bmpce-copyin-redirty");
+			break;
 		}
 
 		/*
@@ -1748,8 +2608,11 @@ msl_pages_copyin(struct bmpc_ioreq *r)
 }
 
 /*
- * Copy pages to the user application buffer (i.e. application read(2)
- * servicing).
+ * Hand pages to the user application (i.e. application read(2)
+ * servicing).  Whole pages are not copied: the reply iovec points at
+ * the page buffer, which is pinned read-only until the reply has been
+ * sent.  Only partial pages at the unaligned edges of the request are
+ * copied, so concurrent writers to those are not held up.
  */
 size_t
 msl_pages_copyout(struct bmpc_ioreq *r, struct msl_fsrqinfo *q)
@@ -1757,10 +2620,9 @@ msl_pages_copyout(struct bmpc_ioreq *r, struct msl_fsrqinfo *q)
 	size_t nbytes, tbytes = 0, rflen;
 	struct bmap_pagecache_entry *e;
 	int i, npages, tsize;
-	char *dest, *src;
+	char *src;
 	off_t toff;
 
-	dest = r->biorq_buf;
 	toff = r->biorq_off;
 
 	rflen = fcmh_getsize(r->biorq_bmap->bcm_fcmh) -
@@ -1782,6 +2644,8 @@ msl_pages_copyout(struct bmpc_ioreq *r, struct msl_fsrqinfo *q)
 
 	q->mfsrq_iovs = PSC_REALLOC(q->mfsrq_iovs,
 	    sizeof(struct iovec) * (q->mfsrq_niov + npages));
+	q->mfsrq_pins = PSC_REALLOC(q->mfsrq_pins,
+	    sizeof(*q->mfsrq_pins) * (q->mfsrq_npins + npages));
 
 	/*
 	 * Due to page prefetching, the pages contained in biorq_pages
@@ -1807,6 +2671,21 @@ msl_pages_copyout(struct bmpc_ioreq *r, struct msl_fsrqinfo *q)
 
 		bmpce_usecheck(e, BIORQ_READ, biorq_getaligned_off(r, i));
 
+		if (nbytes == BMPC_BUFSZ) {
+			e->bmpce_rpins++;
+			q->mfsrq_pins[q->mfsrq_npins++] = e;
+			OPSTAT_INCR("msl.copyout-zerocopy");
+		} else {
+			pfl_assert(q->mfsrq_nbounce <
+			    (int)nitems(q->mfsrq_bounce));
+			q->mfsrq_bounce[q->mfsrq_nbounce] =
+			    PSCALLOC(nbytes);
+			memcpy(q->mfsrq_bounce[q->mfsrq_nbounce], src,
+			    nbytes);
+			src = q->mfsrq_bounce[q->mfsrq_nbounce++];
+			OPSTAT_INCR("msl.copyout-bounce");
+		}
+
 		q->mfsrq_iovs[q->mfsrq_niov].iov_len = nbytes;
 		q->mfsrq_iovs[q->mfsrq_niov].iov_base = src;
 		q->mfsrq_niov++;
@@ -1814,7 +2693,6 @@ msl_pages_copyout(struct bmpc_ioreq *r, struct msl_fsrqinfo *q)
 		BMPCE_ULOCK(e);
 
 		toff   += nbytes;
-		dest   += nbytes;
 		tbytes += nbytes;
 		tsize  -= nbytes;
 	}
@@ -1824,59 +2702,237 @@ msl_pages_copyout(struct bmpc_ioreq *r, struct msl_fsrqinfo *q)
 	return (tbytes);
 }
 
+/*
+ * Release the pages and bounce buffers that backed a read reply.
+ */
+__static void
+msl_pages_copyout_done(struct msl_fsrqinfo *q)
+{
+	struct bmap_pagecache_entry *e;
+	int i;
+
+	for (i = 0; i < q->mfsrq_npins; i++) {
+		e = q->mfsrq_pins[i];
+		BMPCE_LOCK(e);
+		pfl_assert(e->bmpce_rpins > 0);
+		if (--e->bmpce_rpins == 0)
+			BMPCE_WAKE(e);
+		BMPCE_ULOCK(e);
+	}
+	PSCFREE(q->mfsrq_pins);
+
+	for (i = 0; i < q->mfsrq_nbounce; i++)
+		PSCFREE(q->mfsrq_bounce[i]);
+}
+
+#define MSL_PREDIO_MAX_STRIDE	(8 * (off_t)SLASH_BMAP_SIZE)	/* largest gap taken as a stride */
+#define MSL_PREDIO_MAX_STRIDES	8				/* strided I/Os to run ahead */
+
+/*
+ * Match an application I/O against the streams tracked on this file
+ * handle.  An I/O may continue a sequential stream, continue an
+ * established stride (a negative stride is a reverse scan), or, if it
+ * lands near a stream that has seen only one I/O, guess a stride to be
+ * confirmed by the next I/O.  Only then is an I/O within a page of the
+ * end of a stream taken as semi-sequential, so that reverse scans and
+ * strides made of small I/Os are still detected.  Otherwise the least
+ * recently used stream is recycled for it.
+ */
 void
 mfh_track_predictive_io(struct msl_fhent *mfh, size_t size, off_t off,
     enum rw rw)
 {
-	int delta = BMPC_BUFSZ;
+	struct msl_predio_stream *s, *cand = NULL, *semi = NULL, *lru = NULL;
+	int i, flag, delta = BMPC_BUFSZ;
+	off_t end, gap;
 
 	MFH_LOCK(mfh);
 
-	if (rw == SL_WRITE) {
-		if (mfh->mfh_flags & MFHF_TRACKING_RA) {
-			mfh->mfh_flags &= ~MFHF_TRACKING_RA;
-			mfh->mfh_flags |= MFHF_TRACKING_WA;
-			mfh->mfh_predio_off = 0;
-			mfh->mfh_predio_nseq = 0;
-			mfh->mfh_predio_lastoff = 0;
-			mfh->mfh_predio_lastsize = 0;
-		}
-	} else {
-		if (mfh->mfh_flags & MFHF_TRACKING_WA) {
-			mfh->mfh_flags &= ~MFHF_TRACKING_WA;
-			mfh->mfh_flags |= MFHF_TRACKING_RA;
-			mfh->mfh_predio_off = 0;
-			mfh->mfh_predio_nseq = 0;
-			mfh->mfh_predio_lastoff = 0;
-			mfh->mfh_predio_lastsize = 0;
-		}
+	/* Switching between reads and writes restarts detection. */
+	flag = rw == SL_WRITE ? MFHF_TRACKING_WA : MFHF_TRACKING_RA;
+	if (!(mfh->mfh_flags & flag)) {
+		mfh->mfh_flags &= ~(MFHF_TRACKING_RA | MFHF_TRACKING_WA);
+		mfh->mfh_flags |= flag;
+		memset(mfh->mfh_streams, 0, sizeof(mfh->mfh_streams));
 	}
 
-	/*
-	 * If the first read starts from offset 0, the following will
-	 * automatically trigger a read-ahead because as part of the
-	 * msl_fhent structure, the fields are zeroed during allocation.
-	 */
-	if (off == mfh->mfh_predio_lastoff + mfh->mfh_predio_lastsize) {
-		OPSTAT_INCR("msl.predio-sequential");
-		mfh->mfh_predio_nseq++;
+	mfh->mfh_predio_clock++;
+	for (i = 0; i < MSL_PREDIO_NSTREAMS; i++) {
+		s = &mfh->mfh_streams[i];
+		end = s->mps_lastoff + s->mps_lastsize;
+
+		/*
+		 * If the first read starts from offset 0, the following
+		 * will automatically trigger a read-ahead because the
+		 * streams are zeroed when tracking starts.
+		 */
+		if (off == end) {
+			OPSTAT_INCR("msl.predio-sequential");
+			if (s->mps_pattern != MPS_PAT_SEQ) {
+				s->mps_pattern = MPS_PAT_SEQ;
+				s->mps_stride = 0;
+				s->mps_off = 0;
+			}
+			s->mps_nseq++;
+			goto out;
+		}
+		if (s->mps_stride &&
+		    off == s->mps_lastoff + s->mps_stride) {
+			if (s->mps_stride < 0) {
+				OPSTAT_INCR("msl.predio-reverse");
+				s->mps_pattern = MPS_PAT_REVERSE;
+			} else {
+				OPSTAT_INCR("msl.predio-stride");
+				s->mps_pattern = MPS_PAT_STRIDE;
+			}
+			s->mps_nseq++;
+			goto out;
+		}
+		if (s->mps_lastsize && off <= end + delta &&
+		    off >= end - delta && semi == NULL)
+			semi = s;
+
+		gap = off - s->mps_lastoff;
+		if (s->mps_lastsize && !s->mps_nseq && gap &&
+		    gap <= MSL_PREDIO_MAX_STRIDE &&
+		    gap >= -MSL_PREDIO_MAX_STRIDE &&
+		    (cand == NULL || s->mps_lastuse > cand->mps_lastuse))
+			cand = s;
+		if (lru == NULL || s->mps_lastuse < lru->mps_lastuse)
+			lru = s;
+	}
+
+	if (cand) {
+		OPSTAT_INCR("msl.predio-stride-guess");
+		s = cand;
+		s->mps_pattern = MPS_PAT_NONE;
+		s->mps_stride = off - s->mps_lastoff;
+		s->mps_off = -1;
 		goto out;
 	}
-	if (off > mfh->mfh_predio_lastoff + mfh->mfh_predio_lastsize + delta ||
-	    off < mfh->mfh_predio_lastoff + mfh->mfh_predio_lastsize - delta) {
-		OPSTAT_INCR("msl.predio-reset");
-		mfh->mfh_predio_off = 0;
-		mfh->mfh_predio_nseq = 0;
+
+	if (semi) {
+		OPSTAT_INCR("msl.predio-semi-sequential");
+		s = semi;
 		goto out;
 	}
-	OPSTAT_INCR("msl.predio-semi-sequential");
+
+	OPSTAT_INCR("msl.predio-reset");
+	s = lru;
+	memset(s, 0, sizeof(*s));
 
  out:
-	mfh->mfh_predio_lastoff = off;
-	mfh->mfh_predio_lastsize = size;
+	s->mps_lastoff = off;
+	s->mps_lastsize = size;
+	s->mps_lastuse = mfh->mfh_predio_clock;
+	mfh->mfh_predio_cur = s - mfh->mfh_streams;
 
 	MFH_ULOCK(mfh);
 }
+
+/*
+ * Return the readahead window of a file, adjusting it from the fate of
+ * the pages it prefetched since the last call: double it while nearly
+ * all readahead pages are consumed and halve it when more than a
+ * quarter are reaped unaccessed.  The window is bounded by
+ * msl_predio_window_max and never takes more than a quarter of the
+ * free page cache.  Without autotuning, it is msl_predio_max_pages.
+ */
+__static int
+msl_predio_window(struct fidc_membh *f)
+{
+	struct fcmh_cli_info *fci = fcmh_2_fci(f);
+	int w, hits, waste, avail;
+
+	if (!msl_predio_autotune)
+		return (msl_predio_max_pages);
+
+	FCMH_LOCK(f);
+	w = fci->fcif_ra_window;
+	if (w == 0)
+		w = msl_predio_pipe_size;
+
+	hits = psc_atomic32_read(&fci->fcif_ra_hits);
+	waste = psc_atomic32_read(&fci->fcif_ra_waste);
+	if (hits + waste >= MSL_PREDIO_SAMPLE) {
+		if (waste * 4 > hits + waste) {
+			OPSTAT_INCR("msl.predio-window-shrink");
+			w /= 2;
+		} else if (waste * 16 < hits + waste) {
+			OPSTAT_INCR("msl.predio-window-grow");
+			w *= 2;
+		}
+		psc_atomic32_set(&fci->fcif_ra_hits, 0);
+		psc_atomic32_set(&fci->fcif_ra_waste, 0);
+	}
+
+	avail = bmpce_pool->ppm_max - bmpce_pool->ppm_total +
+	    bmpce_nfree();
+	w = MIN(w, msl_predio_window_max);
+	w = MIN(w, avail / 4);
+	w = MAX(w, MSL_PREDIO_WINDOW_MIN);
+	fci->fcif_ra_window = w;
+	FCMH_ULOCK(f);
+
+	return (w);
+}
+
+/*
+ * Prefetch the next few I/Os of a strided or reverse stream.  Each
+ * predicted I/O is the size of the last one and lies mps_stride bytes
+ * past the previous one.  mps_off is the next predicted I/O that has
+ * not been enqueued yet.
+ */
+__static void
+msl_issue_predio_stride(struct msl_fhent *mfh,
+    struct msl_predio_stream *s, int window)
+{
+	int n, nahead, tpages, rapages, raflags;
+	struct fidc_membh *f;
+	off_t target, len, fsz;
+	uint32_t roff, boff;
+	sl_bmapno_t bno;
+
+	f = mfh->mfh_fcmh;
+	fsz = fcmh_2_fsz(f);
+	raflags = s->mps_pattern == MPS_PAT_REVERSE ?
+	    BMPCEF_RA_REVERSE : BMPCEF_RA_STRIDE;
+	nahead = MIN(s->mps_nseq * 2, MSL_PREDIO_MAX_STRIDES);
+
+	/* Restart the pipe if the application has caught up with it. */
+	if (s->mps_off < 0 ||
+	    (s->mps_off - s->mps_lastoff) / s->mps_stride <= 0)
+		s->mps_off = s->mps_lastoff + s->mps_stride;
+	n = (s->mps_off - s->mps_lastoff) / s->mps_stride;
+	if (n > nahead) {
+		OPSTAT_INCR("msl.predio-pipe-hit");
+		return;
+	}
+	OPSTAT_INCR("msl.predio-pipe-miss");
+
+	for (rapages = 0; n <= nahead && rapages < window;
+	    n++, s->mps_off += s->mps_stride) {
+		target = s->mps_off;
+		if (target < 0 || target >= fsz)
+			break;
+		len = MIN(s->mps_lastsize, fsz - target);
+
+		/* An I/O may straddle a bmap boundary. */
+		while (len > 0) {
+			bno = target / SLASH_BMAP_SIZE;
+			roff = target % SLASH_BMAP_SIZE;
+			boff = roff & ~BMPC_BUFMASK;
+			tpages = howmany(MIN(roff + len,
+			    SLASH_BMAP_SIZE) - boff, BMPC_BUFSZ);
+			predio_enqueue(&f->fcmh_fg, bno, SL_READ, boff,
+			    tpages, raflags);
+			rapages += tpages;
+			len -= SLASH_BMAP_SIZE - roff;
+			target += SLASH_BMAP_SIZE - roff;
+		}
+	}
+}
+
 /*
  * Calculate the next predictive I/O for an actual I/O request.
  *
@@ -1899,14 +2955,18 @@ __static void
 msl_issue_predio(struct msl_fhent *mfh, sl_bmapno_t bno, enum rw rw,
     uint32_t off, int npages)
 {
-	int bsize, tpages, rapages;
+	int n, bsize, tpages, rapages, window;
+	struct msl_predio_stream *s;
 	struct fidc_membh *f;
+	sl_bmapno_t lbno;
 	off_t raoff;
 
 	f = mfh->mfh_fcmh;
+	window = rw == SL_READ ? msl_predio_window(f) : 0;
 	MFH_LOCK(mfh);
 
-	if (!mfh->mfh_predio_nseq)
+	s = &mfh->mfh_streams[mfh->mfh_predio_cur];
+	if (!s->mps_nseq)
 		PFL_GOTOERR(out, 0);
 
 	if (mfh->mfh_flags & MFHF_TRACKING_WA) {
@@ -1914,23 +2974,37 @@ msl_issue_predio(struct msl_fhent *mfh, sl_bmapno_t bno, enum rw rw,
 		    off + npages * BMPC_BUFSZ >= 
 		    SLASH_BMAP_SIZE - BMPC_BUFSZ * msl_predio_pipe_size) {
 			OPSTAT_INCR("msl.predio-write-enqueue");
-			predio_enqueue(&f->fcmh_fg, bno+1, rw, 0, 0);
+			if (!msl_predio_lease_ahead)
+				predio_enqueue(&f->fcmh_fg, bno+1, rw, 0, 0,
+				    0);
+			else if (bno + 1 >= s->mps_leasebno) {
+				lbno = MAX(bno + 1, s->mps_leasebno);
+				predio_enqueue_leases(&f->fcmh_fg, lbno, rw,
+				    msl_predio_lease_ahead);
+				s->mps_leasebno = lbno + msl_predio_lease_ahead;
+			}
 		}
 		PFL_GOTOERR(out, 0);
 	}
 
+	if (s->mps_pattern == MPS_PAT_STRIDE ||
+	    s->mps_pattern == MPS_PAT_REVERSE) {
+		msl_issue_predio_stride(mfh, s, window);
+		PFL_GOTOERR(out, 0);
+	}
+
 	raoff = bno * SLASH_BMAP_SIZE + off + npages * BMPC_BUFSZ;
-	if (raoff + msl_predio_pipe_size * BMPC_BUFSZ < mfh->mfh_predio_off) {
+	if (raoff + window * BMPC_BUFSZ < s->mps_off) {
 		OPSTAT_INCR("msl.predio-pipe-hit");
 		PFL_GOTOERR(out, 0);
 	}
 	OPSTAT_INCR("msl.predio-pipe-miss");
 
 	/* Adjust raoff based on our position in the pipe */
-	if (mfh->mfh_predio_off) {
-		if (mfh->mfh_predio_off > raoff) {
+	if (s->mps_off) {
+		if (s->mps_off > raoff) {
 			OPSTAT_INCR("msl.predio-pipe-enlarge");
-			raoff = mfh->mfh_predio_off;
+			raoff = s->mps_off;
 		} else
 			OPSTAT_INCR("msl.predio-pipe-overrun");
 	}
@@ -1938,7 +3012,26 @@ msl_issue_predio(struct msl_fhent *mfh, sl_bmapno_t bno, enum rw rw,
 	/* convert to bmap relative */
 	bno = raoff / SLASH_BMAP_SIZE;
 	raoff = raoff - bno * SLASH_BMAP_SIZE;
-	rapages = MIN(MAX(mfh->mfh_predio_nseq*2, npages), msl_predio_max_pages);
+	rapages = MIN(MAX(s->mps_nseq*2, npages), window);
+
+	/*
+	 * Once the pipe gets within a bmap of the end of the leases
+	 * fetched so far, fetch the next msl_predio_lease_ahead of them
+	 * with one RPC.  This goes out before the readahead below so
+	 * that crossing into the next bmap does not fetch its lease on
+	 * its own.
+	 */
+	lbno = (bno * SLASH_BMAP_SIZE + raoff + rapages * BMPC_BUFSZ) /
+	    SLASH_BMAP_SIZE;
+	if (msl_predio_lease_ahead && lbno + 1 >= s->mps_leasebno) {
+		lbno = MAX(bno + 1, s->mps_leasebno);
+		if (lbno < fcmh_2_nbmaps(f)) {
+			n = MIN(msl_predio_lease_ahead,
+			    fcmh_2_nbmaps(f) - lbno);
+			predio_enqueue_leases(&f->fcmh_fg, lbno, rw, n);
+			s->mps_leasebno = lbno + n;
+		}
+	}
 
 #ifdef MYDEBUG
 	psclog_max("readahead: FID = "SLPRI_FID", bno = %d, offset = %ld, size = %d", 
@@ -1967,7 +3060,7 @@ msl_issue_predio(struct msl_fhent *mfh, sl_bmapno_t bno, enum rw rw,
 		if (tpages > rapages)
 			tpages = rapages;
 
-		predio_enqueue(&f->fcmh_fg, bno, rw, raoff, tpages);
+		predio_enqueue(&f->fcmh_fg, bno, rw, raoff, tpages, 0);
 
 		raoff += tpages * BMPC_BUFSZ;
 		if (raoff >= SLASH_BMAP_SIZE) {
@@ -1976,7 +3069,7 @@ msl_issue_predio(struct msl_fhent *mfh, sl_bmapno_t bno, enum rw rw,
 		}
 	}
 
-	mfh->mfh_predio_off = bno * SLASH_BMAP_SIZE + raoff;
+	s->mps_off = bno * SLASH_BMAP_SIZE + raoff;
 
  out:
 	MFH_ULOCK(mfh);
@@ -2100,6 +3193,20 @@ msl_io(struct pscfs_req *pfr, struct msl_fhent *mfh, char *buf,
 		PFL_GOTOERR(out3, rc = EISDIR);
 	}
 
+	/*
+	 * A file created asynchronously needs to exist on the MDS before
+	 * we can get a bmap lease for it.  This must happen before any
+	 * bmap is looked up since the create reply preloads bmap 0.
+	 *
+	 * XXX so create+write still pays one round trip per file, the
+	 * same as a synchronous create.  Buffering writes against the
+	 * provisional FID until flush would need the bmap lease to be
+	 * taken lazily by the flusher.
+	 */
+	rc = msl_nsop_wait(f);
+	if (rc)
+		PFL_GOTOERR(out3, rc);
+
 	FCMH_LOCK(f);
 	/*
 	 * All I/O's block here for pending truncate requests.
@@ -2134,6 +3241,9 @@ msl_io(struct pscfs_req *pfr, struct msl_fhent *mfh, char *buf,
 	if (nr > MAX_BMAPS_REQ)
 		PFL_GOTOERR(out3, rc = EINVAL);
 
+	if (rw == SL_WRITE)
+		msl_dirty_throttle();
+
 	/*
 	 * Initialize some state in the request to help with aio
 	 * handling.
@@ -2161,7 +3271,18 @@ msl_io(struct pscfs_req *pfr, struct msl_fhent *mfh, char *buf,
 	 *
 	 * For each block range, get its bmap and make a request into
 	 * its page cache.  This first loop retrieves all the pages.
+	 * Leases for the bmaps after the first are requested in the
+	 * background beforehand so that the MDS round trips overlap
+	 * instead of running one after another.
 	 */
+	for (i = 1; i < nr; i++) {
+		rc = bmap_getf(f, start + i, rw, BMAPGETF_CREATE |
+		    BMAPGETF_NONBLOCK, &b);
+		if (!rc)
+			bmap_op_done(b);
+	}
+	rc = 0;
+
 	for (i = 0; i < nr; i++) {
 		DEBUG_FCMH(PLL_DIAG, f, "nr=%d sz=%zu tlen=%zu "
 		    "off=%"PSCPRIdOFFT" roff=%"PSCPRIdOFFT" rw=%s", i,
@@ -2257,7 +3378,25 @@ msl_io(struct pscfs_req *pfr, struct msl_fhent *mfh, char *buf,
 	msl_issue_predio(mfh, bno, rw, aoff, npages);
 
  out1:
-	/* Step 3: launch biorqs (if necessary). */
+	/*
+	 * Step 3: launch biorqs (if necessary).  When a read spans
+	 * bmaps, send the read RPCs of all of them before waiting on
+	 * any, so bmaps that live on different IOSes are fetched in
+	 * parallel.  The fsrq is replied to when the last one is done.
+	 */
+	if (nr > 1 && rw == SL_READ) {
+		for (i = 0; i < nr; i++) {
+			r = q->mfsrq_biorq[i];
+			if (r->biorq_flags & BIORQ_DIO)
+				continue;
+			rc = msl_launch_read_rpcs(r);
+			if (rc)
+				PFL_GOTOERR(out2, rc);
+			BIORQ_SETATTR(r, BIORQ_LAUNCHED);
+		}
+		OPSTAT_INCR("msl.io-launch-parallel");
+	}
+
 	for (i = 0; i < nr; i++) {
 		r = q->mfsrq_biorq[i];
 
@@ -2327,6 +3466,14 @@ msreadaheadthr_main(struct psc_thread *thr)
 		b = NULL;
 		f = NULL;
 
+		if (rarq->rarq_nbmaps) {
+			rc = sl_fcmh_peek_fg(&rarq->rarq_fg, &f);
+			if (!rc)
+				msl_bmap_lease_ahead(f, rarq->rarq_bno,
+				    rarq->rarq_nbmaps, rarq->rarq_rw);
+			goto end;
+		}
+
 		npages = rarq->rarq_npages;
 		if (rarq->rarq_off + npages * BMPC_BUFSZ >
 		    SLASH_BMAP_SIZE)
@@ -2369,7 +3516,8 @@ msreadaheadthr_main(struct psc_thread *thr)
 		bmap_op_start_type(b, BMAP_OPCNT_BIORQ);
 
 		for (i = 0; i < npages; i++) {
-			rc = bmpce_lookup(r, b, BMPCEF_READAHEAD,
+			rc = bmpce_lookup(r, b,
+			    BMPCEF_READAHEAD | rarq->rarq_flags,
 			    rarq->rarq_off + i * BMPC_BUFSZ,
 			    &f->fcmh_waitq);
 			if (rc)
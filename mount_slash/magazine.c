@@ -0,0 +1,240 @@
+/*
+ * %GPL_START_LICENSE%
+ * ---------------------------------------------------------------------
+ * Copyright 2009-2018, Pittsburgh Supercomputing Center
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License contained in the file
+ * `COPYING-GPL' at the top of this distribution or at
+ * https://www.gnu.org/licenses/gpl-2.0.html for more details.
+ * ---------------------------------------------------------------------
+ * %END_LICENSE%
+ */
+
+/*
+ * magazine - Per-CPU object caches in front of the page buffer free
+ * list and the bmpce/biorq pools.
+ *
+ * Every CPU has two magazines: the loaded one is used first and the
+ * previous one absorbs a get/put ping-pong across a magazine boundary
+ * without going to the depot.  The number of magazines is fixed at
+ * init time (two per CPU plus the depot); when no empty one can be had
+ * the previous magazine is emptied in place instead.
+ */
+
+#define PSC_SUBSYS SLSS_BMAP
+#include "slsubsys.h"
+
+#include <pthread.h>
+#ifdef Linux
+#include <sched.h>
+#endif
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pfl/alloc.h"
+#include "pfl/dynarray.h"
+#include "pfl/opstats.h"
+
+#include "magazine.h"
+
+static __inline struct msl_magcpu *
+msl_magcache_cpu(struct msl_magcache *mgc)
+{
+	int cpu = -1;
+
+#ifdef Linux
+	cpu = sched_getcpu();
+#endif
+	if (cpu < 0)
+		cpu = ((uintptr_t)pthread_self() >> 4);
+	return (&mgc->mgc_cpus[cpu % mgc->mgc_ncpu]);
+}
+
+void
+msl_magcache_init(struct msl_magcache *mgc, const char *name,
+    void (*freef)(void *), int (*bypassf)(void))
+{
+	struct msl_magazine *mag;
+	struct msl_magcpu *mc;
+	int i, nmags;
+
+	mgc->mgc_name = name;
+	mgc->mgc_free = freef;
+	mgc->mgc_bypass = bypassf;
+	mgc->mgc_ncpu = sysconf(_SC_NPROCESSORS_CONF);
+	if (mgc->mgc_ncpu < 1)
+		mgc->mgc_ncpu = 1;
+	psc_atomic32_set(&mgc->mgc_nobjs, 0);
+	mgc->mgc_cpus = PSCALLOC(sizeof(*mc) * mgc->mgc_ncpu);
+
+	pll_init(&mgc->mgc_full, struct msl_magazine, mag_lentry, NULL);
+	pll_init(&mgc->mgc_empty, struct msl_magazine, mag_lentry, NULL);
+
+	nmags = 2 * mgc->mgc_ncpu + MSL_MAG_DEPOT_MAX + 1;
+	for (i = 0; i < nmags; i++) {
+		mag = PSCALLOC(sizeof(*mag));
+		INIT_PSC_LISTENTRY(&mag->mag_lentry);
+		pll_add(&mgc->mgc_empty, mag);
+	}
+	for (i = 0, mc = mgc->mgc_cpus; i < mgc->mgc_ncpu; i++, mc++) {
+		INIT_SPINLOCK(&mc->mc_lock);
+		mc->mc_loaded = pll_get(&mgc->mgc_empty);
+		mc->mc_prev = pll_get(&mgc->mgc_empty);
+	}
+
+	mgc->mgc_opst_hit = pfl_opstat_initf(OPSTF_BASE10,
+	    "msl.mag-%s-hit", name);
+	mgc->mgc_opst_miss = pfl_opstat_initf(OPSTF_BASE10,
+	    "msl.mag-%s-miss", name);
+	mgc->mgc_opst_depot = pfl_opstat_initf(OPSTF_BASE10,
+	    "msl.mag-%s-depot", name);
+}
+
+/*
+ * Grab an object from the current CPU's magazines, refilling from the
+ * depot when both are empty.  Returns NULL on a miss, in which case the
+ * caller should go to the backing store.
+ */
+void *
+msl_magcache_get(struct msl_magcache *mgc)
+{
+	struct msl_magazine *mag;
+	struct msl_magcpu *mc;
+	void *p = NULL;
+
+	mc = msl_magcache_cpu(mgc);
+	spinlock(&mc->mc_lock);
+	for (;;) {
+		mag = mc->mc_loaded;
+		if (mag->mag_nrounds) {
+			p = mag->mag_rounds[--mag->mag_nrounds];
+			break;
+		}
+		if (mc->mc_prev->mag_nrounds) {
+			mc->mc_loaded = mc->mc_prev;
+			mc->mc_prev = mag;
+			continue;
+		}
+		mag = pll_get(&mgc->mgc_full);
+		if (mag == NULL)
+			break;
+		pfl_opstat_incr(mgc->mgc_opst_depot);
+		pll_add(&mgc->mgc_empty, mc->mc_prev);
+		mc->mc_prev = mc->mc_loaded;
+		mc->mc_loaded = mag;
+	}
+	freelock(&mc->mc_lock);
+
+	if (p)
+		psc_atomic32_dec(&mgc->mgc_nobjs);
+	pfl_opstat_incr(p ? mgc->mgc_opst_hit : mgc->mgc_opst_miss);
+	return (p);
+}
+
+/*
+ * Stash a freed object in the current CPU's magazines.  When both are
+ * full, the previous one is handed to the depot; if the depot is full
+ * as well, its contents are released to the backing store and it is
+ * reused as the empty magazine.  Returns 0 if the caller must free the
+ * object itself because someone is waiting on the backing store.
+ */
+int
+msl_magcache_put(struct msl_magcache *mgc, void *p)
+{
+	void *ovf[MSL_MAG_NROUNDS];
+	struct msl_magazine *mag;
+	struct msl_magcpu *mc;
+	int i, novf = 0;
+
+	if (mgc->mgc_bypass && mgc->mgc_bypass())
+		return (0);
+
+	mc = msl_magcache_cpu(mgc);
+	spinlock(&mc->mc_lock);
+	for (;;) {
+		mag = mc->mc_loaded;
+		if (mag->mag_nrounds < MSL_MAG_NROUNDS) {
+			mag->mag_rounds[mag->mag_nrounds++] = p;
+			break;
+		}
+		if (mc->mc_prev->mag_nrounds < MSL_MAG_NROUNDS) {
+			mc->mc_loaded = mc->mc_prev;
+			mc->mc_prev = mag;
+			continue;
+		}
+		pfl_opstat_incr(mgc->mgc_opst_depot);
+		mag = NULL;
+		if (pll_nitems(&mgc->mgc_full) < MSL_MAG_DEPOT_MAX)
+			mag = pll_get(&mgc->mgc_empty);
+		if (mag)
+			pll_add(&mgc->mgc_full, mc->mc_prev);
+		else {
+			mag = mc->mc_prev;
+			novf = mag->mag_nrounds;
+			memcpy(ovf, mag->mag_rounds, novf * sizeof(*ovf));
+			mag->mag_nrounds = 0;
+		}
+		mc->mc_prev = mc->mc_loaded;
+		mc->mc_loaded = mag;
+	}
+	freelock(&mc->mc_lock);
+
+	psc_atomic32_add(&mgc->mgc_nobjs, 1 - novf);
+	for (i = 0; i < novf; i++)
+		mgc->mgc_free(ovf[i]);
+	return (1);
+}
+
+/*
+ * Return up to 'want' cached objects to the backing store, taking
+ * whole magazines from the depot before touching the per-CPU ones.
+ * This calls the backing store's free routine so it must not be used
+ * from within a pool reclaim callback.  Returns the number released.
+ */
+int
+msl_magcache_reap(struct msl_magcache *mgc, int want)
+{
+	struct psc_dynarray a = DYNARRAY_INIT;
+	struct msl_magazine *mag;
+	struct msl_magcpu *mc;
+	int i, j, n;
+	void *p;
+
+	while (psc_dynarray_len(&a) < want &&
+	    (mag = pll_get(&mgc->mgc_full))) {
+		for (j = 0; j < mag->mag_nrounds; j++)
+			psc_dynarray_add(&a, mag->mag_rounds[j]);
+		mag->mag_nrounds = 0;
+		pll_add(&mgc->mgc_empty, mag);
+	}
+	for (i = 0, mc = mgc->mgc_cpus;
+	    i < mgc->mgc_ncpu && psc_dynarray_len(&a) < want;
+	    i++, mc++) {
+		spinlock(&mc->mc_lock);
+		mag = mc->mc_prev;
+		while (mag->mag_nrounds && psc_dynarray_len(&a) < want)
+			psc_dynarray_add(&a,
+			    mag->mag_rounds[--mag->mag_nrounds]);
+		mag = mc->mc_loaded;
+		while (mag->mag_nrounds && psc_dynarray_len(&a) < want)
+			psc_dynarray_add(&a,
+			    mag->mag_rounds[--mag->mag_nrounds]);
+		freelock(&mc->mc_lock);
+	}
+
+	n = psc_dynarray_len(&a);
+	psc_atomic32_sub(&mgc->mgc_nobjs, n);
+	DYNARRAY_FOREACH(p, i, &a)
+		mgc->mgc_free(p);
+	psc_dynarray_free(&a);
+	return (n);
+}
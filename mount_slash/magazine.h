@@ -0,0 +1,90 @@
+/*
+ * %GPL_START_LICENSE%
+ * ---------------------------------------------------------------------
+ * Copyright 2009-2018, Pittsburgh Supercomputing Center
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed WITHOUT ANY WARRANTY; without even the
+ * implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License contained in the file
+ * `COPYING-GPL' at the top of this distribution or at
+ * https://www.gnu.org/licenses/gpl-2.0.html for more details.
+ * ---------------------------------------------------------------------
+ * %END_LICENSE%
+ */
+
+/*
+ * Per-CPU magazine caches placed in front of a global free list or
+ * pool.  Each CPU owns a loaded and a previous magazine of objects
+ * guarded by its own lock, so the common get/put path never touches
+ * the shared lock of the backing store.  Full and empty magazines are
+ * exchanged through a depot, which rebalances objects freed on one CPU
+ * to allocations made on another.
+ */
+
+#ifndef _MSL_MAGAZINE_H_
+#define _MSL_MAGAZINE_H_
+
+#include <limits.h>
+
+#include "pfl/atomic.h"
+#include "pfl/list.h"
+#include "pfl/lock.h"
+#include "pfl/lockedlist.h"
+
+struct pfl_opstat;
+
+#define MSL_MAG_NROUNDS		16		/* objects per magazine */
+#define MSL_MAG_DEPOT_MAX	64		/* full magazines in depot */
+
+struct msl_magazine {
+	struct psc_listentry	 mag_lentry;	/* chain on depot */
+	int			 mag_nrounds;
+	void			*mag_rounds[MSL_MAG_NROUNDS];
+};
+
+struct msl_magcpu {
+	psc_spinlock_t		 mc_lock;
+	struct msl_magazine	*mc_loaded;
+	struct msl_magazine	*mc_prev;
+};
+
+struct msl_magcache {
+	const char		*mgc_name;
+	int			 mgc_ncpu;
+	struct msl_magcpu	*mgc_cpus;
+
+	struct psc_lockedlist	 mgc_full;	/* depot */
+	struct psc_lockedlist	 mgc_empty;
+	psc_atomic32_t		 mgc_nobjs;	/* objects parked in magazines */
+
+	/* return an object to the backing store */
+	void			(*mgc_free)(void *);
+	/* nonzero if the backing store has waiters to feed */
+	int			(*mgc_bypass)(void);
+
+	struct pfl_opstat	*mgc_opst_hit;
+	struct pfl_opstat	*mgc_opst_miss;
+	struct pfl_opstat	*mgc_opst_depot;
+};
+
+void	 msl_magcache_init(struct msl_magcache *, const char *,
+	    void (*)(void *), int (*)(void));
+void	*msl_magcache_get(struct msl_magcache *);
+int	 msl_magcache_put(struct msl_magcache *, void *);
+int	 msl_magcache_reap(struct msl_magcache *, int);
+
+#define msl_magcache_drain(mgc)	msl_magcache_reap((mgc), INT_MAX)
+
+/*
+ * Objects held in the magazines are free as far as their owner is
+ * concerned even though the backing store counts them as in use.
+ */
+#define msl_magcache_nobjs(mgc)	psc_atomic32_read(&(mgc)->mgc_nobjs)
+
+#endif /* _MSL_MAGAZINE_H_ */
@@ -66,6 +66,7 @@
 #include "pfl/usklndthr.h"
 #include "pfl/vbitmap.h"
 
+#include "batchrpc.h"
 #include "bmap_cli.h"
 #include "cache_params.h"
 #include "creds.h"
@@ -130,6 +131,46 @@ struct pfl_waitq		 msl_flush_attrq = PFL_WAITQ_INIT("flush-attr");
 
 struct psc_listcache		 msl_attrtimeoutq;
 
+/*
+ * Batched GETATTRs issued after a readdir for cached files whose
+ * attributes have expired.  msl_getattr_batch is the number of files
+ * per batch RPC, zero disables.
+ */
+struct psc_listcache		 msl_batch_workq;
+int				 msl_getattr_batch = 128;
+
+/*
+ * Attribute leases of regular files in use are renewed this many
+ * seconds before they run out, riding on the same GETATTR batches.
+ * Zero disables.
+ */
+int				 msl_attr_lease_renew = 10;
+
+/*
+ * Asynchronous file creation: creat(2) is answered right away using a
+ * FID reserved from the MDS beforehand and the CREATE itself goes out
+ * in a batch of up to msl_async_create_batch.
+ */
+int				 msl_async_create;
+int				 msl_async_create_batch = 64;
+
+/*
+ * Asynchronous unlink: unlink(2) of a file nobody has open is answered
+ * right away and the UNLINK goes out in a batch of up to
+ * msl_async_unlink_batch.
+ */
+int				 msl_async_unlink;
+int				 msl_async_unlink_batch = 128;
+
+#define MSL_FIDPOOL_SIZE	256		/* FIDs reserved at a time */
+#define MSL_FIDPOOL_HOLDOFF	30		/* secs between failed refills */
+
+psc_spinlock_t			 msl_fidpool_lock = SPINLOCK_INIT;
+slfid_t				 msl_fidpool_next;
+slfid_t				 msl_fidpool_end;
+int				 msl_fidpool_busy;
+time_t				 msl_fidpool_holdoff;
+
 sl_ios_id_t			 msl_pref_ios = IOS_ID_ANY;
 
 const char			*msl_ctlsockfn = SL_PATH_MSCTLSOCK;
@@ -432,11 +473,368 @@ msl_internalize_stat(struct srt_stat *sstb, struct stat *stb)
 	gidmap_int_stat(sstb, &stb->st_gid);
 }
 
+/*
+ * Forget the FIDs reserved from the MDS, called when the connection to
+ * it drops since a restarted MDS no longer honors them.
+ */
+void
+msl_fidpool_reset(void)
+{
+	spinlock(&msl_fidpool_lock);
+	msl_fidpool_next = msl_fidpool_end = 0;
+	freelock(&msl_fidpool_lock);
+}
+
+/*
+ * Take a FID out of the pool reserved for asynchronous creates,
+ * refilling it from the MDS when it runs dry.  Only one thread refills
+ * at a time; the others get EAGAIN and create synchronously meanwhile.
+ * A failed refill (e.g. an MDS that predates SRMT_RESERVE_FID) is not
+ * retried for a while so creates do not pay for it each time.
+ */
+static int
+msl_fidpool_get(struct fidc_membh *p, slfid_t *fidp)
+{
+	struct slrpc_cservice *csvc = NULL;
+	struct pscrpc_request *rq = NULL;
+	struct srm_reserve_fid_req *mq;
+	struct srm_reserve_fid_rep *mp;
+	int rc;
+
+	spinlock(&msl_fidpool_lock);
+	if (msl_fidpool_next < msl_fidpool_end) {
+		*fidp = msl_fidpool_next++;
+		freelock(&msl_fidpool_lock);
+		return (0);
+	}
+	if (msl_fidpool_busy) {
+		freelock(&msl_fidpool_lock);
+		OPSTAT_INCR("msl.fidpool-busy");
+		return (EAGAIN);
+	}
+	if (time(NULL) < msl_fidpool_holdoff) {
+		freelock(&msl_fidpool_lock);
+		OPSTAT_INCR("msl.fidpool-holdoff");
+		return (EAGAIN);
+	}
+	msl_fidpool_busy = 1;
+	freelock(&msl_fidpool_lock);
+
+	MSL_RMC_NEWREQ(p, csvc, SRMT_RESERVE_FID, rq, mq, mp, rc, 0);
+	if (rc)
+		PFL_GOTOERR(out, rc);
+	mq->count = MSL_FIDPOOL_SIZE;
+	rc = SL_RSX_WAITREP(csvc, rq, mp);
+	if (rc == 0)
+		rc = mp->rc;
+	if (rc == 0 && mp->count <= 0)
+		rc = -EINVAL;
+	if (rc)
+		PFL_GOTOERR(out, rc);
+	OPSTAT_INCR("msl.fidpool-refill");
+
+ out:
+	spinlock(&msl_fidpool_lock);
+	if (rc == 0) {
+		*fidp = mp->fid;
+		msl_fidpool_next = mp->fid + 1;
+		msl_fidpool_end = mp->fid + mp->count;
+	} else {
+		msl_fidpool_holdoff = time(NULL) + MSL_FIDPOOL_HOLDOFF;
+		OPSTAT_INCR("msl.fidpool-refill-err");
+	}
+	msl_fidpool_busy = 0;
+	freelock(&msl_fidpool_lock);
+
+	pscrpc_req_finished(rq);
+	if (csvc)
+		sl_csvc_decref(csvc);
+	return (abs(rc));
+}
+
+/*
+ * Instantiate bmap 0 of a new file and load it with the write lease
+ * piggybacked on the CREATE reply.
+ */
+static int
+msl_create_preload_bmap(struct fidc_membh *c, struct srm_create_rep *mp)
+{
+	struct bmap_cli_info *bci;
+	struct bmap *b;
+	int rc;
+
+	/*
+	 * Any errors encountered here cannot affect the return status
+	 * of the open(2).  If they were to, the namei cache in the
+	 * kernel would get confused thinking there the error here was a
+	 * failure of the creation itself.
+	 *
+	 * Instead, wait for the application to perform some actual I/O
+	 * to retrieve bmap lease on-demand.
+	 */
+	if (mp->rc2) {
+		OPSTAT_INCR("bmap-preload-err");
+		return (mp->rc2);
+	}
+	OPSTAT_INCR("bmap-preload-ok");
+
+	rc = bmap_getf(c, 0, SL_WRITE, BMAPGETF_CREATE |
+	    BMAPGETF_NORETRIEVE, &b);
+	if (rc)
+		return (rc);
+
+	b->bcm_flags |= BMAPF_LOADED;
+	msl_bmap_stash_lease(b, &mp->sbd, "preload");
+	msl_bmap_reap_init(b);
+
+	/* 05/09/2017: random crash here: bcm_bmapno = 4026567200 */
+	DEBUG_BMAP(PLL_DIAG, b, "ios(%s) sbd_seq=%"PRId64,
+	    libsl_ios2name(mp->sbd.sbd_ios), mp->sbd.sbd_seq);
+
+	bci = bmap_2_bci(b);
+	// XXX this is wrong if the fcmh inherited from a dir with a
+	// reptbl!
+	SL_REPL_SET_BMAP_IOS_STAT(bci->bci_repls, 0, BREPLST_VALID);
+
+	bmap_op_done(b);
+	return (0);
+}
+
+struct msl_create_pending {
+	struct fidc_membh	*cp_p;
+	struct fidc_membh	*cp_c;
+	char			 cp_name[SL_NAME_MAX + 1];
+};
+
+/*
+ * Apply the reply to one asynchronous CREATE of a batch, or fail it.
+ * Anyone waiting on the file or its parent directory is woken up.  A
+ * failure can no longer be returned from creat(2), so the name is
+ * withdrawn and the error is handed to the next operation on the file.
+ */
+void
+msl_create_batch_cb(__unusedx void *req, void *rep, void *scratch,
+    int rc)
+{
+	struct msl_create_pending *cpend = scratch;
+	struct fidc_membh *p = cpend->cp_p, *c = cpend->cp_c;
+	struct srm_create_rep *mp = rep;
+	struct fcmh_cli_info *fci;
+
+	if (!rc && mp == NULL)
+		rc = EINVAL;
+	if (!rc)
+		rc = -mp->rc;
+	if (!rc && fcmh_2_fid(c) != mp->cattr.sst_fid)
+		rc = EBADF;
+
+	if (rc) {
+		/*
+		 * creat(2) has already succeeded, so make some noise.
+		 * A reset connection takes our FID reservations with it
+		 * and the create cannot be replayed.
+		 */
+		DEBUG_FCMH(PLL_ERROR, c, "async create of '%s' lost, "
+		    "rc=%d", cpend->cp_name, rc);
+		OPSTAT_INCR("msl.create-async-err");
+		dircache_delete(p, cpend->cp_name);
+	} else {
+		OPSTAT_INCR("msl.create-async-ok");
+		slc_fcmh_setattr(p, &mp->pattr, mp->lease);
+
+		FCMH_LOCK(c);
+		slc_fcmh_setattrf(c, &mp->cattr, FCMH_SETATTRF_HAVELOCK |
+		    FCMH_SETATTRF_CLOBBER, msl_attributes_timeout);
+		fci = fcmh_2_fci(c);
+		fci->fci_inode.reptbl[0].bs_id = mp->sbd.sbd_ios;
+		fci->fci_inode.nrepls = 1;
+		FCMH_ULOCK(c);
+
+		msl_create_preload_bmap(c, mp);
+	}
+
+	FCMH_LOCK(c);
+	fcmh_2_fci(c)->fci_nsop_rc = rc;
+	c->fcmh_flags &= ~FCMH_CLI_CREATING;
+	fcmh_wake_locked(c);
+	fcmh_op_done_type(c, FCMH_OPCNT_ASYNC_NSOP);
+
+	FCMH_LOCK(p);
+	fcmh_2_fci(p)->fci_nsops--;
+	fcmh_wake_locked(p);
+	fcmh_op_done_type(p, FCMH_OPCNT_ASYNC_NSOP);
+}
+
+struct slrpc_batch_rep_handler msl_batch_rep_create = {
+	msl_create_batch_cb,
+	sizeof(struct srm_create_req),
+	sizeof(struct srm_create_rep)
+};
+
+/*
+ * Wait until the MDS has acted on any asynchronous create of a file,
+ * or on asynchronous creates and unlinks of entries in a directory, so
+ * that an operation that depends on them goes out after them.  The
+ * pending batches are pushed out right away instead of being left to
+ * expire.  Returns the error from a failed create of the file itself.
+ * For a directory, the first error from an unlink in it is returned
+ * and cleared only if @report is set, which is reserved for the
+ * operations documented to report it (rmdir, rename, readdir and
+ * fsync).
+ */
+int
+_msl_nsop_wait(struct fidc_membh *f, int report)
+{
+	struct fcmh_cli_info *fci = fcmh_2_fci(f);
+	int rc = 0, locked;
+
+	locked = FCMH_RLOCK(f);
+	if (f->fcmh_flags & FCMH_CLI_CREATING || fci->fci_nsops)
+		OPSTAT_INCR("msl.nsop-wait");
+	while (f->fcmh_flags & FCMH_CLI_CREATING ||
+	    fci->fci_nsops) {
+		FCMH_ULOCK(f);
+		slrpc_batches_flush(fci->fci_resm->resm_res,
+		    SRMT_CREATE);
+		slrpc_batches_flush(fci->fci_resm->resm_res,
+		    SRMT_UNLINK);
+		FCMH_LOCK(f);
+		if (!(f->fcmh_flags & FCMH_CLI_CREATING) &&
+		    !fci->fci_nsops)
+			break;
+		fcmh_wait_nocond_locked(f);
+	}
+	if (!fcmh_isdir(f))
+		rc = fci->fci_nsop_rc;
+	else if (report) {
+		rc = fci->fci_nsop_rc;
+		fci->fci_nsop_rc = 0;
+	}
+	FCMH_URLOCK(f, locked);
+	return (rc);
+}
+
+/*
+ * Make sure a new entry in a directory does not reach the MDS before an
+ * asynchronous unlink of the same name queued earlier.
+ */
+static int
+msl_unlink_wait(struct fidc_membh *p)
+{
+	if (fcmh_2_fci(p)->fci_nunlinks == 0)
+		return (0);
+	OPSTAT_INCR("msl.unlink-async-wait");
+	return (msl_nsop_wait(p));
+}
+
+/*
+ * Create a file without waiting for the MDS: a FID is taken from the
+ * reserved pool, the attributes the MDS would assign are filled in
+ * locally, and the CREATE is queued on a batch.  Until the batch reply
+ * arrives, the file is marked FCMH_CLI_CREATING and its parent counts
+ * it in fci_nsops.
+ *
+ * @cattr: value-result attributes of the new file.
+ * @cp: value-result new file.
+ */
+static int
+msl_create_async(struct pscfs_req *pfr, struct fidc_membh *p,
+    const char *name, mode_t mode, struct pscfs_creds *pcr,
+    struct srt_stat *cattr, struct fidc_membh **cp)
+{
+	struct slrpc_cservice *csvc = NULL;
+	struct msl_create_pending *cpend;
+	struct fcmh_cli_info *pci;
+	struct srm_create_req mq;
+	struct fidc_membh *c;
+	slfid_t fid;
+	int rc;
+
+	/* without a reserved FID, the caller creates synchronously */
+	if (msl_fidpool_get(p, &fid))
+		return (EAGAIN);
+
+	memset(&mq, 0, sizeof(mq));
+	mq.mode = mode;
+	mq.pfg.fg_fid = fcmh_2_fid(p);
+	mq.pfg.fg_gen = FGEN_ANY;
+	mq.prefios[0] = msl_pref_ios;
+	mq.owner.scr_uid = pcr->pcr_uid;
+	mq.owner.scr_gid = newent_select_group(p, pcr);
+	strlcpy(mq.name, name, sizeof(mq.name));
+	PFL_GETPTIMESPEC(&mq.time);
+	mq.fid = fid;
+
+	/* what the MDS will make of it */
+	memset(cattr, 0, sizeof(*cattr));
+	cattr->sst_fid = fid;
+	cattr->sst_gen = 0;
+	cattr->sst_mode = S_IFREG | mode;
+	cattr->sst_nlink = 1;
+	cattr->sst_uid = mq.owner.scr_uid;
+	cattr->sst_gid = mq.owner.scr_gid;
+	cattr->sst_blksize = MSL_FS_BLKSIZ;
+	cattr->sst_atim = mq.time;
+	cattr->sst_mtim = mq.time;
+	cattr->sst_ctim = mq.time;
+
+	rc = msl_fcmh_get_fg(pfr, &cattr->sst_fg, &c);
+	if (rc)
+		return (rc);
+
+	FCMH_LOCK(c);
+	slc_fcmh_setattrf(c, cattr, FCMH_SETATTRF_HAVELOCK |
+	    FCMH_SETATTRF_CLOBBER, msl_attributes_timeout);
+	/* no default ACL, so nothing for getxattr(2) to wait for */
+	msl_fcmh_stash_xattrsize(c, 0);
+	c->fcmh_flags |= FCMH_CLI_CREATING;
+	fcmh_2_fci(c)->fci_nsop_rc = 0;
+	fcmh_op_start_type(c, FCMH_OPCNT_ASYNC_NSOP);
+	FCMH_ULOCK(c);
+
+	pci = fcmh_2_fci(p);
+	FCMH_LOCK(p);
+	pci->fci_nsops++;
+	fcmh_op_start_type(p, FCMH_OPCNT_ASYNC_NSOP);
+	FCMH_ULOCK(p);
+
+	msl_invalidate_readdir(p);
+	dircache_insert(p, name, fid, msl_attributes_timeout);
+
+	/* the batch owns both fcmh references until the reply */
+	cpend = PSCALLOC(sizeof(*cpend));
+	cpend->cp_p = p;
+	cpend->cp_c = c;
+	strlcpy(cpend->cp_name, name, sizeof(cpend->cp_name));
+
+	rc = slc_rmc_getcsvc(pci->fci_resm, &csvc, 0);
+	if (!rc && csvc == NULL)
+		rc = ENOTCONN;
+	if (!rc)
+		rc = slrpc_batch_req_add(pci->fci_resm->resm_res,
+		    &msl_batch_workq, csvc, SRMT_CREATE,
+		    SRCM_BULK_PORTAL, SRMC_BULK_PORTAL, &mq, sizeof(mq),
+		    cpend, &msl_batch_rep_create, 1,
+		    MAX(msl_async_create_batch, 1));
+	if (rc) {
+		if (csvc)
+			sl_csvc_decref(csvc);
+		rc = abs(rc);
+		msl_create_batch_cb(NULL, NULL, cpend, rc);
+		PSCFREE(cpend);
+		fcmh_op_done(c);
+		return (rc);
+	}
+	OPSTAT_INCR("msl.create-async");
+	*cp = c;
+	return (0);
+}
+
 void
 mslfsop_create(struct pscfs_req *pfr, pscfs_inum_t pinum,
     const char *name, int oflags, mode_t mode)
 {
-	int rc = 0, rc2, rflags = 0;
+	int rc = 0, rflags = 0, async = 0;
 	struct fidc_membh *c = NULL, *p = NULL;
 	struct slrpc_cservice *csvc = NULL;
 	struct pscrpc_request *rq = NULL;
@@ -444,14 +842,15 @@ mslfsop_create(struct pscfs_req *pfr, pscfs_inum_t pinum,
 	struct srm_create_rep *mp = NULL;
 	struct msl_fhent *mfh = NULL;
 	struct fcmh_cli_info *fci = NULL;
-	struct bmap_cli_info *bci;
+	struct srt_stat cattr;
 	struct pscfs_creds pcr;
 	struct stat stb;
-	struct bmap *b;
 	int32_t lease = 0;
 
 	pfl_assert(oflags & O_CREAT);
 
+	memset(&cattr, 0, sizeof(cattr));
+
 	if (msl_read_only)
 		PFL_GOTOERR(out, rc = EROFS);
 	if (!msl_progallowed(pfr))
@@ -479,6 +878,30 @@ mslfsop_create(struct pscfs_req *pfr, pscfs_inum_t pinum,
 	if (rc)
 		PFL_GOTOERR(out, rc);
 
+	rc = msl_unlink_wait(p);
+	if (rc)
+		PFL_GOTOERR(out, rc);
+
+	/*
+	 * Default ACLs are applied by the MDS, so we cannot predict the
+	 * mode of the new file with them enabled.  The name cache is
+	 * what keeps lookups from going to the MDS before it knows.
+	 */
+	if (msl_async_create && !msl_acl && msl_enable_namecache &&
+	    fcmh_2_fci(p)->fci_resm == msl_rmc_resm) {
+		rc = msl_create_async(pfr, p, name,
+		    !(mode & 0777) ? (0666 & ~pscfs_getumask(pfr)) : mode,
+		    &pcr, &cattr, &c);
+		if (rc == 0) {
+			async = 1;
+			lease = msl_attributes_timeout;
+			goto created;
+		}
+		if (rc != EAGAIN)
+			PFL_GOTOERR(out, rc);
+		rc = 0;
+	}
+
  retry1:
 
 	MSL_RMC_NEWREQ(p, csvc, SRMT_CREATE, rq, mq, mp, rc, 0);
@@ -510,14 +933,17 @@ mslfsop_create(struct pscfs_req *pfr, pscfs_inum_t pinum,
 
 	lease = mp->lease;
 	slc_fcmh_setattr(p, &mp->pattr, lease);
+	cattr = mp->cattr;
 
-	rc = msl_fcmh_get_fg(pfr, &mp->cattr.sst_fg, &c);
+	rc = msl_fcmh_get_fg(pfr, &cattr.sst_fg, &c);
 	if (rc)
 		PFL_GOTOERR(out, rc);
 
 	msl_invalidate_readdir(p);
 	dircache_insert(p, name, fcmh_2_fid(c), lease);
 
+ created:
+
 #if 0
 	if (oflags & O_APPEND) {
 		FCMH_LOCK(c);
@@ -540,8 +966,9 @@ mslfsop_create(struct pscfs_req *pfr, pscfs_inum_t pinum,
 	    sizeof(mfh->mfh_open_atime));
 
 	FCMH_LOCK(c);
-	slc_fcmh_setattrf(c, &mp->cattr, FCMH_SETATTRF_HAVELOCK |
-	    FCMH_SETATTRF_CLOBBER, msl_attributes_timeout);
+	if (!async)
+		slc_fcmh_setattrf(c, &cattr, FCMH_SETATTRF_HAVELOCK |
+		    FCMH_SETATTRF_CLOBBER, msl_attributes_timeout);
 	msl_internalize_stat(&c->fcmh_sstb, &stb);
 
 	fci = fcmh_2_fci(c);
@@ -551,8 +978,11 @@ mslfsop_create(struct pscfs_req *pfr, pscfs_inum_t pinum,
 
 	// XXX bug fci->fci_inode.reptbl inherited?
 
-	fci->fci_inode.reptbl[0].bs_id = mp->sbd.sbd_ios;
-	fci->fci_inode.nrepls = 1;
+	/* an async create learns the IOS from the batch reply */
+	if (!async) {
+		fci->fci_inode.reptbl[0].bs_id = mp->sbd.sbd_ios;
+		fci->fci_inode.nrepls = 1;
+	}
 
 	// XXX bug fci->fci_inode.flags inherited?
 	// XXX bug fci->fci_inode.newreplpol inherited?
@@ -565,44 +995,12 @@ mslfsop_create(struct pscfs_req *pfr, pscfs_inum_t pinum,
 	fci->fci_nopen = 1;
 	FCMH_ULOCK(c);
 
-	/*
-	 * Any errors encountered here cannot affect the return status
-	 * of the open(2).  If they were to, the namei cache in the
-	 * kernel would get confused thinking there the error here was a
-	 * failure of the creation itself.
-	 *
-	 * Instead, wait for the application to perform some actual I/O
-	 * to retrieve bmap lease on-demand.
-	 */
-	if (mp->rc2) {
-		OPSTAT_INCR("bmap-preload-err");
-		PFL_GOTOERR(out, mp->rc2);
-	}
-	OPSTAT_INCR("bmap-preload-ok");
-
 	/*
 	 * Instantiate a bmap and load it with the piggybacked lease
 	 * from the above create RPC.
 	 */
-	rc2 = bmap_getf(c, 0, SL_WRITE, BMAPGETF_CREATE |
-	    BMAPGETF_NORETRIEVE, &b);
-	if (rc2)
-		PFL_GOTOERR(out, rc2);
-
-	b->bcm_flags |= BMAPF_LOADED;
-	msl_bmap_stash_lease(b, &mp->sbd, "preload");
-	msl_bmap_reap_init(b);
-
-	/* 05/09/2017: random crash here: bcm_bmapno = 4026567200 */
-	DEBUG_BMAP(PLL_DIAG, b, "ios(%s) sbd_seq=%"PRId64,
-	    libsl_ios2name(mp->sbd.sbd_ios), mp->sbd.sbd_seq);
-
-	bci = bmap_2_bci(b);
-	// XXX this is wrong if the fcmh inherited from a dir with a
-	// reptbl!
-	SL_REPL_SET_BMAP_IOS_STAT(bci->bci_repls, 0, BREPLST_VALID);
-
-	bmap_op_done(b);
+	if (!async)
+		msl_create_preload_bmap(c, mp);
 
 #ifdef DO_DEBUG
 	if (strcmp(name, "prslerr.c") == 0) {
@@ -613,15 +1011,14 @@ mslfsop_create(struct pscfs_req *pfr, pscfs_inum_t pinum,
 #endif
 
  out:
-	pscfs_reply_create(pfr, mp ? mp->cattr.sst_fid : 0,
-	    mp ? mp->cattr.sst_gen : 0, (double)lease, &stb,
-	    (double)lease, mfh, rflags, rc);
+	pscfs_reply_create(pfr, cattr.sst_fid, cattr.sst_gen,
+	    (double)lease, &stb, (double)lease, mfh, rflags, rc);
 
 	psclogs(rc ? PLL_WARN : PLL_DIAG, SLCSS_FSOP, "CREATE: pfid="SLPRI_FID" "
 	//psclogs(PLL_WARN, SLCSS_FSOP, "CREATE: pfid="SLPRI_FID" "
-	    "cfid="SLPRI_FID" name='%s' mode=%#o oflags=%#o nopen=%d rc=%d",
-	    pinum, mp ? mp->cattr.sst_fid : FID_ANY, name, mode, 
-	    oflags, fci ? fci->fci_nopen : -1, rc);
+	    "cfid="SLPRI_FID" name='%s' mode=%#o oflags=%#o nopen=%d "
+	    "async=%d rc=%d", pinum, c ? fcmh_2_fid(c) : FID_ANY, name,
+	    mode, oflags, fci ? fci->fci_nopen : -1, async, rc);
 
 	if (c)
 		fcmh_op_done(c);
@@ -639,7 +1036,7 @@ msl_open(struct pscfs_req *pfr, pscfs_inum_t inum, int oflags,
 	struct fidc_membh *c = NULL;
 	struct pscfs_creds pcr;
 	struct fcmh_cli_info *fci = NULL;
-	int rc = 0;
+	int rc = 0, prefetch;
 	struct timeval now;
 
 	*mfhp = NULL;
@@ -720,9 +1117,21 @@ msl_open(struct pscfs_req *pfr, pscfs_inum_t inum, int oflags,
 	}
 	FCMH_LOCK(c);
 	fci = fcmh_2_fci(c);
+	prefetch = !fci->fci_nopen && msl_open_prefetch_size &&
+	    fcmh_isreg(c) && (oflags & O_ACCMODE) == O_RDONLY;
 	fci->fci_nopen++;
 	fcmh_op_start_type(c, FCMH_OPCNT_OPEN);
 
+	/*
+	 * Small files are usually read whole right after being opened,
+	 * so fetch the bmap lease and the data now instead of paying
+	 * for both round trips in the first read().
+	 */
+	if (prefetch) {
+		FCMH_ULOCK(c);
+		msl_open_prefetch(c);
+	}
+
 
  out1:
 
@@ -776,7 +1185,7 @@ msl_stat(struct fidc_membh *f, void *arg)
 	struct srm_getattr_rep *mp;
 	struct fcmh_cli_info *fci;
 	struct timeval now;
-	int rc = 0, timeout;
+	int rc = 0, timeout, renew;
 	int32_t lease = 0;
 
 	fci = fcmh_2_fci(f);
@@ -802,8 +1211,18 @@ msl_stat(struct fidc_membh *f, void *arg)
 		if (now.tv_sec < fci->fci_expire) {
 			DEBUG_FCMH(PLL_DIAG, f,
 			    "attrs retrieved from local cache");
+			renew = fcmh_isreg(f) && msl_getattr_batch &&
+			    fci->fci_nopen &&
+			    fci->fci_expire - now.tv_sec <
+			    msl_attr_lease_renew &&
+			    !(f->fcmh_flags & (FCMH_CLI_RENEWING |
+			    FCMH_CLI_DIRTY_ATTRS));
+			if (renew)
+				f->fcmh_flags |= FCMH_CLI_RENEWING;
 			FCMH_ULOCK(f);
 			OPSTAT_INCR("attr-cached");
+			if (renew)
+				msl_attr_renew(f);
 			return (0);
 		}
 		OPSTAT_INCR("attr-timeout");
@@ -814,6 +1233,11 @@ msl_stat(struct fidc_membh *f, void *arg)
 	f->fcmh_flags |= FCMH_GETTING_ATTRS;
 	FCMH_ULOCK(f);
 
+	/* the MDS does not know about it until its create goes out */
+	rc = msl_nsop_wait(f);
+	if (rc)
+		goto out;
+
 	do {
 		timeout = 0;
 		if (fcmh_2_fid(f) == SLFID_ROOT) {
@@ -871,6 +1295,192 @@ msl_stat(struct fidc_membh *f, void *arg)
 	return (rc);
 }
 
+/*
+ * Apply the reply to one GETATTR of a batch, or fail it.  Called once
+ * per item from a worker thread when the batch reply arrives or the
+ * batch is abandoned.
+ */
+void
+msl_getattr_batch_cb(__unusedx void *req, void *rep, void *scratch,
+    int rc)
+{
+	struct fidc_membh *f = *(struct fidc_membh **)scratch;
+	struct srm_getattr_rep *mp = rep;
+
+	if (!rc && mp == NULL)
+		rc = EINVAL;
+	if (!rc)
+		rc = -mp->rc;
+
+	FCMH_LOCK(f);
+	if (!rc && fcmh_2_fid(f) != mp->attr.sst_fid)
+		rc = EBADF;
+	if (!rc) {
+		slc_fcmh_setattrf(f, &mp->attr, FCMH_SETATTRF_HAVELOCK |
+		    (f->fcmh_flags & FCMH_CLI_RENEWING ?
+		     FCMH_SETATTRF_RENEW : 0), mp->lease);
+		msl_fcmh_stash_xattrsize(f, mp->xattrsize);
+		OPSTAT_INCR("msl.getattr-batch-ok");
+	} else
+		OPSTAT_INCR("msl.getattr-batch-err");
+	/* a lease renewal leaves stat(2) alone while it is out */
+	if (f->fcmh_flags & FCMH_CLI_RENEWING)
+		f->fcmh_flags &= ~FCMH_CLI_RENEWING;
+	else
+		f->fcmh_flags &= ~FCMH_GETTING_ATTRS;
+	fcmh_wake_locked(f);
+
+	DEBUG_FCMH(PLL_DEBUG, f, "attrs retrieved via batch rc=%d", rc);
+	fcmh_op_done(f);
+}
+
+struct slrpc_batch_rep_handler msl_batch_rep_getattr = {
+	msl_getattr_batch_cb,
+	sizeof(struct srm_getattr_req),
+	sizeof(struct srm_getattr_rep)
+};
+
+/*
+ * Queue a batched GETATTR for each file of a freshly loaded readdir
+ * page that is already in the fidcache but whose attributes have
+ * expired.  New files get their attributes from the readdir reply
+ * itself; without this, every stat(2) of an `ls -l' or find(1) that
+ * follows would pay a round trip for each of the others.
+ *
+ * While the batch is out, FCMH_GETTING_ATTRS is held so that a
+ * concurrent msl_stat() waits for the batch instead of sending its
+ * own GETATTR.  Each batch is sized to what is left to send so that
+ * the last one fills up and goes out right away instead of waiting
+ * for the batch RPC thread to expire it.
+ *
+ * @fgs: FIDs of the files to refresh.
+ */
+void
+msl_getattr_batch_add(struct psc_dynarray *fgs)
+{
+	struct psc_dynarray a = DYNARRAY_INIT;
+	struct slrpc_cservice *csvc = NULL;
+	struct srm_getattr_req mq;
+	struct fcmh_cli_info *fci;
+	struct sl_fidgen *fgp;
+	struct fidc_membh *f;
+	struct timeval now;
+	int i, n, rc = 0;
+	void *scratch;
+
+	if (!msl_getattr_batch)
+		return;
+
+	PFL_GETTIMEVAL(&now);
+	DYNARRAY_FOREACH(fgp, i, fgs) {
+		if (msl_fcmh_peek_fg(fgp, &f, NULL))
+			continue;
+
+		fci = fcmh_2_fci(f);
+		FCMH_LOCK(f);
+		if (f->fcmh_flags & (FCMH_GETTING_ATTRS |
+		    FCMH_CLI_DIRTY_ATTRS | FCMH_CLI_RENEWING) ||
+		    ((f->fcmh_flags & FCMH_HAVE_ATTRS) &&
+		     now.tv_sec < fci->fci_expire)) {
+			fcmh_op_done(f);
+			continue;
+		}
+		f->fcmh_flags &= ~FCMH_HAVE_ATTRS;
+		f->fcmh_flags |= FCMH_GETTING_ATTRS;
+		FCMH_ULOCK(f);
+		psc_dynarray_add(&a, f);
+	}
+
+	/* not worth a batch; let stat(2) fetch them one by one */
+	n = psc_dynarray_len(&a);
+	if (n < SLRPC_BATCH_MIN_COUNT)
+		rc = EAGAIN;
+
+	DYNARRAY_FOREACH(f, i, &a) {
+		if (rc) {
+			msl_getattr_batch_cb(NULL, NULL, &f, rc);
+			continue;
+		}
+
+		fci = fcmh_2_fci(f);
+		memset(&mq, 0, sizeof(mq));
+		mq.fg = f->fcmh_fg;
+		mq.iosid = msl_pref_ios;
+
+		/* the batch owns the fcmh reference until the reply */
+		scratch = PSCALLOC(sizeof(f));
+		*(struct fidc_membh **)scratch = f;
+
+		rc = slc_rmc_getcsvc(fci->fci_resm, &csvc, 0);
+		if (!rc && csvc == NULL)
+			rc = ENOTCONN;
+		if (!rc)
+			rc = slrpc_batch_req_add(fci->fci_resm->resm_res,
+			    &msl_batch_workq, csvc, SRMT_GETATTR,
+			    SRCM_BULK_PORTAL, SRMC_BULK_PORTAL, &mq,
+			    sizeof(mq), scratch, &msl_batch_rep_getattr,
+			    0, MIN(msl_getattr_batch, n - i));
+		if (rc) {
+			if (csvc) {
+				sl_csvc_decref(csvc);
+				csvc = NULL;
+			}
+			PSCFREE(scratch);
+			rc = abs(rc);
+			msl_getattr_batch_cb(NULL, NULL, &f, rc);
+			continue;
+		}
+		csvc = NULL;
+		OPSTAT_INCR("msl.getattr-batch-add");
+	}
+	psc_dynarray_free(&a);
+}
+
+/*
+ * Renew the attribute lease of a file in use before it runs out, so
+ * that stat(2) keeps being answered from the cache for as long as the
+ * MDS does not revoke it.  The GETATTR is added to a batch shared
+ * with other files and sent when the batch fills up or a second
+ * later, so a client using many files renews them a batch at a time.
+ * The caller has set FCMH_CLI_RENEWING.
+ */
+void
+msl_attr_renew(struct fidc_membh *f)
+{
+	struct slrpc_cservice *csvc = NULL;
+	struct srm_getattr_req mq;
+	struct fcmh_cli_info *fci;
+	void *scratch;
+	int rc;
+
+	fci = fcmh_2_fci(f);
+	memset(&mq, 0, sizeof(mq));
+	mq.fg = f->fcmh_fg;
+	mq.iosid = msl_pref_ios;
+
+	/* the batch owns this reference until the reply */
+	fcmh_op_start_type(f, FCMH_OPCNT_LOOKUP_FIDC);
+	scratch = PSCALLOC(sizeof(f));
+	*(struct fidc_membh **)scratch = f;
+
+	rc = slc_rmc_getcsvc(fci->fci_resm, &csvc, 0);
+	if (!rc && csvc == NULL)
+		rc = ENOTCONN;
+	if (!rc)
+		rc = slrpc_batch_req_add(fci->fci_resm->resm_res,
+		    &msl_batch_workq, csvc, SRMT_GETATTR,
+		    SRCM_BULK_PORTAL, SRMC_BULK_PORTAL, &mq, sizeof(mq),
+		    scratch, &msl_batch_rep_getattr, 1, msl_getattr_batch);
+	if (rc) {
+		if (csvc)
+			sl_csvc_decref(csvc);
+		PSCFREE(scratch);
+		msl_getattr_batch_cb(NULL, NULL, &f, abs(rc));
+		return;
+	}
+	OPSTAT_INCR("msl.attr-lease-renew");
+}
+
 void
 mslfsop_getattr(struct pscfs_req *pfr, pscfs_inum_t inum)
 {
@@ -911,6 +1521,12 @@ mslfsop_getattr(struct pscfs_req *pfr, pscfs_inum_t inum)
 	PFL_GETTIMEVAL(&now);
 	fci = fcmh_2_fci(f);
 	timeout = fci->fci_expire > now.tv_sec ? fci->fci_expire - now.tv_sec : 0;
+	/*
+	 * Attribute leases can be revoked, which the kernel would not
+	 * hear about; have it come back to our cache now and then.
+	 */
+	if (timeout > msl_attributes_timeout)
+		timeout = msl_attributes_timeout;
 
  out:
 	if (f)
@@ -977,6 +1593,13 @@ mslfsop_link(struct pscfs_req *pfr, pscfs_inum_t c_inum,
 	    FID_GET_SITEID(fcmh_2_fid(c)))
 		PFL_GOTOERR(out, rc = EXDEV);
 
+	rc = msl_nsop_wait(c);
+	if (rc)
+		PFL_GOTOERR(out, rc);
+	rc = msl_unlink_wait(p);
+	if (rc)
+		PFL_GOTOERR(out, rc);
+
  retry:
 	MSL_RMC_NEWREQ(p, csvc, SRMT_LINK, rq, mq, mp, rc, 0);
 	if (!rc) {
@@ -1068,6 +1691,10 @@ mslfsop_mkdir(struct pscfs_req *pfr, pscfs_inum_t pinum,
 	if (p->fcmh_sstb.sst_mode & S_ISGID)
 		mode |= S_ISGID;
 
+	rc = msl_unlink_wait(p);
+	if (rc)
+		PFL_GOTOERR(out, rc);
+
  retry1:
 
 	MSL_RMC_NEWREQ(p, csvc, SRMT_MKDIR, rq, mq, mp, rc, 0);
@@ -1143,6 +1770,9 @@ msl_lookup_rpc(struct pscfs_req *pfr, struct fidc_membh *p,
 	int rc;
 	int32_t lease = 0;
 
+	/* the MDS would still find a name we have unlinked */
+	msl_unlink_wait(p);
+
  retry:
 	MSL_RMC_NEWREQ(p, csvc, SRMT_LOOKUP, rq, mq, mp, rc, 0);
 	if (!rc) {
@@ -1158,6 +1788,8 @@ msl_lookup_rpc(struct pscfs_req *pfr, struct fidc_membh *p,
 	rc = abs(rc);
 	if (rc == 0)
 		rc = -mp->rc;
+	if (rc == ENOENT)
+		dircache_insert_neg(p, name);
 	if (rc)
 		PFL_GOTOERR(out, rc);
 
@@ -1297,7 +1929,9 @@ msl_lookup_fidcache(struct pscfs_req *pfr,
 	if (rc)
 		PFL_GOTOERR(out, rc);
 
-	dircache_lookup(p, name, &inum);
+	rc = dircache_lookup(p, name, &inum);
+	if (rc)
+		PFL_GOTOERR(out, rc);
 	if (inum) {
 		OPSTAT_INCR("msl.dircache-lookup-hit");
 		/* will call msl_stat() if necessary */
@@ -1495,6 +2129,145 @@ msl_create_sillyname(struct fidc_membh *f, pscfs_inum_t pinum, const char *name,
 	return (rc);
 }
 
+struct msl_unlink_pending {
+	struct fidc_membh	*up_p;
+	char			 up_name[SL_NAME_MAX + 1];
+};
+
+/*
+ * Apply the reply to one asynchronous UNLINK of a batch, or fail it.
+ * unlink(2) has already returned, so on failure the name is put back
+ * and the error is kept on the directory for the next operation that
+ * waits on it, e.g. rmdir(2) or fsync(2).
+ */
+void
+msl_unlink_batch_cb(__unusedx void *req, void *rep, void *scratch,
+    int rc)
+{
+	struct msl_unlink_pending *upend = scratch;
+	struct fidc_membh *p = upend->up_p, *c;
+	struct srm_unlink_rep *mp = rep;
+	struct fcmh_cli_info *fci;
+
+	if (!rc && mp == NULL)
+		rc = EINVAL;
+	if (!rc)
+		rc = -mp->rc;
+
+	if (rc) {
+		DEBUG_FCMH(PLL_WARN, p, "async unlink of '%s' failed, "
+		    "rc=%d", upend->up_name, rc);
+		OPSTAT_INCR("msl.unlink-async-err");
+		dircache_delete(p, upend->up_name);
+	} else {
+		OPSTAT_INCR("msl.unlink-async-ok");
+		slc_fcmh_setattr(p, &mp->pattr, mp->lease);
+
+		if (sl_fcmh_lookup(mp->cattr.sst_fg.fg_fid, FGEN_ANY, 0,
+		    &c, NULL) == 0) {
+			FCMH_LOCK(c);
+			if (mp->valid)
+				slc_fcmh_setattr_locked(c, &mp->cattr,
+				    mp->lease);
+			else
+				c->fcmh_flags |= FCMH_DELETED;
+			fcmh_op_done(c);
+		}
+	}
+
+	FCMH_LOCK(p);
+	fci = fcmh_2_fci(p);
+	if (rc && !fci->fci_nsop_rc)
+		fci->fci_nsop_rc = rc;
+	fci->fci_nunlinks--;
+	fci->fci_nsops--;
+	fcmh_wake_locked(p);
+	fcmh_op_done_type(p, FCMH_OPCNT_ASYNC_NSOP);
+}
+
+struct slrpc_batch_rep_handler msl_batch_rep_unlink = {
+	msl_unlink_batch_cb,
+	sizeof(struct srm_unlink_req),
+	sizeof(struct srm_unlink_rep)
+};
+
+/*
+ * Unlink a file without waiting for the MDS by queueing the UNLINK on
+ * a batch.  This is only done when the name cache tells us which file
+ * goes away and that file is not open here, since otherwise it would
+ * need a silly rename.  Returns EAGAIN if the caller should unlink
+ * synchronously instead.
+ */
+static int
+msl_unlink_async(struct fidc_membh *p, const char *name)
+{
+	struct slrpc_cservice *csvc = NULL;
+	struct msl_unlink_pending *upend;
+	struct srm_unlink_req mq;
+	struct fcmh_cli_info *pci;
+	struct fidc_membh *c;
+	uint64_t inum;
+	int rc, busy;
+
+	dircache_lookup(p, name, &inum);
+	if (!inum)
+		return (EAGAIN);
+	if (msl_fcmh_peek_fid(inum, &c, NULL) == 0) {
+		FCMH_LOCK(c);
+		busy = fcmh_2_fci(c)->fci_nopen ||
+		    (c->fcmh_flags & (FCMH_CLI_SILLY_RENAME |
+		     FCMH_CLI_CREATING));
+		fcmh_op_done(c);
+		if (busy)
+			return (EAGAIN);
+	}
+
+	memset(&mq, 0, sizeof(mq));
+	mq.pfid = fcmh_2_fid(p);
+	strlcpy(mq.name, name, sizeof(mq.name));
+
+	pci = fcmh_2_fci(p);
+	FCMH_LOCK(p);
+	pci->fci_nsops++;
+	pci->fci_nunlinks++;
+	fcmh_op_start_type(p, FCMH_OPCNT_ASYNC_NSOP);
+	FCMH_ULOCK(p);
+
+	msl_invalidate_readdir(p);
+	dircache_delete(p, name);
+	dircache_insert_neg(p, name);
+
+	/* the batch owns the parent reference until the reply */
+	upend = PSCALLOC(sizeof(*upend));
+	upend->up_p = p;
+	strlcpy(upend->up_name, name, sizeof(upend->up_name));
+
+	rc = slc_rmc_getcsvc(pci->fci_resm, &csvc, 0);
+	if (!rc && csvc == NULL)
+		rc = ENOTCONN;
+	if (!rc)
+		rc = slrpc_batch_req_add(pci->fci_resm->resm_res,
+		    &msl_batch_workq, csvc, SRMT_UNLINK,
+		    SRCM_BULK_PORTAL, SRMC_BULK_PORTAL, &mq, sizeof(mq),
+		    upend, &msl_batch_rep_unlink, 1,
+		    MAX(msl_async_unlink_batch, 1));
+	if (rc) {
+		if (csvc)
+			sl_csvc_decref(csvc);
+		PSCFREE(upend);
+		dircache_delete(p, name);
+
+		FCMH_LOCK(p);
+		pci->fci_nunlinks--;
+		pci->fci_nsops--;
+		fcmh_wake_locked(p);
+		fcmh_op_done_type(p, FCMH_OPCNT_ASYNC_NSOP);
+		return (EAGAIN);
+	}
+	OPSTAT_INCR("msl.unlink-async");
+	return (0);
+}
+
 __static void
 msl_unlink(struct pscfs_req *pfr, pscfs_inum_t pinum, const char *name,
     int isfile)
@@ -1530,6 +2303,23 @@ msl_unlink(struct pscfs_req *pfr, pscfs_inum_t pinum, const char *name,
 	if (pinum == SLFID_ROOT && strcmp(name, MSL_FIDNS_RPATH) == 0)
 		PFL_GOTOERR(out, rc = EPERM);
 
+	/*
+	 * The entry may still be an asynchronous create the MDS has not
+	 * seen yet.  For rmdir(2), the directory has to be drained of
+	 * those and of asynchronous unlinks, any of which that failed is
+	 * reported here.
+	 */
+	dircache_lookup(p, name, &inum);
+	if (inum && msl_fcmh_peek_fid(inum, &c, NULL) == 0) {
+		rc = isfile ? msl_nsop_wait(c) : msl_nsop_wait_report(c);
+		fcmh_op_done(c);
+		c = NULL;
+		if (rc && !isfile)
+			PFL_GOTOERR(out, rc);
+		rc = 0;
+	} else if (!inum)
+		msl_nsop_wait(p);
+
 	slc_getfscreds(pfr, &pcr, 1);
 
 	FCMH_LOCK(p);
@@ -1555,6 +2345,13 @@ msl_unlink(struct pscfs_req *pfr, pscfs_inum_t pinum, const char *name,
 	if (rc)
 		PFL_GOTOERR(out, rc);
 
+	if (isfile && msl_async_unlink && msl_enable_namecache) {
+		rc = msl_unlink_async(p, name);
+		if (rc != EAGAIN)
+			PFL_GOTOERR(out, rc);
+		rc = 0;
+	}
+
 	/*
  	 * Look up the name cache, if found the file is open, do a silly remame
  	 * and store the silly name into the fcmh.
@@ -1712,6 +2509,10 @@ mslfsop_mknod(struct pscfs_req *pfr, pscfs_inum_t pinum,
 	if (rc)
 		PFL_GOTOERR(out, rc);
 
+	rc = msl_unlink_wait(p);
+	if (rc)
+		PFL_GOTOERR(out, rc);
+
  retry1:
 
 	MSL_RMC_NEWREQ(p, csvc, SRMT_MKNOD, rq, mq, mp, rc, 0);
@@ -1842,7 +2643,7 @@ msl_readdir_cb(struct pscrpc_request *rq, struct pscrpc_async_args *av)
 	struct fidc_membh *d = av->pointer_arg[MSL_READDIR_CBARG_FCMH];
 	void *dentbuf = av->pointer_arg[MSL_READDIR_CBARG_DENTBUF];
 	char buf[PSCRPC_NIDSTR_SIZE];
-	int rc, async;
+	int rc, async, more;
 	size_t len;
 
 	SL_GET_RQ_STATUSF(csvc, rq, mp,
@@ -1884,6 +2685,8 @@ msl_readdir_cb(struct pscrpc_request *rq, struct pscrpc_async_args *av)
 	async = p->dcp_flags & DIRCACHEPGF_ASYNC;
 	pfl_assert(p->dcp_flags & DIRCACHEPGF_LOADING);
 	p->dcp_flags &= ~(DIRCACHEPGF_LOADING | DIRCACHEPGF_ASYNC);
+	more = !rc && async && !(p->dcp_flags & DIRCACHEPGF_EOF) &&
+	    fcmh_2_fci(d)->fcid_ra_window > 1;
 
 	if (p->dcp_flags & DIRCACHEPGF_WAIT) {
 		p->dcp_flags &= ~DIRCACHEPGF_WAIT;
@@ -1908,6 +2711,12 @@ msl_readdir_cb(struct pscrpc_request *rq, struct pscrpc_async_args *av)
 		    p->dcp_off, rc);
 	}
 
+	/* extend the readdir-ahead pipeline past the page that landed */
+	if (more) {
+		DIRCACHE_WRLOCK(d);
+		msl_readdir_ra(d);
+	}
+
 	fcmh_op_done_type(d, FCMH_OPCNT_READDIR);
 	sl_csvc_decref(csvc);
 
@@ -1938,6 +2747,10 @@ msl_readdir_issue(struct fidc_membh *d, off_t off, size_t size,
 		DIRCACHE_ULOCK(d);
 		return (-ESRCH);
 	}
+	if (!block) {
+		p->dcp_flags |= DIRCACHEPGF_RA;
+		psc_atomic32_inc(&msl_readdir_ra_npages);
+	}
 
 	DIRCACHE_ULOCK(d);
 	fcmh_op_start_type(d, FCMH_OPCNT_READDIR);
@@ -2006,6 +2819,57 @@ msl_readdir_issue(struct fidc_membh *d, off_t off, size_t size,
 	return (rc);
 }
 
+/*
+ * Keep a sequential directory reader supplied: walk the pages that
+ * follow the cookie it has reached and, if fewer than its window are
+ * loaded or loading, issue a READDIR for the next one.  Since a cookie
+ * is only known once the page before it has arrived, the pipeline is
+ * extended one page at a time, from here and from the READDIR callback,
+ * and each readahead READDIR asks for a window's worth of entries so a
+ * long listing costs fewer round trips.
+ *
+ * Called with the dircache write locked; returns with it released.
+ * @d: directory handle.
+ */
+void
+msl_readdir_ra(struct fidc_membh *d)
+{
+	struct fcmh_cli_info *fci = fcmh_2_fci(d);
+	struct dircache_page *p;
+	off_t off;
+	size_t size;
+	int n;
+
+	DIRCACHE_WR_ENSURE(d);
+
+	off = fci->fcid_ra_off;
+	size = fci->fcid_ra_size;
+	/* pages read now would miss entries still being created */
+	if (!off || !size || fci->fci_nsops) {
+		DIRCACHE_ULOCK(d);
+		return;
+	}
+	for (n = 0; (p = dircache_find_page(d, off)); n++) {
+		if (p->dcp_flags & (DIRCACHEPGF_LOADING |
+		    DIRCACHEPGF_EOF) || p->dcp_rc ||
+		    n + 1 >= fci->fcid_ra_window) {
+			DIRCACHE_ULOCK(d);
+			return;
+		}
+		off = p->dcp_nextoff;
+	}
+	if (psc_atomic32_read(&msl_readdir_ra_npages) >=
+	    msl_readdir_ra_maxpages) {
+		OPSTAT_INCR("msl.readdir-ra-throttle");
+		DIRCACHE_ULOCK(d);
+		return;
+	}
+	size = MAX(size, MIN(size * fci->fcid_ra_window,
+	    MSL_READDIR_RA_MAXSIZE));
+	OPSTAT_INCR("msl.readdir-ra-issue");
+	msl_readdir_issue(d, off, size, 0);
+}
+
 void
 mslfsop_readdir(struct pscfs_req *pfr, size_t size, off_t off,
     void *data)
@@ -2047,6 +2911,11 @@ mslfsop_readdir(struct pscfs_req *pfr, size_t size, off_t off,
 		PFL_GOTOERR(out, rc);
 	}
 
+	/* reflect asynchronous creates and unlinks */
+	rc = msl_nsop_wait_report(d);
+	if (rc)
+		PFL_GOTOERR(out, rc);
+
 	DIRCACHE_WRLOCK(d);
 
 	fci = fcmh_2_fci(d);
@@ -2125,6 +2994,19 @@ mslfsop_readdir(struct pscfs_req *pfr, size_t size, off_t off,
 
 			// XXX I/O: remove from lock
 			pscfs_reply_readdir(pfr, p->dcp_base + poff, len, 0);
+			if ((p->dcp_flags & (DIRCACHEPGF_READ |
+			    DIRCACHEPGF_RA)) == DIRCACHEPGF_RA) {
+				/*
+				 * Sequential reader consuming what we
+				 * read ahead: deepen the pipeline.
+				 */
+				OPSTAT_INCR("msl.readdir-ra-hit");
+				psc_atomic32_dec(&msl_readdir_ra_npages);
+				fci->fcid_ra_window = MIN(msl_readdir_ra_max,
+				    fci->fcid_ra_window * 2);
+				if (fci->fcid_ra_window < 1)
+					fci->fcid_ra_window = 1;
+			}
 			p->dcp_flags |= DIRCACHEPGF_READ;
 			if (hit)
 				OPSTAT_INCR("msl.dircache-hit");
@@ -2147,6 +3029,8 @@ mslfsop_readdir(struct pscfs_req *pfr, size_t size, off_t off,
 			fcmh_op_start_type(d, FCMH_OPCNT_READAHEAD);
 			raoff = p->dcp_nextoff;
 			pfl_assert(raoff);
+			fci->fcid_ra_off = raoff;
+			fci->fcid_ra_size = size;
 
 			issue = 0;
 			break;
@@ -2159,6 +3043,9 @@ mslfsop_readdir(struct pscfs_req *pfr, size_t size, off_t off,
 		 * had an error.  Issue a READDIR then wait for a reply.
 		 */
 		hit = 0;
+		if (fci->fcid_ra_window > 1)
+			OPSTAT_INCR("msl.readdir-ra-miss");
+		fci->fcid_ra_window = 1;
 		rc = msl_readdir_issue(d, off, size, 1);
 		if (rc && !slc_rpc_should_retry(pfr, &rc))
 			PFL_GOTOERR(out, rc);
@@ -2167,7 +3054,7 @@ mslfsop_readdir(struct pscfs_req *pfr, size_t size, off_t off,
 	}
 
 	if (raoff) {
-		msl_readdir_issue(d, raoff, size, 0);
+		msl_readdir_ra(d);
 		fcmh_op_done_type(d, FCMH_OPCNT_READAHEAD);
 	}
 	return;
@@ -2527,6 +3414,7 @@ void
 mslfsop_flush(struct pscfs_req *pfr, void *data)
 {
 	struct msl_fhent *mfh = data;
+	struct fidc_membh *f = mfh->mfh_fcmh;
 	int rc, rc2;
 
 	DEBUG_FCMH(PLL_DIAG, mfh->mfh_fcmh, "flushing (mfh=%p)", mfh);
@@ -2536,6 +3424,16 @@ mslfsop_flush(struct pscfs_req *pfr, void *data)
 	if (!rc)
 		rc = rc2;
 
+	/*
+	 * Report a failed asynchronous create, but do not wait for a
+	 * pending one: that would cost every close(2) of a new file
+	 * the round trip async creation is meant to save.
+	 */
+	FCMH_LOCK(f);
+	if (!rc && !(f->fcmh_flags & FCMH_CLI_CREATING))
+		rc = fcmh_2_fci(f)->fci_nsop_rc;
+	FCMH_ULOCK(f);
+
 	DEBUG_FCMH(PLL_DIAG, mfh->mfh_fcmh,
 	    "done flushing (mfh=%p, rc=%d)", mfh, rc);
 
@@ -2773,6 +3671,13 @@ mslfsop_rename(struct pscfs_req *pfr, pscfs_inum_t opinum,
 			PFL_GOTOERR(out, rc);
 	}
 
+	/* either name may still be an asynchronous create or unlink */
+	rc = msl_nsop_wait_report(op);
+	if (!rc && np != op)
+		rc = msl_nsop_wait_report(np);
+	if (rc)
+		PFL_GOTOERR(out, rc);
+
  retry1:
 	MSL_RMC_NEWREQ(np, csvc, SRMT_RENAME, rq, mq, mp, rc, 0);
 	if (rc)
@@ -2859,13 +3764,17 @@ mslfsop_rename(struct pscfs_req *pfr, pscfs_inum_t opinum,
 
 	msl_invalidate_readdir(op);
 	dircache_delete(op, oldname); 
+
 	/*
+	 * Always drop whatever we had for the new name, including a
+	 * negative entry from an earlier failed lookup.
+	 *
  	 * XXX child is NULL for a simple rename in the same directory!
  	 */
-	if (child) {
-		msl_invalidate_readdir(np);
+	msl_invalidate_readdir(np);
+	dircache_delete(np, newname);
+	if (child)
 		dircache_insert(np, newname, fcmh_2_fid(child), lease); 
-	}
 
  out:
 	pscfs_reply_rename(pfr, rc);
@@ -3023,6 +3932,10 @@ mslfsop_symlink(struct pscfs_req *pfr, const char *buf,
 	if (rc)
 		PFL_GOTOERR(out, rc);
 
+	rc = msl_unlink_wait(p);
+	if (rc)
+		PFL_GOTOERR(out, rc);
+
  retry1:
 
 	MSL_RMC_NEWREQ(p, csvc, SRMT_SYMLINK, rq, mq, mp, rc, 0);
@@ -3148,6 +4061,10 @@ mslfsop_setattr(struct pscfs_req *pfr, pscfs_inum_t inum,
 	if (mfh)
 		pfl_assert(c == mfh->mfh_fcmh);
 
+	rc = msl_nsop_wait(c);
+	if (rc)
+		PFL_GOTOERR(out, rc);
+
 	FCMH_LOCK(c);
 	FCMH_WAIT_BUSY(c, 0);
 	fcmh_wait_locked(c, c->fcmh_flags & FCMH_CLI_TRUNC);
@@ -3468,6 +4385,10 @@ mslfsop_setattr(struct pscfs_req *pfr, pscfs_inum_t inum,
 			}
 		}
 
+		/* chmod(2) rewrites the ACL mask entry on the MDS. */
+		if (!rc && (to_set & PSCFS_SETATTRF_MODE))
+			msl_xattr_cache_purge(c);
+
 		/* See note below. */
 		if (!rc && (to_set & PSCFS_SETATTRF_MODE) &&
 		    fcmh_isdir(c)) {
@@ -3532,10 +4453,13 @@ mslfsop_fsync(struct pscfs_req *pfr, int datasync_only, void *data)
 	f = mfh->mfh_fcmh;
 	if (fcmh_isdir(f)) {
 		// XXX flush all fcmh attrs under dir
+		rc = msl_nsop_wait_report(f);
 	} else {
 		DEBUG_FCMH(PLL_DIAG, mfh->mfh_fcmh, "fsyncing");
 
-		rc = msl_flush(mfh);
+		rc = msl_nsop_wait(f);
+		if (!rc)
+			rc = msl_flush(mfh);
 		if (!datasync_only) {
 			int rc2;
 
@@ -3566,7 +4490,6 @@ mslfsop_destroy(__unusedx struct pscfs_req *pfr)
 	pscthr_setdead(slcconnthr, 1);
 
 	/* mark listcaches as dead */
-	lc_kill(&msl_bmapflushq);
 	lc_kill(&msl_bmaptimeoutq);
 	lc_kill(&msl_attrtimeoutq);
 	lc_kill(&msl_readaheadq);
@@ -3575,8 +4498,7 @@ mslfsop_destroy(__unusedx struct pscfs_req *pfr)
 	pscthr_setdead(sl_freapthr, 1);
 
 	/* wait for drain */
-	LISTCACHE_WAITEMPTY_UNLOCKED(&msl_bmapflushq,
-	    lc_nitems(&msl_bmapflushq));
+	bmap_flushq_drain();
 	LISTCACHE_WAITEMPTY_UNLOCKED(&msl_bmaptimeoutq,
 	    lc_nitems(&msl_bmaptimeoutq));
 	LISTCACHE_WAITEMPTY_UNLOCKED(&msl_attrtimeoutq,
@@ -3665,7 +4587,7 @@ mslfsop_destroy(__unusedx struct pscfs_req *pfr)
 	/* XXX wait for wkq to drain, or perhaps at the pflfs layer? */
 
 	pfl_listcache_destroy_registered(&msl_attrtimeoutq);
-	pfl_listcache_destroy_registered(&msl_bmapflushq);
+	bmap_flushq_destroy();
 	pfl_listcache_destroy_registered(&msl_bmaptimeoutq);
 	pfl_listcache_destroy_registered(&msl_readaheadq);
 	pfl_listcache_destroy_registered(&msl_readahead_pages);
@@ -3757,7 +4679,9 @@ mslfsop_listxattr(struct pscfs_req *pfr, size_t size, pscfs_inum_t inum)
 	struct fidc_membh *f = NULL;
 	struct pscfs_creds pcr;
 	struct iovec iov;
+	size_t retsz;
 	char *buf = NULL;
+	uint32_t xgen;
 	int rc;
 
 	if (size > LNET_MTU)
@@ -3807,6 +4731,18 @@ mslfsop_listxattr(struct pscfs_req *pfr, size_t size, pscfs_inum_t inum)
 	if (size)
 		buf = PSCALLOC(size);
 
+	if (msl_xattr_cache_lookup(f, NULL, buf, size, &retsz, &rc)) {
+		tmp.size = retsz;
+		mp = rc ? NULL : &tmp;
+		PFL_GOTOERR(out, rc);
+	}
+
+	rc = msl_nsop_wait(f);
+	if (rc)
+		PFL_GOTOERR(out, rc);
+
+	xgen = msl_xattr_cache_gen(f);
+
  retry1:
 	MSL_RMC_NEWREQ(f, csvc, SRMT_LISTXATTR, rq, mq, mp, rc, 0);
 	if (rc)
@@ -3836,8 +4772,11 @@ mslfsop_listxattr(struct pscfs_req *pfr, size_t size, pscfs_inum_t inum)
 		// XXX sanity check mp->size
 		iov.iov_len = mp->size;
 		rc = slrpc_bulk_checkmsg(rq, rq->rq_repmsg, &iov, 1);
-		if (rc == 0)
+		if (rc == 0) {
 			OPSTAT_INCR("msl.listxattr-bulk");
+			msl_xattr_cache_add(f, NULL, buf, mp->size, 0,
+			    xgen);
+		}
 	}
 	if (!rc && !size) {
 		FCMH_LOCK(f);
@@ -3871,6 +4810,10 @@ slc_setxattr(struct pscfs_req *pfr, const char *name,
  	 * XXX Do uid/gid mapping if the name is ACL_EA_ACCESS.
  	 */
 
+	rc = msl_nsop_wait(f);
+	if (rc)
+		return (rc);
+
  retry1:
 	MSL_RMC_NEWREQ(f, csvc, SRMT_SETXATTR, rq, mq, mp, rc, 0);
 	if (rc)
@@ -3902,6 +4845,7 @@ slc_setxattr(struct pscfs_req *pfr, const char *name,
 		 */
 		FCMH_LOCK(f);
 		f->fcmh_flags &= ~FCMH_CLI_XATTR_INFO;
+		msl_xattr_cache_purge(f);
 		FCMH_ULOCK(f);
 	}
 	pscrpc_req_finished(rq);
@@ -3962,6 +4906,7 @@ slc_getxattr(struct pscfs_req *pfr, const char *name, void *buf,
 	struct slrpc_cservice *csvc = NULL;
 	struct pscrpc_request *rq = NULL;
 	struct srm_getxattr_rep *mp;
+	uint32_t xgen;
 	struct srm_getxattr_req *mq;
 	struct fcmh_cli_info *fci;
 	struct iovec iov;
@@ -3984,10 +4929,19 @@ slc_getxattr(struct pscfs_req *pfr, const char *name, void *buf,
 			PFL_GOTOERR(out, rc);
 	}
 
+	if (msl_xattr_cache_lookup(f, name, buf, size, retsz, &rc))
+		PFL_GOTOERR(out, rc);
+
 	locked = FCMH_HAS_LOCK(f);
 	if (locked)
 		FCMH_ULOCK(f);
 
+	rc = msl_nsop_wait(f);
+	if (rc)
+		PFL_GOTOERR(out, rc);
+
+	xgen = msl_xattr_cache_gen(f);
+
  retry1:
 	MSL_RMC_NEWREQ(f, csvc, SRMT_GETXATTR, rq, mq, mp, rc, 0);
 	if (rc)
@@ -4020,6 +4974,12 @@ slc_getxattr(struct pscfs_req *pfr, const char *name, void *buf,
 	}
 	if (!rc)
 		*retsz = mp->valuelen;
+	/*
+	 * A size probe only tells us the length, so just remember the
+	 * value itself or its absence.
+	 */
+	if (rc == ENODATA || (!rc && size))
+		msl_xattr_cache_add(f, name, buf, *retsz, rc, xgen);
 
  out:
 	pscrpc_req_finished(rq);
@@ -4085,6 +5045,10 @@ slc_removexattr(struct pscfs_req *pfr, const char *name, struct fidc_membh *f)
 	struct srm_removexattr_req *mq;
 	struct pscrpc_request *rq = NULL;
 
+	rc = msl_nsop_wait(f);
+	if (rc)
+		return (rc);
+
  retry1:
 	MSL_RMC_NEWREQ(f, csvc, SRMT_REMOVEXATTR, rq, mq, mp, rc, 0);
 	if (rc)
@@ -4101,6 +5065,12 @@ slc_removexattr(struct pscfs_req *pfr, const char *name, struct fidc_membh *f)
 	rc = abs(rc);
 	if (rc == 0)
 		rc = -mp->rc;
+	if (rc == 0) {
+		FCMH_LOCK(f);
+		f->fcmh_flags &= ~FCMH_CLI_XATTR_INFO;
+		msl_xattr_cache_purge(f);
+		FCMH_ULOCK(f);
+	}
 	pscrpc_req_finished(rq);
 	if (csvc)
 		sl_csvc_decref(csvc);
@@ -4205,6 +5175,7 @@ msreapthr_main(struct psc_thread *thr)
  		 * Background reaping to make pages available before use.
  		 */
 		didwork = bmpce_reaper(bmpce_pool);
+		msl_pgcache_feed_waiters();
 		if (msl_bmpce_gen != last) {
 			idle = 0;
 			last = msl_bmpce_gen;
@@ -4318,6 +5289,7 @@ msl_init(void)
 	struct sl_resource *r;
 	struct sl_resm *m;
 	struct slrpc_cservice *csvc;
+	struct psc_thread *thr;
 	char *name;
 	time_t now;
 	int i, rc;
@@ -4385,6 +5357,7 @@ msl_init(void)
 	    struct bmpc_ioreq, biorq_lentry, PPMF_AUTO, 1024, 1024, 0,
 	    NULL, "biorq");
 	msl_biorq_pool = psc_poolmaster_getmgr(&msl_biorq_poolmaster);
+	bmpc_biorq_cache_init();
 
 	psc_poolmaster_init(&msl_mfh_poolmaster,
 	    struct msl_fhent, mfh_lentry, PPMF_AUTO, 64, 64, 0,
@@ -4403,6 +5376,15 @@ msl_init(void)
 	pscrpc_nbreapthr_spawn(sl_nbrqset, MSTHRT_NBRQ,
 	    NUM_NBRQ_THREADS, "msnbrqthr%d");
 
+	pfl_workq_init(128, 64, 256);
+	lc_reginit(&msl_batch_workq, struct pfl_workrq, wkrq_lentry,
+	    "batchworkq");
+	thr = pscthr_init(MSTHRT_WORKER, pfl_wkthr_main,
+	    sizeof(struct mswk_thread), "mswkthr");
+	mswkthr(thr)->mwt_wkthr.wkt_workq = &msl_batch_workq;
+	pscthr_setready(thr);
+	slrpc_batches_init(MSTHRT_BATCHRPC, SL_MOUNT, "ms");
+
 	msctlthr_spawn();
 
 	pfl_opstats_grad_init(&slc_iosyscall_iostats_rd, 0,
@@ -4422,6 +5404,7 @@ msl_init(void)
 	msreapthr_spawn(MSTHRT_REAP, "pool reapthr");
 	msattrflushthr_spawn();
 	msreadaheadthr_spawn();
+	mshedgethr_spawn();
 
 	name = getenv("MDS");
 	if (name == NULL)
@@ -4506,9 +5489,17 @@ msl_opt_lookup(const char *opt)
 		void		*ptr;
 	} *io, opts[] = {
 		{ "acl",		LOOKUP_TYPE_BOOL,	&msl_acl },
+		{ "async_create",	LOOKUP_TYPE_BOOL,	&msl_async_create },
+		{ "async_unlink",	LOOKUP_TYPE_BOOL,	&msl_async_unlink },
+		{ "attr_lease_renew",	LOOKUP_TYPE_INT,	&msl_attr_lease_renew },
 		{ "ctlsock",		LOOKUP_TYPE_STR,	&msl_ctlsockfn },
 		{ "datadir",		LOOKUP_TYPE_STR,	&sl_datadir },
+		{ "hedge_reads",	LOOKUP_TYPE_BOOL,	&msl_hedge_reads },
 		{ "mapfile",		LOOKUP_TYPE_BOOL,	&msl_has_mapfile },
+		{ "open_prefetch_size",	LOOKUP_TYPE_INT,	&msl_open_prefetch_size },
+		{ "pagecache_hugepages",
+					LOOKUP_TYPE_BOOL,	&msl_pgcache_hugepages },
+		{ "pagecache_lru",	LOOKUP_TYPE_BOOL,	&msl_pgcache_lru },
 		{ "pagecache_maxsize",	LOOKUP_TYPE_UINT64,	&msl_pagecache_maxsize },
 		{ "predio_issue_maxpages",
 					LOOKUP_TYPE_INT,	&msl_predio_max_pages},
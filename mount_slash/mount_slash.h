@@ -25,10 +25,12 @@
 #include <sys/statvfs.h>
 
 #include "pfl/atomic.h"
+#include "pfl/dynarray.h"
 #include "pfl/fs.h"
 #include "pfl/multiwait.h"
 #include "pfl/opstats.h"
 #include "pfl/service.h"
+#include "pfl/workthr.h"
 
 #include "bmap.h"
 #include "fidcache.h"
@@ -48,6 +50,7 @@ extern struct psc_thread *slcconnthr;
 /* mount_slash thread types */
 enum {
 	MSTHRT_ATTR_FLUSH = _PFL_NTHRT,	/* attr write data flush thread */
+	MSTHRT_BATCHRPC,		/* batch RPC transmitter */
 	MSTHRT_BENCH,			/* I/O benchmarking thread */
 	MSTHRT_BRELEASE,		/* bmap lease releaser */
 	MSTHRT_BWATCH,			/* bmap lease watcher */
@@ -57,6 +60,7 @@ enum {
 	MSTHRT_FREAP,			/* fcmh reap thread */
 	MSTHRT_FLUSH,			/* bmap write data flush thread */
 	MSTHRT_FSMGR,			/* pscfs manager */
+	MSTHRT_HEDGE,			/* hedged read timer */
 	MSTHRT_NBRQ,			/* non-blocking RPC reply handler */
 	MSTHRT_CONN,			/* monitor connection to peers */
 	MSTHRT_RCI,			/* service RPC reqs for CLI from ION */
@@ -88,6 +92,7 @@ struct msbwatch_thread {
 struct msflush_thread {
 	int				 mflt_failcnt;
 	int				 mflt_credits;
+	int				 mflt_home;	/* preferred flush queue */
 	struct pfl_multiwait		 mflt_mw;
 };
 
@@ -105,6 +110,10 @@ struct msreadahead_thread {
 	struct pfl_multiwait		 mrat_mw;
 };
 
+struct mswk_thread {
+	struct pfl_wk_thread		 mwt_wkthr;
+};
+
 PSCTHR_MKCAST(msattrflushthr, msattrflush_thread, MSTHRT_ATTR_FLUSH);
 PSCTHR_MKCAST(msflushthr, msflush_thread, MSTHRT_FLUSH);
 PSCTHR_MKCAST(msbreleasethr, msbrelease_thread, MSTHRT_BRELEASE);
@@ -112,6 +121,7 @@ PSCTHR_MKCAST(msbwatchthr, msbwatch_thread, MSTHRT_BWATCH);
 PSCTHR_MKCAST(msrcithr, msrci_thread, MSTHRT_RCI);
 PSCTHR_MKCAST(msrcmthr, msrcm_thread, MSTHRT_RCM);
 PSCTHR_MKCAST(msreadaheadthr, msreadahead_thread, MSTHRT_READAHEAD);
+PSCTHR_MKCAST(mswkthr, mswk_thread, MSTHRT_WORKER);
 
 #define NUM_NBRQ_THREADS		16
 #define NUM_BMAP_FLUSH_THREADS		16
@@ -145,6 +155,30 @@ struct slc_wkdata_readdir {
 	size_t				 size;
 };
 
+/*
+ * An access stream detected by the predictive I/O engine.  A stream is
+ * a run of I/Os on a file handle where each one follows the previous at
+ * a constant distance: contiguous (sequential), a fixed gap (strided)
+ * or a negative one (reverse scan).
+ */
+struct msl_predio_stream {
+	off_t				 mps_lastoff;	/* last I/O offset */
+	off_t				 mps_lastsize;	/* last I/O size */
+	off_t				 mps_stride;	/* distance between strided I/Os */
+	off_t				 mps_off;	/* next predio I/O offset */
+	int				 mps_nseq;	/* num I/Os matching pattern */
+	int				 mps_pattern;	/* MPS_PAT_* */
+	uint64_t			 mps_lastuse;	/* mfh_predio_clock at last I/O */
+	sl_bmapno_t			 mps_leasebno;	/* first bmap not leased ahead */
+};
+
+#define MPS_PAT_NONE			0
+#define MPS_PAT_SEQ			1
+#define MPS_PAT_STRIDE			2
+#define MPS_PAT_REVERSE			3
+
+#define MSL_PREDIO_NSTREAMS		4
+
 /* file handle in struct fuse_file_info */
 struct msl_fhent {
 	psc_spinlock_t			 mfh_lock;
@@ -162,10 +196,9 @@ struct msl_fhent {
 	int				 mfh_oflags;	/* open(2) flags */
 
 	/* offsets are file-wise */
-	off_t				 mfh_predio_lastoff;	/* last I/O offset */
-	off_t				 mfh_predio_lastsize;	/* last I/O size */
-	off_t				 mfh_predio_off;	/* next predio I/O offset */
-	int				 mfh_predio_nseq;	/* num sequential IOs */
+	struct msl_predio_stream	 mfh_streams[MSL_PREDIO_NSTREAMS];
+	int				 mfh_predio_cur;	/* stream of last I/O */
+	uint64_t			 mfh_predio_clock;
 
 	/* stats */
 	struct timespec			 mfh_open_time;	/* clock_gettime(2) at open(2) time */
@@ -201,6 +234,10 @@ struct msl_fsrqinfo {
 	int				 mfsrq_ref;	/* taken by biorq and the thread that does the I/O */
 	int				 mfsrq_niov;
 	struct iovec			*mfsrq_iovs;
+	int				 mfsrq_npins;
+	struct bmap_pagecache_entry	**mfsrq_pins;	/* pages referenced by mfsrq_iovs */
+	int				 mfsrq_nbounce;
+	char				*mfsrq_bounce[2 * MAX_BMAPS_REQ]; /* copied partial pages */
 };
 
 #define MFSRQ_NONE			0
@@ -224,6 +261,15 @@ struct msl_fsrqinfo {
  * Client-specific private data for sl_resource, shared for both MDS and IOS
  * types.
  */
+/*
+ * Bmaps with pending writes are queued per destination IOS so that a
+ * slow or throttled sliod does not hold up flushing to the others.
+ */
+struct msl_flushq {
+	struct psc_listcache		 mfq_bmaps;
+	struct sl_resm			*mfq_resm;
+};
+
 struct resprof_cli_info {
 	struct psc_spinlock		 rpci_lock;
 	struct statvfs			 rpci_sfb;
@@ -236,8 +282,26 @@ struct resprof_cli_info {
 	int				 rpci_total_rpcs;
 	int				 rpci_infl_credits;
 	int				 rpci_max_infl_rpcs;
+	struct msl_flushq		*rpci_flushq;
+
+	/* adaptive in-flight RPC window, see msl_resm_window_update() */
+	int				 rpci_cc_window;
+	int				 rpci_cc_ssthresh;
+	int				 rpci_cc_ncomp;		/* completions this epoch */
+	int				 rpci_cc_nepoch;
+	uint64_t			 rpci_cc_inflsum;	/* sum of in-flight counts */
+	uint64_t			 rpci_cc_lat;		/* last epoch latency (usecs) */
+	uint64_t			 rpci_cc_minlat;	/* base latency (usecs) */
+	uint64_t			 rpci_cc_minlat_cur;	/* min this base period */
+	uint64_t			 rpci_cc_minlat_prev;	/* min last base period */
+	struct timespec			 rpci_cc_start;		/* epoch start */
+	struct timespec			 rpci_cc_idle;		/* nothing in flight since */
 };
 
+#define RPCI_CC_WINDOW_MIN		4
+#define RPCI_CC_WINDOW_INIT		16
+#define RPCI_CC_BASE_EPOCHS		64	/* epochs per base latency period */
+
 #define RPCIF_AVOID			(1 << 0)	/* IOS self-advertised degradation */
 #define RPCIF_STATFS_FETCHING		(1 << 1)	/* RPC for STATFS in flight */
 
@@ -262,6 +326,13 @@ void	slc_destroy_rpci(struct resprof_cli_info *);
 struct resm_cli_info {
 	struct srm_bmap_release_req	 rmci_bmaprls;
 	struct psc_listcache		 rmci_async_reqs;
+
+	/* read performance estimates, see msl_resm_sample() */
+	psc_spinlock_t			 rmci_lock;
+	uint64_t			 rmci_usecs;	/* avg read RPC time */
+	uint64_t			 rmci_bytes;	/* avg read RPC size */
+	time_t				 rmci_stamp;	/* time of last sample */
+	time_t				 rmci_down;	/* unreachable until */
 };
 
 static __inline struct resm_cli_info *
@@ -277,6 +348,8 @@ struct readaheadrq {
 	sl_bmapno_t			rarq_bno;
 	uint32_t			rarq_off;
 	int				rarq_npages;
+	int				rarq_flags;	/* BMPCEF_RA_* for new pages */
+	int				rarq_nbmaps;	/* lease bmaps ahead only */
 };
 
 struct uid_mapping {
@@ -295,8 +368,12 @@ struct gid_mapping {
 #define msl_read(pfr, fh, p, sz, off)	msl_io((pfr), (fh), (p), (sz), (off), SL_READ)
 #define msl_write(pfr, fh, p, sz, off)	msl_io((pfr), (fh), (p), (sz), (off), SL_WRITE)
 
+#define msl_nsop_wait(f)		_msl_nsop_wait((f), 0)
+#define msl_nsop_wait_report(f)		_msl_nsop_wait((f), 1)
+
 void	 msl_biorq_release(struct bmpc_ioreq *);
 
+void	 msl_bmap_lease_ahead(struct fidc_membh *, sl_bmapno_t, int, enum rw);
 void	 msl_bmap_stash_lease(struct bmap *, const struct srt_bmapdesc *,  const char *);
 int	 msl_bmap_to_csvc(struct bmap *, int, struct sl_resm **, struct slrpc_cservice **);
 void	 msl_bmap_reap_init(struct bmap *);
@@ -308,6 +385,12 @@ void	 mfh_incref(struct msl_fhent *);
 
 void	 msl_io(struct pscfs_req *, struct msl_fhent *, char *, size_t, off_t, enum rw);
 int	 msl_stat(struct fidc_membh *, void *);
+int	 msl_readdir_issue(struct fidc_membh *, off_t, size_t, int);
+void	 msl_readdir_ra(struct fidc_membh *);
+void	 msl_getattr_batch_add(struct psc_dynarray *);
+void	 msl_attr_renew(struct fidc_membh *);
+int	 _msl_nsop_wait(struct fidc_membh *, int);
+void	 msl_fidpool_reset(void);
 
 int	 msl_read_cleanup(struct pscrpc_request *, int, struct pscrpc_async_args *);
 int	 msl_dio_cleanup(struct pscrpc_request *, int, struct pscrpc_async_args *);
@@ -321,20 +404,30 @@ int	 slc_removexattr(struct pscfs_req *, const char *, struct fidc_membh *);
 
 size_t	 msl_pages_copyout(struct bmpc_ioreq *, struct msl_fsrqinfo *);
 
-int	 msl_try_get_replica_res(struct bmap *, int, int,
+/* msl_try_get_replica_res() flags */
+#define MSL_REPLF_BLOCKING	(1 << 0)	/* wait for connection */
+#define MSL_REPLF_TRYDOWN	(1 << 1)	/* include members marked down */
+
+int	 msl_try_get_replica_res(struct bmap *, int, int, int,
 	    struct sl_resm **, struct slrpc_cservice **);
+uint64_t msl_res_cost(struct sl_resource *);
+int	 msl_res_isdown(struct sl_resource *);
 struct msl_fhent *
 	 msl_fhent_new(struct pscfs_req *, struct fidc_membh *);
 
 void	 msl_resm_throttle_wake(struct sl_resm *, int);
 void	 msl_resm_throttle_wait(struct sl_resm *);
 int	 msl_resm_throttle_yield(struct sl_resm *);
+int	 msl_resm_throttle_avail(struct sl_resm *);
+
+int	 msl_dirty_over_hiwat(void);
 
 int	 _msl_resm_throttle(struct sl_resm *, int);
 
 void	 msbmapthr_spawn(void);
 void	 msctlthr_spawn(void);
 void	 msreadaheadthr_spawn(void);
+void	 mshedgethr_spawn(void);
 void	 msl_readahead_svc_destroy(void);
 
 void	 slc_setprefios(sl_ios_id_t);
@@ -354,14 +447,22 @@ void	 gidmap_int_stat(struct srt_stat *, uint32_t *);
 
 void	 parse_mapfile(void);
 
+void	 bmap_flushq_add(struct bmap *);
+void	 bmap_flushq_remove(struct bmap *);
+int	 bmap_flushq_requeue(struct bmap *);
+int	 bmap_flushq_nitems(void);
+void	 bmap_flushq_drain(void);
+void	 bmap_flushq_destroy(void);
 void	 bmap_flushq_wake(int);
 void	 bmap_flush_resched(struct bmpc_ioreq *, int);
 
 void	 msreadahead_cancel(struct fidc_membh *);
+void	 msl_open_prefetch(struct fidc_membh *);
 void	 slc_fcmh_invalidate_bmap(struct fidc_membh *, int);
 
 void	 msl_pgcache_init(void);
 int	 msl_pgcache_reap(void);
+void	 msl_pgcache_feed_waiters(void);
 
 int	 bmpce_reaper(struct psc_poolmgr *);
 
@@ -387,9 +488,9 @@ extern struct pfl_opstats_grad	 slc_iorpc_iostats_rd;
 extern struct pfl_opstats_grad	 slc_iorpc_iostats_wr;
 
 extern struct psc_listcache	 msl_attrtimeoutq;
-extern struct psc_listcache	 msl_bmapflushq;
 extern struct psc_listcache	 msl_bmaptimeoutq;
 extern struct psc_listcache	 msl_readaheadq;
+extern struct psc_listcache	 msl_batch_workq;
 
 extern struct psc_poolmgr	*msl_iorq_pool;
 extern struct psc_poolmgr	*msl_async_req_pool;
@@ -398,18 +499,41 @@ extern struct psc_poolmgr	*msl_biorq_pool;
 extern struct psc_poolmgr	*msl_mfh_pool;
 
 extern int			 msl_acl;
+extern int			 msl_async_create;
+extern int			 msl_async_create_batch;
+extern int			 msl_async_unlink;
+extern int			 msl_async_unlink_batch;
 extern int			 msl_enable_namecache;
 extern int			 msl_enable_sillyrename;
 extern int			 msl_force_dio;
+extern int			 msl_getattr_batch;
+extern int			 msl_attr_lease_renew;
 extern int			 msl_map_enable;
 extern int			 msl_bmap_reassign;
 extern int			 msl_fuse_direct_io;
 extern int			 msl_ios_max_inflight_rpcs;
 extern int			 msl_mds_max_inflight_rpcs;
+extern int			 msl_rpc_window_adapt;
+extern int			 msl_rpc_window_min;
+extern int			 msl_rpc_window_init;
 extern int			 msl_max_nretries;
 
 extern int			 msl_predio_max_pages;
 extern int			 msl_predio_pipe_size;
+extern int			 msl_predio_autotune;
+extern int			 msl_predio_window_max;
+extern int			 msl_predio_lease_ahead;
+extern int			 msl_open_prefetch_size;
+extern int			 msl_repl_explore_secs;
+extern int			 msl_ios_down_secs;
+extern int			 msl_hedge_reads;
+extern int			 msl_hedge_pct;
+extern int			 msl_hedge_min_usecs;
+
+extern uint64_t			 msl_dirty_bytes;
+extern int			 msl_dirty_lowat;
+extern int			 msl_dirty_hiwat;
+extern int			 msl_dirty_maxpause;
 
 extern int			 msl_max_retries;
 extern int			 msl_root_squash;
@@ -417,8 +541,16 @@ extern int			 msl_read_only;
 extern int			 msl_repl_enable;
 extern int			 msl_statfs_pref_ios_only;
 extern uint64_t			 msl_pagecache_maxsize;
+extern int			 msl_pgcache_hugepages;
+extern int			 msl_pgcache_lru;
+extern int			 msl_pgcache_narenas;
 extern int			 msl_max_namecache_per_directory; 
+extern int			 msl_namecache_neg_timeout;
+extern int			 msl_readdir_ra_max;
+extern int			 msl_readdir_ra_maxpages;
+extern psc_atomic32_t		 msl_readdir_ra_npages;
 extern int			 msl_attributes_timeout;
+extern int			 msl_xattr_cache_timeout;
 
 extern int			 msl_bmpce_gen;
 
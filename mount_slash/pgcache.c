@@ -30,8 +30,12 @@
 #define PSC_SUBSYS SLSS_BMAP
 #include "slsubsys.h"
 
+#include <sys/mman.h>
+
+#include <stdint.h>
 #include <time.h>
 
+#include "pfl/alloc.h"
 #include "pfl/atomic.h"
 #include "pfl/ctlsvr.h"
 #include "pfl/fsmod.h"
@@ -41,6 +45,8 @@
 
 #include "pgcache.h"
 #include "bmap_cli.h"
+#include "fidc_cli.h"
+#include "magazine.h"
 #include "mount_slash.h"
 
 struct psc_poolmaster	 bmpce_poolmaster;
@@ -56,8 +62,6 @@ int			 msl_bmpces_max = 16384; 	/* 512MiB */
 
 struct psc_listcache	 msl_readahead_pages;
 
-RB_GENERATE(bmap_pagecachetree, bmap_pagecache_entry, bmpce_tentry,
-    bmpce_cmp)
 RB_GENERATE(bmpc_biorq_tree, bmpc_ioreq, biorq_tentry, bmpc_biorq_cmp)
 
 struct psc_listcache	 free_page_buffers;
@@ -68,11 +72,194 @@ struct psc_listcache	 bmpcLru;
 
 int			 msl_bmpce_gen;
 
-void
-msl_pgcache_init(void)
+#define	PGCACHE_ARENA_NBUFS	2048		/* 64MiB */
+#define	PGCACHE_HUGEPAGE_SZ	(2 * 1024 * 1024)
+
+/* list of page buffer arenas, protected by the free_page_buffers lock */
+PSCLIST_HEAD(msl_pgcache_arenas);
+
+int			 msl_pgcache_narenas;
+int			 msl_pgcache_hugepages;		/* try to back arenas with huge pages */
+
+/* per-CPU caches in front of free_page_buffers and the bmpce/biorq pools */
+struct msl_magcache	 msl_page_magcache;
+struct msl_magcache	 msl_bmpce_magcache;
+struct msl_magcache	 msl_biorq_magcache;
+
+psc_atomic32_t		 msl_pgcache_nwaiters;
+
+/*
+ * Replacement policy.  By default idle pages are managed with 2Q: new
+ * pages go on a per-bmap FIFO (A1in) and evicted A1in pages leave a
+ * ghost behind.  A page faulted in while its ghost is still around is
+ * deemed reused and goes on the LRU (Am) list.  A1in is reclaimed
+ * first while it holds more than a quarter of the cache.  The ghost
+ * table is direct mapped, so an occasional ghost is lost to a hash
+ * collision.  Setting msl_pgcache_lru reverts to a plain LRU.
+ */
+int			 msl_pgcache_lru;
+psc_atomic32_t		 msl_pgcache_na1in;
+
+psc_spinlock_t		 msl_pgcache_ghost_lock = SPINLOCK_INIT;
+uint64_t		*msl_pgcache_ghosts;
+int			 msl_pgcache_nghosts;
+
+#define	PGCACHE_A1IN_TARGET	(msl_bmpces_max / 4)
+
+void	 msl_pgcache_put_slow(void *);
+
+/*
+ * Map a new arena of page buffers and put its entries on the free list.
+ * If huge pages are requested, try MAP_HUGETLB first and fall back to
+ * transparent huge pages when none are reserved.
+ */
+struct bmap_page_arena *
+msl_pgcache_arena_new(int nbufs, int flags)
 {
+	struct bmap_page_arena *pga;
+	struct bmap_page_entry *entry;
+	void *p = MAP_FAILED;
+	size_t len;
 	int i;
+
+	len = (size_t)nbufs * BMPC_BUFSZ;
+	if (msl_pgcache_hugepages) {
+		len = (len + PGCACHE_HUGEPAGE_SZ - 1) &
+		    ~((size_t)PGCACHE_HUGEPAGE_SZ - 1);
+#ifdef MAP_HUGETLB
+		p = mmap(NULL, len, PROT_READ|PROT_WRITE,
+		    MAP_ANONYMOUS|MAP_PRIVATE|MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			flags |= PGAF_HUGETLB;
+			OPSTAT_INCR("msl.pgcache-arena-hugetlb");
+		} else
+			OPSTAT_INCR("msl.pgcache-arena-hugetlb-err");
+#endif
+	}
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, len, PROT_READ|PROT_WRITE,
+		    MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+		if (p == MAP_FAILED) {
+			OPSTAT_INCR("msl.pgcache-arena-err");
+			return (NULL);
+		}
+#ifdef MADV_HUGEPAGE
+		if (msl_pgcache_hugepages &&
+		    madvise(p, len, MADV_HUGEPAGE) == 0) {
+			flags |= PGAF_THP;
+			OPSTAT_INCR("msl.pgcache-arena-thp");
+		}
+#endif
+	}
+
+	pga = PSCALLOC(sizeof(*pga));
+	INIT_PSC_LISTENTRY(&pga->pga_lentry);
+	pga->pga_base = p;
+	pga->pga_size = len;
+	pga->pga_flags = flags;
+	pga->pga_nbufs = nbufs;
+	pga->pga_entries = PSCALLOC(sizeof(*entry) * nbufs);
+
+	LIST_CACHE_LOCK(&free_page_buffers);
+	for (i = 0, entry = pga->pga_entries; i < nbufs; i++, entry++) {
+		INIT_PSC_LISTENTRY(&entry->page_lentry);
+		entry->page_flag = 0;
+		entry->page_buf = pga->pga_base + (size_t)i * BMPC_BUFSZ;
+		entry->page_arena = pga;
+		lc_addtail(&free_page_buffers, entry);
+	}
+	psclist_add_tail(&pga->pga_lentry, &msl_pgcache_arenas);
+	page_buffer_total += nbufs;
+	msl_pgcache_narenas++;
+	LIST_CACHE_ULOCK(&free_page_buffers);
+
+	OPSTAT_INCR("msl.pgcache-arena-new");
+	return (pga);
+}
+
+/*
+ * Unmap an arena if none of its buffers are in use.  Called with the
+ * free_page_buffers lock held.  An entry that is off the free list is
+ * in use, even if its owner has not gotten around to touching it yet.
+ */
+int
+msl_pgcache_arena_free(struct bmap_page_arena *pga)
+{
+	struct bmap_page_entry *entry;
+	int i, rc;
+
+	for (i = 0, entry = pga->pga_entries; i < pga->pga_nbufs;
+	    i++, entry++)
+		if (psclist_disjoint(&entry->page_lentry))
+			return (0);
+
+	for (i = 0, entry = pga->pga_entries; i < pga->pga_nbufs;
+	    i++, entry++)
+		lc_remove(&free_page_buffers, entry);
+
+	rc = munmap(pga->pga_base, pga->pga_size);
+	if (!rc)
+		OPSTAT_INCR("munmap-success-reap");
+	else
+		OPSTAT_INCR("munmap-failure-reap");
+
+	psclist_del(&pga->pga_lentry, &msl_pgcache_arenas);
+	page_buffer_total -= pga->pga_nbufs;
+	msl_pgcache_narenas--;
+	PSCFREE(pga->pga_entries);
+	PSCFREE(pga);
+	return (1);
+}
+
+/*
+ * Release the memory behind buffers [start, end) of an arena back to
+ * the system.  Huge pages can only be dropped as a whole.
+ */
+void
+msl_pgcache_arena_madvise(struct bmap_page_arena *pga, int start,
+    int end)
+{
 	struct bmap_page_entry *entry;
+	uintptr_t p, q;
+	int i;
+
+	p = (uintptr_t)pga->pga_base + (size_t)start * BMPC_BUFSZ;
+	q = (uintptr_t)pga->pga_base + (size_t)end * BMPC_BUFSZ;
+	if (pga->pga_flags & PGAF_HUGETLB) {
+		p = (p + PGCACHE_HUGEPAGE_SZ - 1) &
+		    ~((uintptr_t)PGCACHE_HUGEPAGE_SZ - 1);
+		q &= ~((uintptr_t)PGCACHE_HUGEPAGE_SZ - 1);
+	}
+	if (p >= q)
+		return;
+
+	if (madvise((void *)p, q - p, MADV_DONTNEED)) {
+		OPSTAT_INCR("madvise-failure-reap");
+		return;
+	}
+	OPSTAT_INCR("madvise-success-reap");
+
+	for (i = start, entry = &pga->pga_entries[start]; i < end;
+	    i++, entry++)
+		if ((uintptr_t)entry->page_buf >= p &&
+		    (uintptr_t)entry->page_buf + BMPC_BUFSZ <= q)
+			entry->page_flag &= ~PAGE_MADVISE;
+}
+
+/*
+ * Stop stashing buffers in the magazines while someone is blocked on
+ * the global free list.
+ */
+int
+msl_pgcache_bypass(void)
+{
+	return (psc_atomic32_read(&msl_pgcache_nwaiters) > 0);
+}
+
+void
+msl_pgcache_init(void)
+{
+	int nbufs, left;
 
 	lc_reginit(&free_page_buffers, struct bmap_page_entry,
 	    page_lentry, "pagebuffers");
@@ -80,21 +267,15 @@ msl_pgcache_init(void)
 	/*
  	 * Note that ppm_max can change after we start.
  	 */
-	entry = PSCALLOC(sizeof(struct bmap_page_entry) * bmpce_pool->ppm_max); 
-	for (i = 0; i < bmpce_pool->ppm_max; i++) {
-		pfl_assert(entry);
-		entry->page_flag = 0;
-		page_buffer_total++;
-		entry->page_buf = mmap(NULL, BMPC_BUFSZ, PROT_READ|PROT_WRITE, 
-		    MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
-
-		if (entry->page_buf == MAP_FAILED)
-			psc_fatalx("Please raise vm.max_map_count limit");
-
-		INIT_PSC_LISTENTRY(&entry->page_lentry);
-		lc_add(&free_page_buffers, entry);
-		entry++;
+	for (left = bmpce_pool->ppm_max; left > 0; left -= nbufs) {
+		nbufs = MIN(left, PGCACHE_ARENA_NBUFS);
+		if (msl_pgcache_arena_new(nbufs, 0) == NULL)
+			psc_fatalx("unable to map %d page cache buffers",
+			    nbufs);
 	}
+
+	msl_magcache_init(&msl_page_magcache, "page",
+	    msl_pgcache_put_slow, msl_pgcache_bypass);
 }
 
 struct bmap_page_entry *
@@ -102,36 +283,50 @@ msl_pgcache_get(int wait)
 {
 	struct timespec ts;
 	struct bmap_page_entry *entry;
-	static int warned = 0, failed = 0;
+	static int warned = 0, failed = 0, growing = 0;
+	int nbufs;
 
+	entry = msl_magcache_get(&msl_page_magcache);
+	if (entry)
+		goto out;
 	entry = lc_getnb(&free_page_buffers);
 	if (entry)
 		goto out;
  again:
 
+	/*
+	 * Only one thread grows the cache at a time; mmap(2) is done
+	 * without holding the list lock.
+	 */
+	nbufs = 0;
 	LIST_CACHE_LOCK(&free_page_buffers);
-	if (page_buffer_total < bmpce_pool->ppm_max) {
-		entry = PSCALLOC(sizeof(struct bmap_page_entry)); 
-		entry->page_buf = mmap(NULL, BMPC_BUFSZ, PROT_READ|PROT_WRITE, 
-		    MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
-		if (entry->page_buf != MAP_FAILED) {
+	if (!growing && page_buffer_total < bmpce_pool->ppm_max) {
+		nbufs = MIN(bmpce_pool->ppm_max - page_buffer_total,
+		    PGCACHE_ARENA_NBUFS);
+		growing = 1;
+	}
+	LIST_CACHE_ULOCK(&free_page_buffers);
+
+	if (nbufs) {
+		if (msl_pgcache_arena_new(nbufs, PGAF_CANFREE)) {
 			warned = 0;
-			page_buffer_total++;
 			OPSTAT_INCR("mmap-grow-ok");
-			INIT_PSC_LISTENTRY(&entry->page_lentry);
-			LIST_CACHE_ULOCK(&free_page_buffers);
-			entry->page_flag = PAGE_CANFREE;
-			return (entry);
+		} else {
+			failed = 1;
+			OPSTAT_INCR("mmap-grow-err");
 		}
-		failed = 1;
-		PSCFREE(entry); 
-		OPSTAT_INCR("mmap-grow-err");
+		LIST_CACHE_LOCK(&free_page_buffers);
+		growing = 0;
+		LIST_CACHE_ULOCK(&free_page_buffers);
+
+		entry = lc_getnb(&free_page_buffers);
+		if (entry)
+			goto out;
 	}
-	LIST_CACHE_ULOCK(&free_page_buffers);
 
 	if (failed && warned < 5) {
 		warned++;
-		psclog_warnx("Please raise vm.max_map_count for performance");
+		psclog_warnx("Unable to grow page cache: out of memory");
 	}
 
 	if (wait) {
@@ -140,7 +335,11 @@ msl_pgcache_get(int wait)
 		 */
 		ts.tv_nsec = 0;
 		ts.tv_sec = time(NULL) + 30;
+		psc_atomic32_inc(&msl_pgcache_nwaiters);
+		msl_magcache_reap(&msl_page_magcache,
+		    psc_atomic32_read(&msl_pgcache_nwaiters));
 		entry = lc_gettimed(&free_page_buffers, &ts);
+		psc_atomic32_dec(&msl_pgcache_nwaiters);
 		if (!entry) {
 			OPSTAT_INCR("pagecache-get-retry");
 			goto again;
@@ -158,27 +357,33 @@ msl_pgcache_get(int wait)
 void
 msl_pgcache_put(struct bmap_page_entry *entry)
 {
-	int rc;
+	if (!msl_magcache_put(&msl_page_magcache, entry))
+		msl_pgcache_put_slow(entry);
+}
+
+void
+msl_pgcache_put_slow(void *p)
+{
+	struct bmap_page_entry *entry = p;
+	int canfree;
+
 	/*
- 	 * Do not assume that the max value has not changed.
+ 	 * Do not assume that the max value has not changed.  Buffers
+ 	 * are never unmapped one at a time; when we are over the limit,
+ 	 * let grown arenas drain so the reaper can unmap them whole.
  	 */
+	canfree = entry->page_arena->pga_flags & PGAF_CANFREE;
 	LIST_CACHE_LOCK(&free_page_buffers);
 	if (page_buffer_total <= bmpce_pool->ppm_max) {
-		if (entry->page_flag & PAGE_CANFREE)
+		if (canfree)
 			lc_addhead(&free_page_buffers, entry);
 		else
 			lc_addtail(&free_page_buffers, entry);
 	} else {
-		if (entry->page_flag & PAGE_CANFREE) {
-			rc = munmap(entry->page_buf, BMPC_BUFSZ);
-			if (!rc)
-				OPSTAT_INCR("munmap-success");
-			else
-				OPSTAT_INCR("munmap-failure");
-			PSCFREE(entry);
-			page_buffer_total--;
-		} else
-			lc_add(&free_page_buffers, entry);
+		if (canfree)
+			lc_addtail(&free_page_buffers, entry);
+		else
+			lc_addhead(&free_page_buffers, entry);
 	}
 	LIST_CACHE_ULOCK(&free_page_buffers);
 }
@@ -186,8 +391,20 @@ msl_pgcache_put(struct bmap_page_entry *entry)
 int
 msl_pgcache_reap(void)
 {
-	struct bmap_page_entry *entry, *tmp;
-	int rc, nfree, didwork = 0;
+	struct bmap_page_arena *pga, *tmp;
+	struct bmap_page_entry *entry;
+	int i, start, dirty, nfree, didwork = 0;
+
+	/*
+	 * Entries parked in the magazines look busy to the pool and
+	 * would keep the arena scan below from ever running, so hand
+	 * them back only when everything else is idle.  The pages go
+	 * with them since no page can be in use at that point.
+	 */
+	if (bmpce_nfree() == bmpce_pool->ppm_total) {
+		msl_magcache_drain(&msl_bmpce_magcache);
+		msl_magcache_drain(&msl_page_magcache);
+	}
 
 	/* (gdb) p bmpce_pool.ppm_u.ppmu_explist.pexl_pll.pll_nitems */
 	nfree = bmpce_pool->ppm_nfree; 
@@ -198,35 +415,103 @@ msl_pgcache_reap(void)
 	/* I tried the other way, but RSS wouldn't go down as much */
 	if (bmpce_pool->ppm_nfree != bmpce_pool->ppm_total)
 		return (didwork);
-	/*
- 	 * Do not assume that the max value has not changed.
- 	 */
+
 	LIST_CACHE_LOCK(&free_page_buffers);
-	LIST_CACHE_FOREACH_SAFE(entry, tmp, &free_page_buffers) {
-		if (entry->page_flag & PAGE_CANFREE) {
-			lc_remove(&free_page_buffers, entry);
-			rc = munmap(entry->page_buf, BMPC_BUFSZ);
-			if (!rc)
-				OPSTAT_INCR("munmap-success-reap");
-			else
-				OPSTAT_INCR("munmap-failure-reap");
-			PSCFREE(entry);
-			page_buffer_total--;
+	psclist_for_each_entry_safe(pga, tmp, &msl_pgcache_arenas,
+	    pga_lentry) {
+		if ((pga->pga_flags & PGAF_CANFREE) &&
+		    msl_pgcache_arena_free(pga))
 			continue;
+
+		/*
+		 * Coalesce runs of free buffers into as few madvise(2)
+		 * calls as possible, skipping runs that are all clean.
+		 */
+		start = -1;
+		dirty = 0;
+		for (i = 0; i <= pga->pga_nbufs; i++) {
+			entry = &pga->pga_entries[i];
+			if (i < pga->pga_nbufs &&
+			    !psclist_disjoint(&entry->page_lentry)) {
+				if (start == -1)
+					start = i;
+				if (entry->page_flag & PAGE_MADVISE)
+					dirty = 1;
+				continue;
+			}
+			if (start != -1 && dirty)
+				msl_pgcache_arena_madvise(pga, start, i);
+			start = -1;
+			dirty = 0;
 		}
-		if (!(entry->page_flag & PAGE_MADVISE))
-			continue;
-		rc = madvise(entry->page_buf, BMPC_BUFSZ, MADV_DONTNEED);
-		if (!rc)
-			OPSTAT_INCR("madvise-success-reap");
-		else
-			OPSTAT_INCR("madvise-failure-reap");
-		entry->page_flag &= ~PAGE_MADVISE;
 	}
 	LIST_CACHE_ULOCK(&free_page_buffers);
 	return (1);
 }
 
+static __inline uint64_t
+bmpce_ghost_key(struct bmap *b, uint32_t off)
+{
+	uint64_t h;
+
+	h = fcmh_2_fid(b->bcm_fcmh) * UINT64_C(0x9e3779b97f4a7c15);
+	h ^= ((uint64_t)b->bcm_bmapno << 32 | off) *
+	    UINT64_C(0xc2b2ae3d27d4eb4f);
+	h ^= h >> 29;
+	return (h | 1);		/* zero marks an empty slot */
+}
+
+__static void
+bmpce_ghost_add(struct bmap_pagecache_entry *e)
+{
+	uint64_t key;
+
+	key = bmpce_ghost_key(e->bmpce_bmap, e->bmpce_off);
+	spinlock(&msl_pgcache_ghost_lock);
+	msl_pgcache_ghosts[key % msl_pgcache_nghosts] = key;
+	freelock(&msl_pgcache_ghost_lock);
+}
+
+/*
+ * Check whether a page being faulted in was evicted from A1in recently
+ * and consume its ghost if so.
+ */
+__static int
+bmpce_ghost_hit(struct bmap *b, uint32_t off)
+{
+	uint64_t key, *slot;
+	int hit = 0;
+
+	key = bmpce_ghost_key(b, off);
+	spinlock(&msl_pgcache_ghost_lock);
+	slot = &msl_pgcache_ghosts[key % msl_pgcache_nghosts];
+	if (*slot == key) {
+		*slot = 0;
+		hit = 1;
+	}
+	freelock(&msl_pgcache_ghost_lock);
+	return (hit);
+}
+
+/*
+ * Take an idle page off whichever replacement list it is on.
+ */
+void
+bmpce_lru_remove(struct bmap_pagecache_entry *e,
+    struct bmap_pagecache *bmpc)
+{
+	BMPCE_LOCK_ENSURE(e);
+	pfl_assert(e->bmpce_flags & BMPCEF_LRU);
+
+	e->bmpce_flags &= ~BMPCEF_LRU;
+	if (e->bmpce_flags & BMPCEF_HOT)
+		pll_remove(&bmpc->bmpc_lru, e);
+	else {
+		pll_remove(&bmpc->bmpc_a1in, e);
+		psc_atomic32_dec(&msl_pgcache_na1in);
+	}
+}
+
 /*
  * Initialize write coalescer pool entry.
  */
@@ -248,6 +533,71 @@ bwc_free(struct bmpc_write_coalescer *bwc)
 	psc_pool_return(bwc_pool, bwc);
 }
 
+void
+bmpce_pool_return(void *p)
+{
+	psc_pool_return(bmpce_pool, p);
+}
+
+int
+bmpce_pool_bypass(void)
+{
+	return (psc_atomic32_read(&bmpce_pool->ppm_nwaiters) > 0);
+}
+
+/*
+ * Allocate a bmap page cache entry, trying the per-CPU magazines before
+ * the pool.
+ */
+struct bmap_pagecache_entry *
+bmpce_alloc(int nonblock)
+{
+	struct bmap_pagecache_entry *e;
+
+	e = msl_magcache_get(&msl_bmpce_magcache);
+	if (e)
+		return (e);
+	if (nonblock)
+		return (psc_pool_shallowget(bmpce_pool));
+	return (psc_pool_get(bmpce_pool));
+}
+
+void
+bmpce_dealloc(struct bmap_pagecache_entry *e)
+{
+	if (!msl_magcache_put(&msl_bmpce_magcache, e))
+		psc_pool_return(bmpce_pool, e);
+}
+
+/*
+ * Number of bmpces available for allocation, including the ones parked
+ * in the magazines.
+ */
+int
+bmpce_nfree(void)
+{
+	return (bmpce_pool->ppm_nfree +
+	    msl_magcache_nobjs(&msl_bmpce_magcache));
+}
+
+/*
+ * Hand objects parked in the magazines back to their pools when
+ * threads are blocked on them.  Called by the reaper thread rather
+ * than from bmpce_reaper() as it returns entries to the pool.
+ */
+void
+msl_pgcache_feed_waiters(void)
+{
+	int n;
+
+	n = psc_atomic32_read(&bmpce_pool->ppm_nwaiters);
+	if (n && msl_magcache_reap(&msl_bmpce_magcache, n))
+		OPSTAT_INCR("msl.bmpce-mag-feed");
+	n = psc_atomic32_read(&msl_biorq_pool->ppm_nwaiters);
+	if (n && msl_magcache_reap(&msl_biorq_magcache, n))
+		OPSTAT_INCR("msl.biorq-mag-feed");
+}
+
 /*
  * Initialize a bmap page cache entry.
  */
@@ -266,14 +616,13 @@ bmpce_lookup(struct bmpc_ioreq *r, struct bmap *b, int flags,
     uint32_t off, struct pfl_waitq *wq)
 {
 	int rc = 0, wrlock = 0;
-	struct bmap_pagecache_entry q, *e, *e2 = NULL;
+	struct bmap_pagecache_entry *e, *e2 = NULL;
 	struct bmap_cli_info *bci = bmap_2_bci(b);
 	struct bmap_pagecache *bmpc;
 	struct bmap_page_entry *entry = NULL;
 	struct timespec tm;
 
 	bmpc = bmap_2_bmpc(b);
-	q.bmpce_off = off;
 
  restart:
 
@@ -283,7 +632,7 @@ bmpce_lookup(struct bmpc_ioreq *r, struct bmap *b, int flags,
 		pfl_rwlock_rdlock(&bci->bci_rwlock);
 
 	for (;;) {
-		e = RB_FIND(bmap_pagecachetree, &bmpc->bmpc_tree, &q);
+		e = bmpc_pt_lookup(bmpc, off);
 		if (e) {
 			if (flags & BMPCEF_READAHEAD) {
 				rc = EEXIST;
@@ -316,7 +665,7 @@ bmpce_lookup(struct bmpc_ioreq *r, struct bmap *b, int flags,
 		if (e2 == NULL) {
 			pfl_rwlock_unlock(&bci->bci_rwlock);
 			if (flags & BMPCEF_READAHEAD) {
-				e2 = psc_pool_shallowget(bmpce_pool);
+				e2 = bmpce_alloc(1);
 				if (e2 == NULL) {
 					rc = EAGAIN;
 					goto out;
@@ -327,7 +676,7 @@ bmpce_lookup(struct bmpc_ioreq *r, struct bmap *b, int flags,
 					goto out;
 				}
 			} else {
-				e2 = psc_pool_get(bmpce_pool);
+				e2 = bmpce_alloc(0);
 				entry = msl_pgcache_get(1);
 			}
 			wrlock = 1;
@@ -347,11 +696,17 @@ bmpce_lookup(struct bmpc_ioreq *r, struct bmap *b, int flags,
 			e->bmpce_bmap = b;
 			e->bmpce_entry = entry;
 
+			if (!msl_pgcache_lru &&
+			    !(flags & BMPCEF_READAHEAD) &&
+			    bmpce_ghost_hit(b, off)) {
+				e->bmpce_flags |= BMPCEF_HOT;
+				OPSTAT_INCR("msl.bmpce-ghost-hit");
+			}
+
 			e2 = NULL;
 			entry = NULL;
 
-			PSC_RB_XINSERT(bmap_pagecachetree,
-			    &bmpc->bmpc_tree, e);
+			bmpc_pt_insert(bmpc, e);
 
 			bmap_op_start_type(b, BMAP_OPCNT_BMPCE);
 
@@ -367,7 +722,7 @@ bmpce_lookup(struct bmpc_ioreq *r, struct bmap *b, int flags,
 		OPSTAT_INCR("msl.bmpce-gratuitous");
 		if (entry)
 			msl_pgcache_put(entry);
-		psc_pool_return(bmpce_pool, e2);
+		bmpce_dealloc(e2);
 	}
 
 	if (!rc)
@@ -380,6 +735,59 @@ bmpce_lookup(struct bmpc_ioreq *r, struct bmap *b, int flags,
 	return (rc);
 }
 
+/*
+ * Insert a page into the bmap page table.  The caller holds bci_rwlock
+ * for writing.
+ */
+void
+bmpc_pt_insert(struct bmap_pagecache *bmpc, struct bmap_pagecache_entry *e)
+{
+	struct bmap_pagetable *pt = &bmpc->bmpc_pages;
+	int idx = bmpce_2_ptidx(e), l1, l2;
+
+	l1 = idx / BMPC_PT_LEAFSZ;
+	l2 = idx % BMPC_PT_LEAFSZ;
+	if (pt->bpt_leaves[l1] == NULL)
+		pt->bpt_leaves[l1] = PSCALLOC(BMPC_PT_LEAFSZ *
+		    sizeof(*pt->bpt_leaves[l1]));
+	pfl_assert(!(pt->bpt_occ[l1] & (UINT64_C(1) << l2)));
+	pt->bpt_leaves[l1][l2] = e;
+	pt->bpt_occ[l1] |= UINT64_C(1) << l2;
+	pt->bpt_summary |= UINT64_C(1) << l1;
+	pt->bpt_npages++;
+}
+
+void
+bmpc_pt_remove(struct bmap_pagecache *bmpc, struct bmap_pagecache_entry *e)
+{
+	struct bmap_pagetable *pt = &bmpc->bmpc_pages;
+	int idx = bmpce_2_ptidx(e), l1, l2;
+
+	l1 = idx / BMPC_PT_LEAFSZ;
+	l2 = idx % BMPC_PT_LEAFSZ;
+	pfl_assert(pt->bpt_occ[l1] & (UINT64_C(1) << l2));
+	pfl_assert(pt->bpt_leaves[l1][l2] == e);
+	pt->bpt_leaves[l1][l2] = NULL;
+	pt->bpt_occ[l1] &= ~(UINT64_C(1) << l2);
+	if (!pt->bpt_occ[l1])
+		pt->bpt_summary &= ~(UINT64_C(1) << l1);
+	pt->bpt_npages--;
+}
+
+/*
+ * Release the leaves of an empty page table when its bmap goes away.
+ */
+void
+bmpc_pt_destroy(struct bmap_pagecache *bmpc)
+{
+	struct bmap_pagetable *pt = &bmpc->bmpc_pages;
+	int i;
+
+	pfl_assert(bmpc_pt_empty(bmpc));
+	for (i = 0; i < BMPC_PT_NLEAVES; i++)
+		PSCFREE(pt->bpt_leaves[i]);
+}
+
 void
 bmpce_free(struct bmap_pagecache_entry *e, struct bmap_pagecache *bmpc)
 {
@@ -393,23 +801,33 @@ bmpce_free(struct bmap_pagecache_entry *e, struct bmap_pagecache *bmpc)
 
 	DEBUG_BMPCE(PLL_DIAG, e, "destroying");
 
-	if (e->bmpce_flags & BMPCEF_READAHEAD)
+	if ((e->bmpce_flags & (BMPCEF_READAHEAD | BMPCEF_ACCESSED)) ==
+	    BMPCEF_READAHEAD) {
+		psc_atomic32_inc(&fcmh_2_fci(b->bcm_fcmh)->fcif_ra_waste);
 		OPSTAT_INCR("msl.readahead-waste");
+		if (e->bmpce_flags & BMPCEF_RA_STRIDE)
+			OPSTAT_INCR("msl.readahead-waste-stride");
+		else if (e->bmpce_flags & BMPCEF_RA_REVERSE)
+			OPSTAT_INCR("msl.readahead-waste-reverse");
+		else
+			OPSTAT_INCR("msl.readahead-waste-seq");
+	}
 
 	BMPCE_ULOCK(e);
 
 	pfl_rwlock_wrlock(&bci->bci_rwlock);
-	PSC_RB_XREMOVE(bmap_pagecachetree, &bmpc->bmpc_tree, e);
+	bmpc_pt_remove(bmpc, e);
 	pfl_rwlock_unlock(&bci->bci_rwlock);
 
 	msl_pgcache_put(e->bmpce_entry);
-	psc_pool_return(bmpce_pool, e);
+	bmpce_dealloc(e);
 }
 
 void
 bmpce_release_locked(struct bmap_pagecache_entry *e, struct bmap_pagecache *bmpc)
 {
 	struct bmap *b = e->bmpce_bmap;
+	int keep;
 
 	msl_bmpce_gen++;
 	LOCK_ENSURE(&e->bmpce_lock);
@@ -426,31 +844,41 @@ bmpce_release_locked(struct bmap_pagecache_entry *e, struct bmap_pagecache *bmpc
 	/* sanity checks */
 	pfl_assert(pll_empty(&e->bmpce_pndgaios));
 
+	keep = (e->bmpce_flags & BMPCEF_DATARDY) &&
+	   !(e->bmpce_flags & BMPCEF_EIO) &&
+	   !(e->bmpce_flags & BMPCEF_TOFREE) &&
+	   !(e->bmpce_flags & BMPCEF_DISCARD);
+
 	/*
  	 * This has the side effect of putting the page
- 	 * to the end of the list.
+ 	 * to the end of the list.  Pages on A1in keep their
+ 	 * place: it is a FIFO.
  	 */
-	if (e->bmpce_flags & BMPCEF_LRU) {
-		e->bmpce_flags &= ~BMPCEF_LRU;
-		pll_remove(&bmpc->bmpc_lru, e);
-	}
+	if ((e->bmpce_flags & BMPCEF_LRU) && (!keep || msl_pgcache_lru ||
+	    (e->bmpce_flags & BMPCEF_HOT)))
+		bmpce_lru_remove(e, bmpc);
 
-	if ((e->bmpce_flags & BMPCEF_DATARDY) &&
-	   !(e->bmpce_flags & BMPCEF_EIO) &&
-	   !(e->bmpce_flags & BMPCEF_TOFREE) &&
-	   !(e->bmpce_flags & BMPCEF_DISCARD)) { 
+	if (keep) {
 		DEBUG_BMPCE(PLL_DIAG, e, "put on LRU");
 
-		e->bmpce_flags |= BMPCEF_LRU;
+		if (msl_pgcache_lru)
+			e->bmpce_flags |= BMPCEF_HOT;
 
 		/*
  		 * The other side must use trylock to
  		 * avoid a deadlock.
  		 */
-		pll_add(&bmpc->bmpc_lru, e);
+		if (e->bmpce_flags & BMPCEF_HOT) {
+			e->bmpce_flags |= BMPCEF_LRU;
+			pll_add(&bmpc->bmpc_lru, e);
+		} else if (!(e->bmpce_flags & BMPCEF_LRU)) {
+			e->bmpce_flags |= BMPCEF_LRU;
+			pll_addtail(&bmpc->bmpc_a1in, e);
+			psc_atomic32_inc(&msl_pgcache_na1in);
+		}
 
 		BMPCE_ULOCK(e);
-		if (bmpce_pool->ppm_nfree < MIN_FREE_PAGES) {
+		if (bmpce_nfree() < MIN_FREE_PAGES) {
 			OPSTAT_INCR("msl.bmpce-nfree-reap");
 #if 0
 			bmpce_reaper(bmpce_pool);
@@ -468,6 +896,26 @@ bmpce_release_locked(struct bmap_pagecache_entry *e, struct bmap_pagecache *bmpc
 	bmap_op_done_type(b, BMAP_OPCNT_BMPCE);
 }
 
+/*
+ * Check whether any page of a write biorq is still on the wire with an
+ * earlier write window.  Such a biorq must wait for the next window.
+ */
+int
+bmpc_biorq_wnd_busy(struct bmpc_ioreq *r)
+{
+	struct bmap_pagecache_entry *e;
+	int i, busy = 0;
+
+	DYNARRAY_FOREACH(e, i, &r->biorq_pages) {
+		BMPCE_LOCK(e);
+		busy = BMPCE_WND_BUSY(e);
+		BMPCE_ULOCK(e);
+		if (busy)
+			break;
+	}
+	return (busy);
+}
+
 struct bmpc_ioreq *
 bmpc_biorq_new(struct msl_fsrqinfo *q, struct bmap *b, char *buf,
     uint32_t off, uint32_t len, int flags)
@@ -476,7 +924,9 @@ bmpc_biorq_new(struct msl_fsrqinfo *q, struct bmap *b, char *buf,
 	struct timespec issue;
 	struct bmpc_ioreq *r;
 
-	r = psc_pool_get(msl_biorq_pool);
+	r = msl_magcache_get(&msl_biorq_magcache);
+	if (r == NULL)
+		r = psc_pool_get(msl_biorq_pool);
 	memset(r, 0, sizeof(*r));
 	INIT_PSC_LISTENTRY(&r->biorq_lentry);
 	INIT_PSC_LISTENTRY(&r->biorq_exp_lentry);
@@ -594,14 +1044,88 @@ bmpc_biorqs_destroy_locked(struct bmap *b)
 	psc_dynarray_free(&a);
 }
 
+void
+bmpc_biorq_pool_return(void *p)
+{
+	psc_pool_return(msl_biorq_pool, p);
+}
+
+int
+bmpc_biorq_pool_bypass(void)
+{
+	return (psc_atomic32_read(&msl_biorq_pool->ppm_nwaiters) > 0);
+}
+
+void
+bmpc_biorq_free(struct bmpc_ioreq *r)
+{
+	if (!msl_magcache_put(&msl_biorq_magcache, r))
+		psc_pool_return(msl_biorq_pool, r);
+}
+
+/*
+ * Called once msl_biorq_pool exists, which is after bmpc_global_init().
+ */
+void
+bmpc_biorq_cache_init(void)
+{
+	msl_magcache_init(&msl_biorq_magcache, "biorq",
+	    bmpc_biorq_pool_return, bmpc_biorq_pool_bypass);
+}
+
 #define	PAGE_RECLAIM_BATCH	1
 
+/*
+ * Mark up to 'want' idle pages on one replacement list for freeing.  If
+ * 'rawaste' is set, only take readahead pages that were never used.
+ */
+__static int
+bmpc_reap_list(struct psc_lockedlist *pll, int rawaste,
+    struct psc_dynarray *a, int want)
+{
+	struct bmap_pagecache_entry *e;
+	int n = 0;
+
+	if (want <= 0 || !pll_nitems(pll))
+		return (0);
+
+	/*
+ 	 * Hold a list lock can cause deadlock and slow things down.
+ 	 * So do it in two loops.
+ 	 */
+	PLL_LOCK(pll);
+	PLL_FOREACH(e, pll) {
+		if (!BMPCE_TRYLOCK(e))
+			continue;
+
+		if (e->bmpce_ref || e->bmpce_flags & BMPCEF_TOFREE) {
+			DEBUG_BMPCE(PLL_DIAG, e, "non-zero ref, skip");
+			BMPCE_ULOCK(e);
+			continue;
+		}
+		if (rawaste && (e->bmpce_flags &
+		    (BMPCEF_READAHEAD | BMPCEF_ACCESSED)) !=
+		    BMPCEF_READAHEAD) {
+			BMPCE_ULOCK(e);
+			continue;
+		}
+		e->bmpce_flags |= BMPCEF_TOFREE;
+		BMPCE_ULOCK(e);
+
+		psc_dynarray_add(a, e);
+		if (++n >= want)
+			break;
+	}
+	PLL_ULOCK(pll);
+	return (n);
+}
+
 /* Called from psc_pool_reap() and msl_pgcache_reap() */
 int
 bmpce_reaper(struct psc_poolmgr *m)
 {
 	struct bmap *b;
-	int i, nfreed, haswork;
+	int i, n, want, nfreed, haswork, pass, a1in_over;
 	struct bmap_pagecache *bmpc;
 	struct bmap_pagecache_entry *e;
 	struct psc_thread *thr;
@@ -614,72 +1138,101 @@ bmpce_reaper(struct psc_poolmgr *m)
 
 	nfreed = 0;
 	haswork = 0;
-	LIST_CACHE_LOCK(&bmpcLru);
-	LIST_CACHE_FOREACH(bmpc, &bmpcLru) {
-
-		b = bmpc_2_bmap(bmpc);
-		if (!pll_nitems(&bmpc->bmpc_lru))
-			continue;
-
-		haswork = 1;
-		if (!BMAP_TRYLOCK(b))
-			continue;
-		bmap_op_start_type(b, BMAP_OPCNT_WORK);
 
-		/*
- 		 * Hold a list lock can cause deadlock and slow things down.
- 		 * So do it in two loops.
- 		 */
-		PLL_LOCK(&bmpc->bmpc_lru);
-		PLL_FOREACH(e, &bmpc->bmpc_lru) {
-			if (!BMPCE_TRYLOCK(e))
+	/*
+	 * Under 2Q, the first pass only takes A1in pages: readahead that
+	 * was never used, plus any other A1in page while A1in is over its
+	 * target share.  This is done across all bmaps before any Am page
+	 * is touched so that a scan of one file cannot push the working
+	 * set of others out.  The second pass takes from Am, then A1in.
+	 */
+	for (pass = msl_pgcache_lru ? 1 : 0; pass < 2; pass++) {
+		a1in_over = psc_atomic32_read(&msl_pgcache_na1in) >
+		    PGCACHE_A1IN_TARGET;
+		LIST_CACHE_LOCK(&bmpcLru);
+		LIST_CACHE_FOREACH(bmpc, &bmpcLru) {
+
+			b = bmpc_2_bmap(bmpc);
+			if (!pll_nitems(&bmpc->bmpc_lru) &&
+			    !pll_nitems(&bmpc->bmpc_a1in))
 				continue;
 
-			if (e->bmpce_ref || e->bmpce_flags & BMPCEF_TOFREE) {
-				DEBUG_BMPCE(PLL_DIAG, e, "non-zero ref, skip");
-				BMPCE_ULOCK(e);
+			haswork = 1;
+			if (pass == 0 && !pll_nitems(&bmpc->bmpc_a1in))
 				continue;
+			if (!BMAP_TRYLOCK(b))
+				continue;
+			bmap_op_start_type(b, BMAP_OPCNT_WORK);
+
+			want = MAX(PAGE_RECLAIM_BATCH,
+			    psc_atomic32_read(&m->ppm_nwaiters)) - nfreed;
+
+			if (pass == 0) {
+				n = bmpc_reap_list(&bmpc->bmpc_a1in, 1, &a,
+				    want);
+				if (n)
+					OPSTAT_ADD("msl.bmpce-reap-rawaste",
+					    n);
+				if (a1in_over)
+					n += bmpc_reap_list(&bmpc->bmpc_a1in,
+					    0, &a, want - n);
+			} else {
+				n = bmpc_reap_list(&bmpc->bmpc_lru, 0, &a,
+				    want);
+				n += bmpc_reap_list(&bmpc->bmpc_a1in, 0, &a,
+				    want - n);
 			}
-			e->bmpce_flags |= BMPCEF_TOFREE;
-			BMPCE_ULOCK(e);
+			nfreed += n;
+
+			DYNARRAY_FOREACH(e, i, &a) {
+				BMPCE_LOCK(e);
+				if (!(e->bmpce_flags & BMPCEF_HOT)) {
+					OPSTAT_INCR("msl.bmpce-reap-a1in");
+					if ((e->bmpce_flags &
+					    (BMPCEF_READAHEAD |
+					     BMPCEF_ACCESSED)) !=
+					    BMPCEF_READAHEAD)
+						bmpce_ghost_add(e);
+				} else
+					OPSTAT_INCR("msl.bmpce-reap-am");
+				bmpce_lru_remove(e, bmpc);
+				bmpce_free(e, bmpc);
+				bmap_op_done_type(b, BMAP_OPCNT_BMPCE);
+			}
+			psc_dynarray_reset(&a);
+
+			bmap_op_done_type(b, BMAP_OPCNT_WORK);
 
-			psc_dynarray_add(&a, e);
-			nfreed++;
 			if (nfreed >= PAGE_RECLAIM_BATCH &&
 			    nfreed >= psc_atomic32_read(&m->ppm_nwaiters))
 				break;
 		}
-		PLL_ULOCK(&bmpc->bmpc_lru);
-		DYNARRAY_FOREACH(e, i, &a) {
-			BMPCE_LOCK(e);
-			pfl_assert(e->bmpce_flags & BMPCEF_LRU);
-			pll_remove(&bmpc->bmpc_lru, e);
-			e->bmpce_flags &= ~BMPCEF_LRU;
-			bmpce_free(e, bmpc);
-			bmap_op_done_type(b, BMAP_OPCNT_BMPCE);
-		}
-		psc_dynarray_reset(&a);
-
-		bmap_op_done_type(b, BMAP_OPCNT_WORK);
+		LIST_CACHE_ULOCK(&bmpcLru);
 
 		if (nfreed >= PAGE_RECLAIM_BATCH &&
 		    nfreed >= psc_atomic32_read(&m->ppm_nwaiters))
 			break;
-	
 	}
-	LIST_CACHE_ULOCK(&bmpcLru);
 
 	/*
 	 * I have also tried to let all non PFL_THRT_FS and non
 	 * MSTHRT_READAHEAD to work harder, to no avail.
 	 */
 	if (thr->pscthr_type == MSTHRT_REAP && 
-	    m->ppm_nfree < MIN_FREE_PAGES && haswork) {
+	    bmpce_nfree() < MIN_FREE_PAGES && haswork) {
 		pscthr_yield();
 		OPSTAT_INCR("msl.reap-loop");
 		goto again;
 	}
 
+	/*
+	 * Entries we just freed may have landed in the magazines.  We
+	 * may be running inside pool reclaim, so let the reaper thread
+	 * hand them to the waiters.
+	 */
+	if (psc_atomic32_read(&m->ppm_nwaiters))
+		pfl_waitq_wakeone(&sl_freap_waitq);
+
 	psc_dynarray_free(&a);
 	psclog_diag("nfreed=%d, waiters=%d", nfreed,
 	    psc_atomic32_read(&m->ppm_nwaiters));
@@ -703,6 +1256,8 @@ bmpc_global_init(void)
 	    msl_bmpces_min, msl_bmpces_min, msl_bmpces_max, 
 	    bmpce_reaper, "bmpce");
 	bmpce_pool = psc_poolmaster_getmgr(&bmpce_poolmaster);
+	msl_magcache_init(&msl_bmpce_magcache, "bmpce",
+	    bmpce_pool_return, bmpce_pool_bypass);
 
 	msl_pgcache_init();
 
@@ -713,6 +1268,10 @@ bmpc_global_init(void)
 
 	lc_reginit(&bmpcLru, struct bmap_pagecache, bmpc_lentry,
 	    "bmpclru");
+
+	msl_pgcache_nghosts = msl_bmpces_max / 2;
+	msl_pgcache_ghosts = PSCALLOC(msl_pgcache_nghosts *
+	    sizeof(*msl_pgcache_ghosts));
 }
 
 void
@@ -738,6 +1297,9 @@ dump_bmpce_flags(uint32_t flags)
 	PFL_PRFLAG(BMPCEF_READAHEAD, &flags, &seq);
 	PFL_PRFLAG(BMPCEF_ACCESSED, &flags, &seq);
 	PFL_PRFLAG(BMPCEF_IDLE, &flags, &seq);
+	PFL_PRFLAG(BMPCEF_RA_STRIDE, &flags, &seq);
+	PFL_PRFLAG(BMPCEF_RA_REVERSE, &flags, &seq);
+	PFL_PRFLAG(BMPCEF_HOT, &flags, &seq);
 	if (flags)
 		printf(" unknown: %#x", flags);
 	printf("\n");
@@ -64,22 +64,42 @@ struct bmap_pagecache_entry {
 	uint16_t		 bmpce_len;
 	uint32_t		 bmpce_off;	/* relative to inside bmap */
 	uint32_t		 bmpce_start;	/* region where data are valid */
-	 int16_t		 bmpce_pins;	/* page contents are read-only */
+	uint16_t		 bmpce_wseq;	/* write windows put on the wire */
+	uint16_t		 bmpce_wdone;	/* write windows acknowledged */
+	 int16_t		 bmpce_rpins;	/* read replies referencing page_buf */
 	psc_spinlock_t		 bmpce_lock;
 	struct bmap_page_entry	*bmpce_entry;	/* statically allocated pg contents */
+	struct bmap_page_entry	*bmpce_wnd_entry;/* contents in write window */
 	struct pfl_waitq	*bmpce_waitq;	/* others block here on I/O */
 	struct psc_lockedlist	 bmpce_pndgaios;
-	RB_ENTRY(bmap_pagecache_entry) bmpce_tentry;
 	struct psc_listentry	 bmpce_lentry;	/* chain on bmap LRU */
 };
 
-#define	PAGE_CANFREE		0x01
-#define	PAGE_MADVISE		0x02
+#define	PAGE_MADVISE		0x02		/* dirtied since last madvise(2) */
+
+/*
+ * Page buffers are carved out of a few large anonymous mappings instead
+ * of one mmap(2) per buffer so the size of the page cache is not bound
+ * by vm.max_map_count.  Arenas are optionally backed by huge pages.
+ */
+struct bmap_page_arena {
+	struct psc_listentry	 pga_lentry;	/* chain on msl_pgcache_arenas */
+	char			*pga_base;
+	size_t			 pga_size;	/* length of the mapping */
+	int			 pga_flags;	/* PGAF_* flag bits */
+	int			 pga_nbufs;
+	struct bmap_page_entry	*pga_entries;
+};
+
+#define PGAF_CANFREE		(1 << 0)	/* grown after init, may be unmapped */
+#define PGAF_HUGETLB		(1 << 1)	/* backed by MAP_HUGETLB */
+#define PGAF_THP		(1 << 2)	/* MADV_HUGEPAGE was accepted */
 
 struct bmap_page_entry {
 	struct psc_listentry	 page_lentry;
 	int			 page_flag;
 	void			*page_buf;
+	struct bmap_page_arena	*page_arena;
 };
 
 /* bmpce_flags */
@@ -93,6 +113,9 @@ struct bmap_page_entry {
 #define BMPCEF_READAHEAD	(1 <<  7)	/* populated from readahead */
 #define BMPCEF_ACCESSED		(1 <<  8)	/* bmpce was used before reap (readahead) */
 #define BMPCEF_IDLE		(1 <<  9)	/* on idle_pages listcache */
+#define BMPCEF_RA_STRIDE	(1 << 10)	/* readahead for a strided stream */
+#define BMPCEF_RA_REVERSE	(1 << 11)	/* readahead for a reverse scan */
+#define BMPCEF_HOT		(1 << 12)	/* on bmpc_lru (2Q Am) instead of bmpc_a1in */
 
 #define BMPCE_LOCK(e)		spinlock(&(e)->bmpce_lock)
 #define BMPCE_ULOCK(e)		freelock(&(e)->bmpce_lock)
@@ -101,6 +124,15 @@ struct bmap_page_entry {
 #define BMPCE_URLOCK(e, lk)	ureqlock(&(e)->bmpce_lock, (lk))
 #define BMPCE_LOCK_ENSURE(e)	LOCK_ENSURE(&(e)->bmpce_lock)
 
+/*
+ * A page is in a write window from the moment it is attached to a WRITE
+ * RPC until the reply arrives.  Writers may keep dirtying the page
+ * meanwhile, but into a copy of the buffer (see msl_pages_copyin()) so
+ * the one the IOS pulls from is never torn; their biorqs are held back
+ * for the next window so the page is never on the wire twice.
+ */
+#define BMPCE_WND_BUSY(e)	((e)->bmpce_wseq != (e)->bmpce_wdone)
+
 #define BMPCE_WAIT(e)		pfl_waitq_wait((e)->bmpce_waitq, &(e)->bmpce_lock)
 
 #define BMPCE_WAKE(e)							\
@@ -125,8 +157,8 @@ struct bmap_page_entry {
 #define DEBUG_BMPCE(level, pg, fmt, ...)				\
 	psclogs((level), SLSS_BMAP,					\
 	    "bmpce@%p fcmh=%p fid="SLPRI_FID" "				\
-	    "fl=%#x:%s%s%s%s%s%s%s%s%s "				\
-	    "off=%#09x entry=%p ref=%u : " fmt,				\
+	    "fl=%#x:%s%s%s%s%s%s%s%s%s%s%s%s "				\
+	    "off=%#09x entry=%p ref=%u wnd=%u/%u : " fmt,		\
 	    (pg), (pg)->bmpce_bmap->bcm_fcmh,				\
 	    fcmh_2_fid((pg)->bmpce_bmap->bcm_fcmh), (pg)->bmpce_flags,	\
 	    (pg)->bmpce_flags & BMPCEF_DATARDY		? "d" : "",	\
@@ -138,20 +170,38 @@ struct bmap_page_entry {
 	    (pg)->bmpce_flags & BMPCEF_READAHEAD	? "r" : "",	\
 	    (pg)->bmpce_flags & BMPCEF_ACCESSED		? "a" : "",	\
 	    (pg)->bmpce_flags & BMPCEF_IDLE		? "i" : "",	\
+	    (pg)->bmpce_flags & BMPCEF_RA_STRIDE	? "s" : "",	\
+	    (pg)->bmpce_flags & BMPCEF_RA_REVERSE	? "R" : "",	\
+	    (pg)->bmpce_flags & BMPCEF_HOT		? "H" : "",	\
 	    (pg)->bmpce_off, (pg)->bmpce_entry,				\
-	    (pg)->bmpce_ref, ## __VA_ARGS__)
+	    (pg)->bmpce_ref, (pg)->bmpce_wdone, (pg)->bmpce_wseq,	\
+	    ## __VA_ARGS__)
 
-static __inline int
-bmpce_cmp(const void *x, const void *y)
-{
-	const struct bmap_pagecache_entry *a = x, *b = y;
+/*
+ * Per-bmap page table.  A bmap holds at most BMPC_NPAGES pages, so
+ * entries are indexed directly by bmpce_off / BMPC_BUFSZ through a
+ * two-level table whose leaves are allocated on demand.  Each leaf has
+ * a 64-bit occupancy word and a summary word records which leaves are
+ * non-empty, so range scans are done a word at a time.
+ *
+ * The table is protected by bci_rwlock.
+ */
+#define BMPC_NPAGES		(SLASH_BMAP_SIZE / BMPC_BUFSZ)	/* 4096 */
+#define BMPC_PT_LEAFSZ		64
+#define BMPC_PT_NLEAVES		(BMPC_NPAGES / BMPC_PT_LEAFSZ)
 
-	return (CMP(a->bmpce_off, b->bmpce_off));
-}
+#if BMPC_PT_NLEAVES > 64
+#error bump bpt_summary
+#endif
+
+struct bmap_pagetable {
+	uint64_t			  bpt_summary;	/* bit per non-empty leaf */
+	uint64_t			  bpt_occ[BMPC_PT_NLEAVES];
+	struct bmap_pagecache_entry	**bpt_leaves[BMPC_PT_NLEAVES];
+	int				  bpt_npages;
+};
 
-RB_HEAD(bmap_pagecachetree, bmap_pagecache_entry);
-RB_PROTOTYPE(bmap_pagecachetree, bmap_pagecache_entry, bmpce_tentry,
-    bmpce_cmp)
+#define bmpce_2_ptidx(e)	((e)->bmpce_off / BMPC_BUFSZ)
 
 struct bmpc_ioreq {
 	char			*biorq_buf;
@@ -187,6 +237,7 @@ struct bmpc_ioreq {
 #define BIORQ_ONTREE		(1 <<  8)	/* on bmpc_biorqs rbtree */
 #define BIORQ_READAHEAD		(1 <<  9)	/* performed by readahead */
 #define BIORQ_AIOWAKE		(1 << 10)	/* aio needs wakeup */
+#define BIORQ_LAUNCHED		(1 << 11)	/* read RPCs already sent by msl_io() */
 
 #define BIORQ_LOCK(r)		spinlock(&(r)->biorq_lock)
 #define BIORQ_ULOCK(r)		freelock(&(r)->biorq_lock)
@@ -199,7 +250,7 @@ struct bmpc_ioreq {
 
 #define DEBUGS_BIORQ(level, ss, r, fmt, ...)				\
 	psclogs((level), (ss), "biorq@%p "				\
-	    "flg=%#x:%s%s%s%s%s%s%s%s%s%s%s "				\
+	    "flg=%#x:%s%s%s%s%s%s%s%s%s%s%s%s "				\
 	    "ref=%d off=%u len=%u "					\
 	    "retry=%u buf=%p rqi=%p pfr=%p "				\
 	    "sliod=%x npages=%d "					\
@@ -216,6 +267,7 @@ struct bmpc_ioreq {
 	    (r)->biorq_flags & BIORQ_ONTREE		? "t" : "",	\
 	    (r)->biorq_flags & BIORQ_READAHEAD		? "a" : "",	\
 	    (r)->biorq_flags & BIORQ_AIOWAKE		? "k" : "",	\
+	    (r)->biorq_flags & BIORQ_LAUNCHED		? "L" : "",	\
 	    (r)->biorq_ref, (r)->biorq_off, (r)->biorq_len,		\
 	    (r)->biorq_retries, (r)->biorq_buf, (r)->biorq_fsrqi,	\
 	    (r)->biorq_fsrqi ? mfsrq_2_pfr((r)->biorq_fsrqi) : NULL,	\
@@ -247,8 +299,16 @@ RB_HEAD(bmpc_biorq_tree, bmpc_ioreq);
 RB_PROTOTYPE(bmpc_biorq_tree, bmpc_ioreq, biorq_tentry, bmpc_biorq_cmp)
 
 struct bmap_pagecache {
-	struct bmap_pagecachetree	 bmpc_tree;		/* tree of entries */
-	struct psc_lockedlist		 bmpc_lru;
+	struct bmap_pagetable		 bmpc_pages;		/* table of entries */
+
+	/*
+	 * Idle pages.  Under the 2Q policy a page starts out on the
+	 * FIFO bmpc_a1in and only goes to the LRU bmpc_lru if it is
+	 * faulted in again soon after being evicted, so one pass over
+	 * a large file cannot push out the pages that are reused.
+	 */
+	struct psc_lockedlist		 bmpc_lru;		/* Am */
+	struct psc_lockedlist		 bmpc_a1in;		/* A1in */
 
 	/*
 	 * List for new requests minus BIORQ_READ and BIORQ_DIO.  All
@@ -291,6 +351,11 @@ bmpce_usecheck(struct bmap_pagecache_entry *bmpce, __unusedx int op,
 void	 bmap_pagecache_destroy(void);
 
 void	 bmpc_global_init(void);
+void	 bmpc_pt_insert(struct bmap_pagecache *,
+	    struct bmap_pagecache_entry *);
+void	 bmpc_pt_remove(struct bmap_pagecache *,
+	    struct bmap_pagecache_entry *);
+void	 bmpc_pt_destroy(struct bmap_pagecache *);
 void	 bmpc_freeall(struct bmap *);
 void	 bmpc_biorqs_flush(struct bmap *);
 
@@ -299,10 +364,20 @@ void	bmpc_expire_biorqs(struct bmap_pagecache *);
 struct bmpc_ioreq *
 	 bmpc_biorq_new(struct msl_fsrqinfo *, struct bmap *,
 	    char *, uint32_t, uint32_t, int);
+void	 bmpc_biorq_free(struct bmpc_ioreq *);
+int	 bmpc_biorq_wnd_busy(struct bmpc_ioreq *);
+void	 bmpc_biorq_cache_init(void);
 
 int      bmpce_lookup(struct bmpc_ioreq *,
              struct bmap *, int, uint32_t, struct pfl_waitq *);
 
+struct bmap_pagecache_entry *
+	 bmpce_alloc(int);
+void	 bmpce_dealloc(struct bmap_pagecache_entry *);
+struct bmap_page_entry *
+	 msl_pgcache_get(int);
+void	 msl_pgcache_put(struct bmap_page_entry *);
+int	 bmpce_nfree(void);
 void	 bmpce_init(struct bmap_pagecache_entry *);
 void     bmpce_release_locked(struct bmap_pagecache_entry *,
             struct bmap_pagecache *);
@@ -311,8 +386,11 @@ struct bmpc_write_coalescer *	 bwc_alloc(void);
 void				 bwc_free(struct bmpc_write_coalescer *);
 
 void	bmpce_free(struct bmap_pagecache_entry *, struct bmap_pagecache *);
+void	bmpce_lru_remove(struct bmap_pagecache_entry *,
+	    struct bmap_pagecache *);
 
 extern struct psc_poolmgr	*bmpce_pool;
+extern int			 msl_bmpces_max;
 extern struct psc_poolmgr	*bwc_pool;
 
 extern struct timespec		 msl_bflush_maxage;
@@ -323,6 +401,55 @@ extern struct psc_listcache	 bmpcLru;
 
 void   bmpc_biorqs_destroy_locked(struct bmap *);
 
+static __inline struct bmap_pagecache_entry *
+bmpc_pt_get(struct bmap_pagecache *bmpc, int idx)
+{
+	struct bmap_pagetable *pt = &bmpc->bmpc_pages;
+
+	if (!(pt->bpt_occ[idx / BMPC_PT_LEAFSZ] &
+	    (UINT64_C(1) << (idx % BMPC_PT_LEAFSZ))))
+		return (NULL);
+	return (pt->bpt_leaves[idx / BMPC_PT_LEAFSZ][idx % BMPC_PT_LEAFSZ]);
+}
+
+static __inline struct bmap_pagecache_entry *
+bmpc_pt_lookup(struct bmap_pagecache *bmpc, uint32_t off)
+{
+	return (bmpc_pt_get(bmpc, off / BMPC_BUFSZ));
+}
+
+/*
+ * Return the index of the first resident page at or after idx, or -1.
+ */
+static __inline int
+bmpc_pt_next(struct bmap_pagecache *bmpc, int idx)
+{
+	struct bmap_pagetable *pt = &bmpc->bmpc_pages;
+	uint64_t w;
+	int l1;
+
+	while (idx < BMPC_NPAGES) {
+		l1 = idx / BMPC_PT_LEAFSZ;
+		w = pt->bpt_occ[l1] & (~UINT64_C(0) << (idx % BMPC_PT_LEAFSZ));
+		if (w)
+			return (l1 * BMPC_PT_LEAFSZ + __builtin_ctzll(w));
+		if (++l1 >= BMPC_PT_NLEAVES)
+			break;
+		w = pt->bpt_summary & (~UINT64_C(0) << l1);
+		if (!w)
+			break;
+		idx = __builtin_ctzll(w) * BMPC_PT_LEAFSZ;
+	}
+	return (-1);
+}
+
+#define bmpc_pt_empty(bmpc)	((bmpc)->bmpc_pages.bpt_npages == 0)
+
+#define BMPC_PT_FOREACH(e, bmpc, idx)					\
+	for ((idx) = bmpc_pt_next((bmpc), 0);				\
+	    (idx) != -1 && (((e) = bmpc_pt_get((bmpc), (idx))) || 1);	\
+	    (idx) = bmpc_pt_next((bmpc), (idx) + 1))
+
 static __inline void
 bmpc_init(struct bmap_pagecache *bmpc)
 {
@@ -332,6 +459,8 @@ bmpc_init(struct bmap_pagecache *bmpc)
 
 	pll_init(&bmpc->bmpc_lru, struct bmap_pagecache_entry,
 	    bmpce_lentry, NULL);
+	pll_init(&bmpc->bmpc_a1in, struct bmap_pagecache_entry,
+	    bmpce_lentry, NULL);
 
 	/* Double check the exclusivity of these lists... */
 	pll_init(&bmpc->bmpc_pndg_biorqs, struct bmpc_ioreq,
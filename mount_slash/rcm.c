@@ -30,6 +30,7 @@
 #include "pfl/str.h"
 
 #include "authbuf.h"
+#include "batchrpc.h"
 #include "bmap.h"
 #include "bmap_cli.h"
 #include "ctl_cli.h"
@@ -300,6 +301,8 @@ msrcm_handle_file_cb(struct pscrpc_request *rq)
  	 */
 	PFL_GETTIMEVAL(&now);
 	fci->fci_expire = now.tv_sec;
+	f->fcmh_flags &= ~FCMH_CLI_XATTR_INFO;
+	msl_xattr_cache_purge(f);
 	if (f->fcmh_flags & FCMH_CLI_DIRTY_QUEUE) {
 		OPSTAT_INCR("msl.callback-flush-attrs");
 		lc_move2head(&msl_attrtimeoutq, fci);
@@ -437,6 +440,9 @@ slc_rcm_handler(struct pscrpc_request *rq)
 	case SRMT_FILECB:
 		rc = msrcm_handle_file_cb(rq);
 		break;
+	case SRMT_BATCH_RP:
+		rc = slrpc_batch_handle_reply(rq);
+		break;
 	default:
 		psclog_errorx("unexpected opcode %d", rq->rq_reqmsg->opc);
 		rq->rq_status = -PFLERR_NOSYS;
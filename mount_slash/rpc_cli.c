@@ -27,6 +27,7 @@
 #include "pfl/service.h"
 #include "pfl/str.h"
 
+#include "batchrpc.h"
 #include "ctl_cli.h"
 #include "mount_slash.h"
 #include "rpc_cli.h"
@@ -43,6 +44,166 @@ struct sl_resm			*msl_rmc_resm;
 struct pscrpc_svc_handle	*msl_rci_svh;
 struct pscrpc_svc_handle	*msl_rcm_svh;
 
+/*
+ * The in-flight RPC limit for each resource is a congestion window
+ * rather than a fixed cap.  The window opens on completions whose
+ * latency stays near the best seen so far and closes when latency
+ * climbs or RPCs time out.  The static limits remain as ceilings.
+ */
+int				 msl_rpc_window_adapt = 1;
+int				 msl_rpc_window_min = RPCI_CC_WINDOW_MIN;
+int				 msl_rpc_window_init = RPCI_CC_WINDOW_INIT;
+
+__static int
+msl_resm_max_inflight(struct sl_resm *m)
+{
+	if (m->resm_type == SLREST_MDS)
+		return (msl_mds_max_inflight_rpcs);
+	return (msl_ios_max_inflight_rpcs);
+}
+
+/*
+ * Return the current in-flight RPC limit for a resource.  The caller
+ * must hold the rpci lock.
+ */
+__static int
+msl_resm_window(struct sl_resm *m, struct resprof_cli_info *rpci)
+{
+	int max, min;
+
+	max = msl_resm_max_inflight(m);
+	if (!msl_rpc_window_adapt)
+		return (max);
+
+	min = MIN(MAX(msl_rpc_window_min, 1), max);
+	if (!rpci->rpci_cc_window) {
+		rpci->rpci_cc_window = msl_rpc_window_init;
+		rpci->rpci_cc_ssthresh = max;
+	}
+	if (rpci->rpci_cc_window > max)
+		rpci->rpci_cc_window = max;
+	if (rpci->rpci_cc_window < min)
+		rpci->rpci_cc_window = min;
+	return (rpci->rpci_cc_window);
+}
+
+__static void
+msl_resm_window_reset(struct resprof_cli_info *rpci,
+    struct timespec *now)
+{
+	rpci->rpci_cc_ncomp = 0;
+	rpci->rpci_cc_inflsum = 0;
+	rpci->rpci_cc_start = *now;
+}
+
+/*
+ * An RPC is going out to a resource with nothing outstanding: move the
+ * epoch start forward by the time it sat idle.  The caller must hold
+ * the rpci lock.
+ */
+__static void
+msl_resm_window_resume(struct resprof_cli_info *rpci)
+{
+	struct timespec now, d;
+
+	PFL_GETTIMESPEC(&now);
+	timespecsub(&now, &rpci->rpci_cc_idle, &d);
+	timespecadd(&rpci->rpci_cc_start, &d, &rpci->rpci_cc_start);
+	rpci->rpci_cc_idle.tv_sec = 0;
+	rpci->rpci_cc_idle.tv_nsec = 0;
+}
+
+/*
+ * Feed one RPC completion into the congestion window of a resource.
+ * Per-RPC send times are not tracked here, so the latency of each
+ * epoch (one window's worth of completions) is estimated with
+ * Little's law: average in-flight count divided by completion rate.
+ * The caller must hold the rpci lock.
+ */
+__static void
+msl_resm_window_update(struct sl_resm *m, struct resprof_cli_info *rpci,
+    int rc)
+{
+	int w, min, max, limited;
+	struct timespec now, d;
+	uint64_t elapsed, lat;
+
+	w = msl_resm_window(m, rpci);
+	max = msl_resm_max_inflight(m);
+	min = MIN(MAX(msl_rpc_window_min, 1), max);
+
+	PFL_GETTIMESPEC(&now);
+	/* idle time until the next send is kept out of the epoch */
+	if (!rpci->rpci_infl_rpcs)
+		rpci->rpci_cc_idle = now;
+	if (abs(rc) == ETIMEDOUT) {
+		w = MAX(w / 2, min);
+		rpci->rpci_cc_window = rpci->rpci_cc_ssthresh = w;
+		msl_resm_window_reset(rpci, &now);
+		OPSTAT_INCR("msl.rpc-window-timeout");
+		return;
+	}
+	if (rc)
+		return;
+
+	if (rpci->rpci_cc_start.tv_sec == 0)
+		rpci->rpci_cc_start = now;
+	rpci->rpci_cc_ncomp++;
+	rpci->rpci_cc_inflsum += rpci->rpci_infl_rpcs + 1;
+	if (rpci->rpci_cc_ncomp < w)
+		return;
+
+	timespecsub(&now, &rpci->rpci_cc_start, &d);
+	elapsed = d.tv_sec * 1000000 + d.tv_nsec / 1000;
+	lat = rpci->rpci_cc_inflsum * elapsed /
+	    ((uint64_t)rpci->rpci_cc_ncomp * rpci->rpci_cc_ncomp);
+
+	/*
+	 * If the average in-flight count stayed well under the window,
+	 * the application rather than the server limited throughput and
+	 * the estimate says little about the server, so the window and
+	 * base latency are left alone.
+	 */
+	limited = rpci->rpci_cc_inflsum * 2 <
+	    (uint64_t)rpci->rpci_cc_ncomp * w;
+	rpci->rpci_cc_lat = lat;
+	if (limited) {
+		OPSTAT_INCR("msl.rpc-window-limited");
+		msl_resm_window_reset(rpci, &now);
+		return;
+	}
+
+	/*
+	 * The base latency is the minimum over the current and previous
+	 * period of RPCI_CC_BASE_EPOCHS epochs, so an old minimum ages
+	 * out without a single congested epoch ever becoming the base.
+	 */
+	if (++rpci->rpci_cc_nepoch % RPCI_CC_BASE_EPOCHS == 0) {
+		rpci->rpci_cc_minlat_prev = rpci->rpci_cc_minlat_cur;
+		rpci->rpci_cc_minlat_cur = 0;
+	}
+	if (!rpci->rpci_cc_minlat_cur || lat < rpci->rpci_cc_minlat_cur)
+		rpci->rpci_cc_minlat_cur = MAX(lat, 1);
+	rpci->rpci_cc_minlat = rpci->rpci_cc_minlat_cur;
+	if (rpci->rpci_cc_minlat_prev &&
+	    rpci->rpci_cc_minlat_prev < rpci->rpci_cc_minlat)
+		rpci->rpci_cc_minlat = rpci->rpci_cc_minlat_prev;
+
+	if (lat > rpci->rpci_cc_minlat * 2) {
+		w = MAX(w * 7 / 8, min);
+		rpci->rpci_cc_window = rpci->rpci_cc_ssthresh = w;
+		OPSTAT_INCR("msl.rpc-window-backoff");
+	} else if (lat <= rpci->rpci_cc_minlat * 5 / 4) {
+		if (w < rpci->rpci_cc_ssthresh)
+			w = MIN(w * 2, rpci->rpci_cc_ssthresh);
+		else
+			w++;
+		rpci->rpci_cc_window = MIN(w, max);
+		OPSTAT_INCR("msl.rpc-window-grow");
+	}
+	msl_resm_window_reset(rpci, &now);
+}
+
 void
 msl_resm_throttle_wake(struct sl_resm *m, int rc)
 {
@@ -68,6 +229,8 @@ msl_resm_throttle_wake(struct sl_resm *m, int rc)
 
 	pfl_assert(rpci->rpci_infl_rpcs > 0);
 	rpci->rpci_infl_rpcs--;
+	if (msl_rpc_window_adapt)
+		msl_resm_window_update(m, rpci, rc);
 	RPCI_WAKE(rpci);
 	RPCI_ULOCK(rpci);
 	if (logit)
@@ -81,24 +244,37 @@ msl_resm_throttle_yield(struct sl_resm *m)
 	struct resprof_cli_info *rpci;
 	int max, rc = 0;
 
-	if (m->resm_type == SLREST_MDS) {
-		max = msl_mds_max_inflight_rpcs;
-	} else {
-		max = msl_ios_max_inflight_rpcs;
-	}
-
 	rpci = res2rpci(m->resm_res);
 	RPCI_LOCK(rpci);
+	max = msl_resm_window(m, rpci);
 	if (rpci->rpci_infl_rpcs + rpci->rpci_infl_credits >= max)
 		rc = -EAGAIN;
 	RPCI_ULOCK(rpci);
 	return rc;
 }
 
+/*
+ * Return the number of RPCs that may still be issued to a resource
+ * before msl_resm_throttle_yield() starts pushing back.
+ */
+int
+msl_resm_throttle_avail(struct sl_resm *m)
+{
+	struct resprof_cli_info *rpci;
+	int max, avail;
+
+	rpci = res2rpci(m->resm_res);
+	RPCI_LOCK(rpci);
+	max = msl_resm_window(m, rpci);
+	avail = max - rpci->rpci_infl_rpcs - rpci->rpci_infl_credits;
+	RPCI_ULOCK(rpci);
+	return (avail > 0 ? avail : 0);
+}
+
 int
 msl_resm_get_credit(struct sl_resm *m, int secs)
 {
-	int max, timeout = 0;
+	int timeout = 0;
 	struct timespec ts0, ts1;
 	struct resprof_cli_info *rpci;
 	struct psc_thread *thr;
@@ -110,19 +286,14 @@ msl_resm_get_credit(struct sl_resm *m, int secs)
 	pfl_assert(thr->pscthr_type == MSTHRT_FLUSH);
 	mflt = msflushthr(thr);
 
-	if (m->resm_type == SLREST_MDS) {
-		max = msl_mds_max_inflight_rpcs;
-	} else {
-		max = msl_ios_max_inflight_rpcs;
-	}
-
 	rpci = res2rpci(m->resm_res);
 	/*
 	 * XXX use resm multiwait?
 	 */
 	PFL_GETTIMESPEC(&ts0);
 	RPCI_LOCK(rpci);
-	while (rpci->rpci_infl_rpcs + rpci->rpci_infl_credits >= max) {
+	while (rpci->rpci_infl_rpcs + rpci->rpci_infl_credits >=
+	    msl_resm_window(m, rpci)) {
 		RPCI_WAIT(rpci);
 		OPSTAT_INCR("msl.throttle-credit-wait");
 		RPCI_LOCK(rpci);
@@ -170,7 +341,7 @@ msl_resm_throttle_wait(struct sl_resm *m)
 {
 	struct timespec ts0, ts1, tsd;
 	struct resprof_cli_info *rpci;
-	int account = 0, max;
+	int account = 0;
 
 	struct psc_thread *thr;
 	struct msflush_thread * mflt = NULL;
@@ -179,12 +350,6 @@ msl_resm_throttle_wait(struct sl_resm *m)
 	if (thr->pscthr_type == MSTHRT_FLUSH)
 		mflt = msflushthr(thr);
 
-	if (m->resm_type == SLREST_MDS) {
-		max = msl_mds_max_inflight_rpcs;
-	} else {
-		max = msl_ios_max_inflight_rpcs;
-	}
-
 	rpci = res2rpci(m->resm_res);
 	/*
 	 * XXX use resm multiwait?
@@ -197,7 +362,8 @@ msl_resm_throttle_wait(struct sl_resm *m)
 		OPSTAT_INCR("msl.throttle-credit");
 		goto out;
 	}
-	while (rpci->rpci_infl_rpcs + rpci->rpci_infl_credits >= max) {
+	while (rpci->rpci_infl_rpcs + rpci->rpci_infl_credits >=
+	    msl_resm_window(m, rpci)) {
 		if (!account) {
 			PFL_GETTIMESPEC(&ts0);
 			account = 1;
@@ -209,6 +375,8 @@ msl_resm_throttle_wait(struct sl_resm *m)
 
  out:
 
+	if (!rpci->rpci_infl_rpcs && rpci->rpci_cc_idle.tv_sec)
+		msl_resm_window_resume(rpci);
 	rpci->rpci_infl_rpcs++;
 	rpci->rpci_total_rpcs++;
 	if (rpci->rpci_infl_rpcs > rpci->rpci_max_infl_rpcs)
@@ -443,6 +611,8 @@ sl_resm_hldrop(struct sl_resm *resm)
 		PLL_FOREACH(mrsq, &msctl_replsts)
 			mrsq_release(mrsq, ECONNRESET);
 		PLL_ULOCK(&msctl_replsts);
+		slrpc_batches_drop(resm->resm_res);
+		msl_fidpool_reset();
 	} else if (resm->resm_type == SLREST_ARCHIVAL_FS) {
 		struct psc_listcache *lc;
 		struct slc_async_req *car;
@@ -33,12 +33,16 @@ struct slrpc_cservice;
 /* async RPC pointers, must be less than PSCRPC_MAX_ASYNC_ARGS */
 #define MSL_CBARG_BMPCE			0
 #define MSL_CBARG_CSVC			1
+#define MSL_CBARG_HEDGE			2
 #define MSL_CBARG_BIORQ			3
 #define MSL_CBARG_BIORQS		4
 #define MSL_CBARG_BMAP			5
 #define MSL_CBARG_RESM			6
 #define MSL_CBARG_IOVS			7
 
+/* async RPC scalars */
+#define MSL_CBARG_STIME			0	/* usecs when a read was sent */
+
 
 #define MSL_READDIR_CBARG_CSVC		0
 #define MSL_READDIR_CBARG_FCMH		1
@@ -150,7 +154,9 @@ msl_getmw(void)
 		return (&msrcmthr(thr)->mrcm_mw);
 	case MSTHRT_READAHEAD:
 		return (&msreadaheadthr(thr)->mrat_mw);
+	case MSTHRT_BATCHRPC:
 	case MSTHRT_CTL:
+	case MSTHRT_HEDGE:
 	case MSTHRT_NBRQ:
 	case MSTHRT_WORKER:
 	case PFL_THRT_CTL:
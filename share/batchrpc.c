@@ -110,6 +110,9 @@ slrpc_batch_rep_ctor(struct slrpc_batch_rep *bp)
 void
 slrpc_batch_rep_dtor(struct slrpc_batch_rep *bp)
 {
+	/* handlers may use the export until the batch is torn down */
+	if (bp->bp_exp)
+		pscrpc_export_put(bp->bp_exp);
 	PSCFREE(bp->bp_reqbuf);
 	PSCFREE(bp->bp_repbuf);
 }
@@ -436,6 +439,8 @@ slrpc_batch_handle_req_workcb(void *arg)
 	pfl_assert(n);
 	psclog_diag("work cb: wk = %p, bp = %p, bid = %"PRId64", count = %d", 
 	    wk, bp, bp->bp_bid, n); 
+	if (h->bqh_startf)
+		h->bqh_startf(bp, n);
 	for (q = bp->bp_reqbuf, p = bp->bp_repbuf, i = 0; i < n;
 	    i++, q += h->bqh_qlen, p += h->bqh_plen) {
 		/*
@@ -514,6 +519,7 @@ slrpc_batch_handle_request(struct slrpc_cservice *csvc,
 	bp->bp_refcnt = 1;
 	bp->bp_reqlen = mq->len;
 	bp->bp_csvc = csvc;
+	bp->bp_exp = pscrpc_export_get(rq->rq_export);
 	bp->bp_replen = mq->len / h->bqh_qlen * h->bqh_plen;
 	bp->bp_opc = mq->opc;
 
@@ -861,6 +867,36 @@ slrpc_batch_thr_main(struct psc_thread *thr)
 	}
 }
 
+/*
+ * Transmit any pending batch set of the given operation to a peer
+ * without waiting for it to fill or expire, for callers that must
+ * wait on the outcome of an item they have queued.
+ *
+ * @res: destination peer.
+ * @opc: underlying RPC operation code.
+ */
+void
+slrpc_batches_flush(struct sl_resource *res, int32_t opc)
+{
+	struct slrpc_batch_req *bq;
+	int found = 0;
+
+	LIST_CACHE_LOCK(&slrpc_batch_req_delayed);
+	LIST_CACHE_FOREACH(bq, &slrpc_batch_req_delayed) {
+		if (bq->bq_res != res || bq->bq_opc != opc)
+			continue;
+		spinlock(&bq->bq_lock);
+		PFL_GETTIMEVAL(&bq->bq_expire);
+		freelock(&bq->bq_lock);
+		found = 1;
+	}
+	LIST_CACHE_ULOCK(&slrpc_batch_req_delayed);
+	if (found) {
+		OPSTAT_INCR("batch-flush");
+		pfl_waitq_wakeone(&slrpc_expire_waitq);
+	}
+}
+
 /*
  * Finish all batch sets awaiting reply, intended to be called when a
  * peer connection is dropped.
@@ -892,7 +928,7 @@ slrpc_batches_drop(struct sl_resource *res)
 void
 slrpc_batches_init(int thrtype, int service, const char *thrprefix)
 {
-	if (service == SL_SLMDS) {
+	if (service == SL_SLMDS || service == SL_MOUNT) {
 		psc_poolmaster_init(&slrpc_batch_req_poolmaster,
 		    struct slrpc_batch_req, bq_lentry, PPMF_AUTO, 16, 16,
 		    0, NULL, "batch-req");
@@ -900,7 +936,8 @@ slrpc_batches_init(int thrtype, int service, const char *thrprefix)
 		    &slrpc_batch_req_poolmaster);
 	}
 
-	if (service == SL_SLIOD) {
+	/* the MDS serves batched GETATTRs from clients */
+	if (service == SL_SLIOD || service == SL_SLMDS) {
 		psc_poolmaster_init(&slrpc_batch_rep_poolmaster,
 		    struct slrpc_batch_rep, bp_lentry, PPMF_AUTO, 16, 16, 
 		    0, NULL, "batch-rep");
@@ -142,7 +142,7 @@ bmap_lookup_cache(struct fidc_membh *f, sl_bmapno_t n, int bmaprw,
 			goto restart;
 		}
 
-		/* (gdb) p ((struct bmap_cli_info *) (b+1))->bci_bmpc.bmpc_tree */
+		/* (gdb) p ((struct bmap_cli_info *) (b+1))->bci_bmpc.bmpc_pages */
 
 		if ((b->bcm_flags & BMAPF_TOFREE) ||
 		    (b->bcm_flags & BMAPF_DISCARD)) {
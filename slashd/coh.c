@@ -46,12 +46,90 @@
 #define SLM_CBARG_SLOT_CSVC	0
 #define SLM_CBARG_SLOT_BML	1
 
+int
+slm_rcm_attr_revoke_cb(struct pscrpc_request *rq,
+    __unusedx struct pscrpc_async_args *a)
+{
+	struct slrpc_cservice *csvc =
+	    rq->rq_async_args.pointer_arg[SLM_CBARG_SLOT_CSVC];
+	int rc;
+
+	SL_GET_RQ_STATUS_TYPE(csvc, rq, struct srm_filecb_rep, rc);
+	if (rc)
+		OPSTAT_INCR("slm-attr-revoke-err");
+	sl_csvc_decref(csvc);
+	return (0);
+}
+
+/*
+ * Revoke the attribute leases that clients hold on a regular file
+ * whose attributes have changed.  The client making the change, if
+ * any, is spared since its reply carries the new attributes.  The
+ * callbacks are dropped so that the next GETATTR registers again.
+ *
+ * @f: file whose attributes changed.
+ * @exp: export of the client making the change or NULL.
+ */
+void
+slm_coh_revoke_attrs(struct fidc_membh *f, struct pscrpc_export *exp)
+{
+	struct fcmh_mds_callback *cb, *next;
+	struct slrpc_cservice *csvc;
+	struct pscrpc_request *rq;
+	struct fcmh_mds_info *fmi;
+	struct srm_filecb_req *mq;
+	struct srm_filecb_rep *mp;
+	int n = 0;
+
+	if (!slm_attr_lease || !fcmh_isreg(f))
+		return;
+
+	fmi = fcmh_2_fmi(f);
+	FCMH_LOCK(f);
+	psclist_for_each_entry_safe(cb, next, &fmi->fmi_callbacks,
+	    fmc_lentry) {
+		if (exp && cb->fmc_exp == exp)
+			continue;
+
+		psclist_del(&cb->fmc_lentry, &fmi->fmi_callbacks);
+		pll_remove(&slm_fcmh_callbacks.ftt_callbacks, cb);
+		fmi->fmi_cb_count--;
+		n++;
+
+		csvc = slm_getclcsvc(cb->fmc_exp, 0);
+		psc_pool_return(slm_callback_pool, cb);
+		if (!csvc) {
+			OPSTAT_INCR("slm-attr-revoke-skip");
+			continue;
+		}
+		if (SL_RSX_NEWREQ(csvc, SRMT_FILECB, rq, mq, mp)) {
+			sl_csvc_decref(csvc);
+			continue;
+		}
+		mq->fg = f->fcmh_fg;
+		rq->rq_interpret_reply = slm_rcm_attr_revoke_cb;
+		rq->rq_async_args.pointer_arg[SLM_CBARG_SLOT_CSVC] = csvc;
+		if (SL_NBRQSET_ADD(csvc, rq)) {
+			pscrpc_req_finished(rq);
+			sl_csvc_decref(csvc);
+			continue;
+		}
+		OPSTAT_INCR("slm-attr-revoke");
+	}
+	FCMH_ULOCK(f);
+
+	/* our caller holds a reference so none of these is the last */
+	while (n--)
+		fcmh_op_done_type(f, FCMH_OPCNT_CALLBACK);
+}
+
 /*
  * Notify clients that a file/directory has been removed.
  */
 void
-slm_coh_delete_file(__unusedx struct fidc_membh *c)
+slm_coh_delete_file(struct fidc_membh *c)
 {
+	slm_coh_revoke_attrs(c, NULL);
 }
 
 void
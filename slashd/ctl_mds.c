@@ -556,6 +556,9 @@ slmctlthr_spawn(const char *fn)
 	psc_ctlparam_register_simple("sys.execute",
 	    slmctlparam_execute_get, slmctlparam_execute_set);
 
+	psc_ctlparam_register_var("sys.attr_lease",
+	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR, &slm_attr_lease);
+
 	psc_ctlparam_register_var("sys.crc_check",
 	    PFLCTL_PARAMT_INT, PFLCTL_PARAMF_RDWR, &slm_crc_check);
 
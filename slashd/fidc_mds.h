@@ -21,6 +21,7 @@
 #ifndef _FIDC_MDS_H_
 #define _FIDC_MDS_H_
 
+#include "pfl/atomic.h"
 #include "pfl/dynarray.h"
 
 #include "fid.h"
@@ -70,6 +71,7 @@ struct fcmh_mds_info {
 	struct mio_fh		  fmi_mfh;		/* file handle */
 	int			  fmi_cb_count;
 	struct psclist_head	  fmi_callbacks;
+	psc_atomic32_t		  fmi_nwriters;		/* bmaps under write lease */
 	union {
 		struct {
 			/*
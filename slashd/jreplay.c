@@ -524,8 +524,20 @@ mds_replay_handler(struct psc_journal_enthdr *pje)
 		if (sjnm->sjnm_op == NS_OP_CREATE ||
 		    sjnm->sjnm_op == NS_OP_MKDIR ||
 		    sjnm->sjnm_op == NS_OP_LINK ||
-		    sjnm->sjnm_op == NS_OP_SYMLINK)
+		    sjnm->sjnm_op == NS_OP_SYMLINK) {
 			slm_get_next_slashfid(&fid);
+			/*
+			 * A file created asynchronously by a client
+			 * carries a FID reserved ahead of time, which
+			 * may lie beyond what the cursor recorded.
+			 */
+			if (sjnm->sjnm_op == NS_OP_CREATE &&
+			    FID_GET_SITEID(sjnm->sjnm_target_fid) ==
+			    FID_GET_SITEID(fid) &&
+			    sjnm->sjnm_target_fid >= fid)
+				slm_set_curr_slashfid(
+				    sjnm->sjnm_target_fid + 1);
+		}
 		break;
 	    default:
 		psc_fatalx("invalid log entry type %d", pje->pje_type);
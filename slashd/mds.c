@@ -60,6 +60,12 @@
 int			slm_lease_timeout = BMAP_TIMEO_MAX;
 int			slm_callback_timeout = CALLBACK_TIMEO_MAX;
 
+/*
+ * Let every client cache the attributes of a regular file that is not
+ * being written until they are revoked, instead of only a sole user.
+ */
+int			slm_attr_lease = 1;
+
 #define	SLM_CBARG_SLOT_CSVC	0
 
 struct pfl_odt		*slm_bia_odt;
@@ -821,6 +827,24 @@ mds_bmap_dupls_find(struct bmap_mds_info *bmi, lnet_process_id_t *cnp,
 	return (bml);
 }
 
+/*
+ * Adjust the count of clients writing a bmap.  The file keeps its own
+ * count of bmaps being written so that attribute leases can tell
+ * whether another client may be holding a newer size.
+ */
+static __inline void
+mds_bmap_writers_adj(struct bmap_mds_info *bmi, int delta)
+{
+	struct fcmh_mds_info *fmi;
+
+	fmi = fcmh_2_fmi(bmi_2_bmap(bmi)->bcm_fcmh);
+	bmi->bmi_writers += delta;
+	if (delta > 0 && bmi->bmi_writers == 1)
+		psc_atomic32_inc(&fmi->fmi_nwriters);
+	else if (delta < 0 && bmi->bmi_writers == 0)
+		psc_atomic32_dec(&fmi->fmi_nwriters);
+}
+
 /*
  * Attempt to upgrade a client-granted bmap lease from READ-only to
  * READ+WRITE.
@@ -880,7 +904,7 @@ mds_bmap_bml_chwrmode(struct bmap_mds_lease *bml, sl_ios_id_t prefios)
 		 * Only bump bmi_writers if no other write lease is
 		 * still leased to this client.
 		 */
-		bmi->bmi_writers++;
+		mds_bmap_writers_adj(bmi, 1);
 		bmi->bmi_readers--;
 	}
 	bml->bml_flags &= ~BML_READ;
@@ -1026,7 +1050,7 @@ mds_bmap_bml_add(struct bmap_mds_lease *bml, enum rw rw,
 		 */
 		if (!wlease) {
 			/* This is the first write from the client. */
-			bmi->bmi_writers++;
+			mds_bmap_writers_adj(bmi, 1);
 
 			if (rlease)
 				/*
@@ -1145,7 +1169,7 @@ mds_bmap_bml_del_locked(struct bmap_mds_lease *bml)
 	if (bml->bml_flags & BML_WRITE) {
 		if (wlease == 1) {
 			pfl_assert(bmi->bmi_writers > 0);
-			bmi->bmi_writers--;
+			mds_bmap_writers_adj(bmi, -1);
 
 			DEBUG_BMAP(PLL_DIAG, bmi_2_bmap(bmi),
 			    "bml=%p bmi_writers=%d bmi_readers=%d",
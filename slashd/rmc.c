@@ -47,6 +47,7 @@
 #include "pfl/time.h"
 
 #include "authbuf.h"
+#include "batchrpc.h"
 #include "bmap_mds.h"
 #include "fidc_mds.h"
 #include "fidcache.h"
@@ -83,6 +84,9 @@ int			slm_min_space_reserve_pct = MIN_SPACE_RESERVE_PCT;
 	
 struct fcmh_timeo_table	slm_fcmh_callbacks;
 
+struct slrpc_batch_req_handler
+			slm_rmc_batch_req_handlers[SRMT_TOTAL];
+
 static void
 slm_root_attributes(struct srt_stat *attr)
 {
@@ -142,7 +146,7 @@ slm_set_curr_slashfid(slfid_t slfid)
  * The siteid has already been baked into the initial cursor file.
  */
 int
-slm_get_next_slashfid(slfid_t *fidp)
+slm_get_next_slashfids(int n, slfid_t *fidp)
 {
 	uint64_t fid;
 
@@ -153,7 +157,7 @@ slm_get_next_slashfid(slfid_t *fidp)
 	 * the cycle bits.  We have to let the sysadmin know otherwise
 	 * they will not know to bump the cycle bits.
 	 */
-	if (FID_GET_INUM(slm_next_fid) >= FID_MAX_INUM) {
+	if (FID_GET_INUM(slm_next_fid + n - 1) >= FID_MAX_INUM) {
 		psclog_warnx("max FID "SLPRI_FID" reached, manual "
 		    "intervention needed (bump the cycle bits)",
 		    slm_next_fid);
@@ -161,14 +165,97 @@ slm_get_next_slashfid(slfid_t *fidp)
 		return (ENOSPC);
 	}
 	/* end up in zp_s2fid in struct znode_phys */
-	fid = slm_next_fid++;
+	fid = slm_next_fid;
+	slm_next_fid += n;
 	freelock(&slm_fid_lock);
 
-	psclog_diag("most recently allocated FID: "SLPRI_FID, fid);
+	psclog_diag("most recently allocated FID: "SLPRI_FID" (%d)",
+	    fid, n);
 	*fidp = fid;
 	return (0);
 }
 
+int
+slm_get_next_slashfid(slfid_t *fidp)
+{
+	return (slm_get_next_slashfids(1, fidp));
+}
+
+/*
+ * Record a range of FIDs handed to a client for asynchronous creates.
+ * Only the last few ranges are remembered, which is plenty since a
+ * client asks for the next one only after using up the previous one.
+ */
+static void
+slm_exp_fidres_add(struct pscrpc_export *exp, slfid_t fid, int n)
+{
+	struct slm_exp_cli *mexpc;
+	struct slm_fidres *fr;
+
+	mexpc = sl_exp_getpri_cli(exp, 0);
+	if (mexpc == NULL)
+		return;
+	spinlock(&mexpc->mexpc_lock);
+	fr = &mexpc->mexpc_fidres[mexpc->mexpc_fidres_next++ %
+	    SLM_EXP_NFIDRES];
+	fr->fr_start = fid;
+	fr->fr_end = fid + n;
+	freelock(&mexpc->mexpc_lock);
+}
+
+/*
+ * Check that a client-supplied FID was reserved by that client from
+ * this instance of the MDS, so a stale or bogus FID can never collide
+ * with one we hand out ourselves.
+ */
+static int
+slm_exp_fidres_check(struct pscrpc_export *exp, slfid_t fid)
+{
+	struct slm_exp_cli *mexpc;
+	struct slm_fidres *fr;
+	int i, rc = -ESTALE;
+
+	mexpc = sl_exp_getpri_cli(exp, 0);
+	if (mexpc == NULL)
+		return (rc);
+	spinlock(&mexpc->mexpc_lock);
+	for (i = 0, fr = mexpc->mexpc_fidres; i < SLM_EXP_NFIDRES;
+	    i++, fr++)
+		if (fid >= fr->fr_start && fid < fr->fr_end) {
+			rc = 0;
+			break;
+		}
+	freelock(&mexpc->mexpc_lock);
+	return (rc);
+}
+
+/*
+ * Handle a RESERVE_FID request from a client that creates files
+ * asynchronously.  The FIDs are taken out of the same sequence as
+ * regular creates, so they are never reused even if the client never
+ * gets around to creating anything with them.
+ */
+int
+slm_rmc_handle_reserve_fid(struct pscrpc_request *rq)
+{
+	struct srm_reserve_fid_req *mq;
+	struct srm_reserve_fid_rep *mp;
+	slfid_t fid;
+
+	SL_RSX_ALLOCREP(rq, mq, mp);
+	mp->count = MIN(mq->count, SLM_RESERVE_FID_MAX);
+	if (mp->count <= 0)
+		PFL_GOTOERR(out, mp->rc = -EINVAL);
+	mp->rc = -slm_get_next_slashfids(mp->count, &fid);
+	if (mp->rc)
+		PFL_GOTOERR(out, mp->rc);
+	slm_exp_fidres_add(rq->rq_export, fid, mp->count);
+	mp->fid = fid;
+	OPSTAT_INCR("reserve-fid");
+ out:
+	return (0);
+}
+
 int
 slm_rmc_check_capacity(int vfsid)
 {
@@ -239,7 +326,7 @@ slm_fcmh_coherent_callback(struct fidc_membh *f,
     struct pscrpc_export *exp, int32_t *leasep)
 {
 	int32_t lease;
-	int rc = 0, count = 0, found = 0;
+	int rc = 0, count = 0, found = 0, shared;
 	lnet_nid_t nid;
 	lnet_pid_t pid;
 	struct psc_listentry *tmp;
@@ -258,7 +345,18 @@ slm_fcmh_coherent_callback(struct fidc_membh *f,
 	lease = 0;
 
 	fmi = fcmh_2_fmi(f);
+
 	FCMH_LOCK(f);
+	/*
+	 * Attributes of a regular file that nobody is writing can be
+	 * cached by all of its users.  Whoever changes them revokes the
+	 * callbacks with slm_coh_revoke_attrs(), which walks the list
+	 * under the same lock, so a writer showing up after this check
+	 * will find our callback.
+	 */
+	shared = slm_attr_lease && fcmh_isreg(f) &&
+	    !psc_atomic32_read(&fmi->fmi_nwriters);
+
 	psclist_for_each(tmp, &fmi->fmi_callbacks) {
 		count++;
 		cb = psc_lentry_obj(tmp, struct fcmh_mds_callback, fmc_lentry);
@@ -278,10 +376,15 @@ slm_fcmh_coherent_callback(struct fidc_membh *f,
 		lease = slm_callback_timeout;
 		OPSTAT_INCR("slm-renew-callback");
 	}
-	/*
- 	 * If the number of users goes from 1 to 2, send callbacks.
- 	 */
-	if (count == 1 && !found) {
+	if (shared && count > (found ? 1 : 0)) {
+		/* users are told when the attributes change instead */
+		lease = slm_callback_timeout;
+		OPSTAT_INCR("slm-shared-callback");
+	} else if (count == 1 && !found) {
+		/*
+		 * If the number of users goes from 1 to 2, send
+		 * callbacks.
+		 */
 		csvc = slm_getclcsvc(cb->fmc_exp, 0);
 		/*
  		 * Hit this when a client dies. Need more investigation.
@@ -357,23 +460,25 @@ slm_fcmh_coherent_callback(struct fidc_membh *f,
 	return (rc);
 }
 
-int
-slm_rmc_handle_getattr(struct pscrpc_request *rq)
+/*
+ * Fill in the attributes of one file for a client, shared by GETATTR
+ * and the batched form sent after a readdir.
+ * @exp: export of the client, to register a callback on.
+ */
+static void
+slm_rmc_getattr(struct pscrpc_export *exp,
+    const struct srm_getattr_req *mq, struct srm_getattr_rep *mp)
 {
-	const struct srm_getattr_req *mq;
-	struct srm_getattr_rep *mp;
-	struct fidc_membh *f;
+	struct fidc_membh *f = NULL;
 	int vfsid;
 
-	SL_RSX_ALLOCREP(rq, mq, mp);
-
 	psclog_diag("pfid="SLPRI_FID, mq->fg.fg_fid);
 
 	if (mq->fg.fg_fid == SLFID_ROOT && slm_global_mount) {
 		mp->attr.sst_fg.fg_fid = SLFID_ROOT;
 		mp->attr.sst_fg.fg_gen = FGEN_ANY-1;
 		slm_root_attributes(&mp->attr);
-		return (0);
+		return;
 	}
 
 	mp->rc = -slm_fcmh_get(&mq->fg, &f);
@@ -386,13 +491,37 @@ slm_rmc_handle_getattr(struct pscrpc_request *rq)
 	mp->xattrsize = mdsio_hasxattrs(vfsid, &rootcreds,
 	    fcmh_2_mfid(f));
 
-	mp->rc = slm_fcmh_coherent_callback(f, rq->rq_export, &mp->lease);
+	mp->rc = slm_fcmh_coherent_callback(f, exp, &mp->lease);
 
 	FCMH_LOCK(f);
 	mp->attr = f->fcmh_sstb;
  out:
 	if (f)
 		fcmh_op_done(f);
+}
+
+int
+slm_rmc_handle_getattr(struct pscrpc_request *rq)
+{
+	const struct srm_getattr_req *mq;
+	struct srm_getattr_rep *mp;
+
+	SL_RSX_ALLOCREP(rq, mq, mp);
+	slm_rmc_getattr(rq->rq_export, mq, mp);
+	return (0);
+}
+
+/*
+ * Handle one GETATTR contained in a batch sent by a client after it
+ * loaded a readdir page.  Errors are per item so that a single file
+ * that went away does not doom the rest of the batch.
+ */
+int
+slm_rmc_batch_handle_getattr(struct slrpc_batch_rep *bp, void *req,
+    void *rep)
+{
+	OPSTAT_INCR("getattr-batch");
+	slm_rmc_getattr(bp->bp_exp, req, rep);
 	return (0);
 }
 
@@ -439,7 +568,9 @@ slm_rmc_handle_bmap_chwrmode(struct pscrpc_request *rq)
 	else if (mp->rc) {
 		psclog_diag("bno = %d, rc = %d", mq->sbd.sbd_bmapno, mp->rc);
 		PFL_GOTOERR(out, mp->rc);
-	}
+	} else
+		/* the file now has a writer, see slm_rmc_handle_getbmap() */
+		slm_coh_revoke_attrs(f, rq->rq_export);
 
 	mp->sbd = mq->sbd;
 	mp->sbd.sbd_seq = bml->bml_seq;
@@ -458,24 +589,51 @@ slm_rmc_handle_bmap_chwrmode(struct pscrpc_request *rq)
 	return (0);
 }
 
+static void
+slm_rmc_extendbmapls(struct pscrpc_export *exp,
+    struct srm_leasebmapext_req *mq, struct srm_leasebmapext_rep *mp)
+{
+	struct fidc_membh *f;
+
+	mp->rc = -slm_fcmh_get(&mq->sbd.sbd_fg, &f);
+	if (mp->rc)
+		return;
+
+	mp->rc = mds_lease_renew(f, &mq->sbd, &mp->sbd, exp);
+	fcmh_op_done(f);
+}
+
 int
 slm_rmc_handle_extendbmapls(struct pscrpc_request *rq)
 {
 	struct srm_leasebmapext_req *mq;
 	struct srm_leasebmapext_rep *mp;
-	struct fidc_membh *f;
 
 	SL_RSX_ALLOCREP(rq, mq, mp);
+	slm_rmc_extendbmapls(rq->rq_export, mq, mp);
+	return (0);
+}
 
-	mp->rc = -slm_fcmh_get(&mq->sbd.sbd_fg, &f);
-	if (mp->rc)
-		return (0);
-
-	mp->rc = mds_lease_renew(f, &mq->sbd, &mp->sbd, rq->rq_export);
-	fcmh_op_done(f);
+/*
+ * Extend one of the bmap leases a client renews in bulk from its bmap
+ * watcher thread.
+ */
+int
+slm_rmc_batch_handle_extendbmapls(struct slrpc_batch_rep *bp,
+    void *req, void *rep)
+{
+	slm_rmc_extendbmapls(bp->bp_exp, req, rep);
 	return (0);
 }
 
+static void
+slm_rmc_batch_extendbmapls_start(__unusedx struct slrpc_batch_rep *bp,
+    int n)
+{
+	OPSTAT_INCR("extendbmapls-batch");
+	OPSTAT_ADD("extendbmapls-batch-items", n);
+}
+
 int
 slm_rmc_handle_reassignbmapls(struct pscrpc_request *rq)
 {
@@ -590,6 +748,13 @@ slm_rmc_handle_getbmap(struct pscrpc_request *rq)
 	if (mp->rc)
 		PFL_GOTOERR(out, mp->rc);
 
+	/*
+	 * Other clients may no longer trust the size they cached now
+	 * that this one can change it without telling us.
+	 */
+	if (mq->rw == SL_WRITE)
+		slm_coh_revoke_attrs(f, rq->rq_export);
+
 	if (mp->flags & SRM_LEASEBMAPF_GETINODE)
 		slm_pack_inode(f, &mp->ino);
 
@@ -603,6 +768,108 @@ slm_rmc_handle_getbmap(struct pscrpc_request *rq)
 	return (0);
 }
 
+/*
+ * Handle SRMT_GETBMAPS: lease a range of consecutive bmaps so that a
+ * client streaming through a file does not pay a round trip for each
+ * of them.  Leasing stops at the first bmap that cannot be leased (or
+ * at EOF for reads); the client falls back to SRMT_GETBMAP for it.
+ */
+int
+slm_rmc_handle_getbmaps(struct pscrpc_request *rq)
+{
+	const struct srm_leasebmaps_req *mq;
+	struct srm_leasebmaps_ent *e;
+	struct srm_leasebmaps_rep *mp;
+	struct fidc_membh *f = NULL;
+	sl_bmapno_t last;
+	int i, rc;
+
+	SL_RSX_ALLOCREP(rq, mq, mp);
+
+	if (mq->rw != SL_READ && mq->rw != SL_WRITE)
+		PFL_GOTOERR(out, mp->rc = -EINVAL);
+	if (mq->count < 1 || mq->count > SRM_LEASEBMAPS_MAX)
+		PFL_GOTOERR(out, mp->rc = -EINVAL);
+
+	mp->rc = -slm_fcmh_get(&mq->fg, &f);
+	if (mp->rc)
+		goto out;
+
+	if (!fcmh_isreg(f))
+		PFL_GOTOERR(out, mp->rc = -EINVAL);
+
+	mp->rc = slm_fcmh_coherent_callback(f, rq->rq_export, NULL);
+	if (mp->rc)
+		PFL_GOTOERR(out, mp->rc);
+
+	last = mq->bmapno + mq->count;
+	if (mq->rw == SL_READ) {
+		FCMH_LOCK(f);
+		last = MIN(last, howmany(fcmh_2_fsz(f),
+		    SLASH_BMAP_SIZE));
+		FCMH_ULOCK(f);
+	}
+
+	mp->flags = mq->flags;
+	for (i = 0; mq->bmapno + i < last; i++) {
+		e = &mp->ents[i];
+
+		/*
+		 * A write lease must not race a partial truncate (see
+		 * slm_rmc_handle_getbmap()).  Rather than stall the
+		 * whole range, stop here and let the client wait for
+		 * this bmap through SRMT_GETBMAP.
+		 */
+		if (mq->rw == SL_WRITE) {
+			FCMH_LOCK(f);
+			rc = f->fcmh_flags & FCMH_MDS_IN_PTRUNC ?
+			    -SLERR_BMAP_IN_PTRUNC : 0;
+			FCMH_ULOCK(f);
+			if (rc) {
+				OPSTAT_INCR("getbmaps-lease-write-ptrunc");
+				e->rc = rc;
+				if (!i)
+					mp->rc = rc;
+				break;
+			}
+		}
+
+		rc = mds_bmap_load_cli(f, mq->bmapno + i, mq->flags,
+		    mq->rw, mq->prefios[0], &e->sbd, rq->rq_export,
+		    e->repls, 0);
+		if (rc) {
+			e->rc = rc;
+			if (!i)
+				mp->rc = rc;
+			break;
+		}
+	}
+	mp->nbmaps = i;
+	OPSTAT_ADD("getbmaps-lease", i);
+	if (!i) {
+		/* the whole range lies past EOF */
+		if (!mp->rc)
+			mp->rc = -ENOENT;
+		goto out;
+	}
+
+	/* see slm_rmc_handle_getbmap() */
+	if (mq->rw == SL_WRITE)
+		slm_coh_revoke_attrs(f, rq->rq_export);
+
+	if (mp->flags & SRM_LEASEBMAPF_GETINODE)
+		slm_pack_inode(f, &mp->ino);
+
+ out:
+	if (f)
+		fcmh_op_done(f);
+	if (!mp->rc)
+		OPSTAT_INCR("getbmaps-ok");
+	else
+		OPSTAT_INCR("getbmaps-err");
+	return (0);
+}
+
 int
 slm_rmc_handle_link(struct pscrpc_request *rq)
 {
@@ -628,10 +895,15 @@ slm_rmc_handle_link(struct pscrpc_request *rq)
 	mp->rc = -mdsio_link(vfsid, fcmh_2_mfid(c), fcmh_2_mfid(p),
 	    mq->name, &rootcreds, mdslog_namespace);
 	mds_unreserve_slot(1);
+	if (mp->rc)
+		PFL_GOTOERR(out, mp->rc);
 
 	mdsio_fcmh_refreshattr(c, &mp->cattr);
 	mdsio_fcmh_refreshattr(p, &mp->pattr);
 
+	/* the link count has changed */
+	slm_coh_revoke_attrs(c, rq->rq_export);
+
 	mp->rc = slm_fcmh_coherent_callback(p, rq->rq_export, &mp->please);
 	if (mp->rc)
 		PFL_GOTOERR(out, mp->rc);
@@ -879,30 +1151,30 @@ slm_rmc_handle_mknod(struct pscrpc_request *rq)
 static int debug_create;
 
 /*
- * Handle a CREATE from CLI.  As an optimization, we bundle a write
- * lease for bmap 0 in the reply.
+ * Handle a CREATE from CLI, either on its own or as part of a batch
+ * from a client that creates files asynchronously.  As an
+ * optimization, we bundle a write lease for bmap 0 in the reply.
+ * @exp: export of the client, to register a callback on.
  */
-int
-slm_rmc_handle_create(struct pscrpc_request *rq)
+static void
+slm_rmc_create(struct pscrpc_export *exp, struct srm_create_req *mq,
+    struct srm_create_rep *mp)
 {
 	struct fidc_membh *p = NULL, *c;
-	struct srm_create_rep *mp;
-	struct srm_create_req *mq;
 	struct slash_creds cr;
 	slfid_t fid = 0;
 	void *mfh;
-	int vfsid, level;
+	int vfsid, level, remote = 0;
 
 	level = debug_create ? PLL_MAX : PLL_DEBUG;
 
-	SL_RSX_ALLOCREP(rq, mq, mp);
 	mp->rc = slfid_to_vfsid(mq->pfg.fg_fid, &vfsid);
 	if (mp->rc)
 		PFL_GOTOERR(out, mp->rc);
 
 	if (mq->pfg.fg_fid == SLFID_ROOT && slm_global_mount) {
 		mp->rc = -EACCES;
-		return (0);
+		return;
 	}
 
 	mp->rc = slfid_to_vfsid(mq->pfg.fg_fid, &vfsid);
@@ -913,7 +1185,7 @@ slm_rmc_handle_create(struct pscrpc_request *rq)
 
 	mp->rc = slm_rmc_check_capacity(vfsid);
 	if (mp->rc)
-		return (0);
+		return;
 
 #ifdef OLD_DEBUG_BITS
 	if (strcmp(mq->name, ".sconsign.dblite") == 0)
@@ -924,12 +1196,21 @@ slm_rmc_handle_create(struct pscrpc_request *rq)
 	cr.scr_gid = mq->owner.scr_gid;
 
 	if (IS_REMOTE_FID(mq->pfg.fg_fid)) {
+		/* reserved FIDs are only handed out for local parents */
+		if (mq->fid)
+			PFL_GOTOERR(out, mp->rc = -EINVAL);
 		mp->rc = slm_rmm_forward_namespace(SLM_FORWARD_CREATE,
 		    &mq->pfg, NULL, mq->name, NULL, mq->mode, &cr,
 		    &mp->cattr, 0);
 		if (mp->rc)
 			PFL_GOTOERR(out, mp->rc);
 		fid = mp->cattr.sst_fg.fg_fid;
+		remote = 1;
+	} else if (mq->fid) {
+		mp->rc = slm_exp_fidres_check(exp, mq->fid);
+		if (mp->rc)
+			PFL_GOTOERR(out, mp->rc);
+		fid = mq->fid;
 	}
 
 	/*
@@ -942,11 +1223,15 @@ slm_rmc_handle_create(struct pscrpc_request *rq)
 
 	DEBUG_FCMH(level, p, "create op start for %s", mq->name);
 
+	/*
+	 * A FID reserved by the client is ours and gets journaled like
+	 * any other; one from a remote peer was journaled over there.
+	 */
 	mp->cattr.sst_ctim = mq->time;
 	mds_reserve_slot(1);
 	mp->rc = -mdsio_opencreate(vfsid, fcmh_2_mfid(p), &cr,
 	    O_CREAT | O_EXCL | O_RDWR, mq->mode, mq->name, NULL,
-	    &mp->cattr, &mfh, fid ? NULL : mdslog_namespace,
+	    &mp->cattr, &mfh, remote ? NULL : mdslog_namespace,
 	    fid ? 0 : slm_get_next_slashfid, fid);
 	mds_unreserve_slot(1);
 
@@ -970,14 +1255,14 @@ slm_rmc_handle_create(struct pscrpc_request *rq)
 
 	DEBUG_FCMH(level, p, "mdsio_release() done for %s", mq->name);
 
-	if (fid)
+	if (remote)
 		PFL_GOTOERR(out, mp->rc2 = ENOENT);
 
 	mp->rc = -slm_fcmh_get(&mp->cattr.sst_fg, &c);
 	if (mp->rc)
 		PFL_GOTOERR(out, mp->rc);
 
-	mp->rc = slm_fcmh_coherent_callback(c, rq->rq_export, &mp->lease);
+	mp->rc = slm_fcmh_coherent_callback(c, exp, &mp->lease);
 	if (mp->rc)
 		PFL_GOTOERR(out, mp->rc);
 	
@@ -990,7 +1275,7 @@ slm_rmc_handle_create(struct pscrpc_request *rq)
 	mp->rc2 = ENOENT;
 #else
 	mp->rc2 = mds_bmap_load_cli(c, 0, mp->flags, SL_WRITE,
-	    mq->prefios[0], &mp->sbd, rq->rq_export, NULL, 1);
+	    mq->prefios[0], &mp->sbd, exp, NULL, 1);
 #endif
 
 	DEBUG_FCMH(level, p, "bmap load done for %s, rc = %d",
@@ -1004,6 +1289,31 @@ slm_rmc_handle_create(struct pscrpc_request *rq)
  out:
 	if (p)
 		fcmh_op_done(p);
+}
+
+int
+slm_rmc_handle_create(struct pscrpc_request *rq)
+{
+	struct srm_create_req *mq;
+	struct srm_create_rep *mp;
+
+	SL_RSX_ALLOCREP(rq, mq, mp);
+	slm_rmc_create(rq->rq_export, mq, mp);
+	return (0);
+}
+
+/*
+ * Handle one CREATE contained in a batch from a client that replied
+ * to creat(2) before asking us, using a FID it reserved earlier.  The
+ * batch is processed in order, so creates arrive in the order the
+ * application issued them.
+ */
+int
+slm_rmc_batch_handle_create(struct slrpc_batch_rep *bp, void *req,
+    void *rep)
+{
+	OPSTAT_INCR("create-batch");
+	slm_rmc_create(bp->bp_exp, req, rep);
 	return (0);
 }
 
@@ -1360,6 +1670,8 @@ slm_rmc_handle_rename(struct pscrpc_request *rq)
 	    slm_fcmh_get(&chfg[0], &c) == 0) {
 		mp->rc = mdsio_fcmh_refreshattr(c,
 		    &mp->srr_cattr);
+		/* its ctime has changed */
+		slm_coh_revoke_attrs(c, rq->rq_export);
 		fcmh_op_done(c);
 	} else
 		mp->srr_cattr.sst_fid = FID_ANY;
@@ -1379,6 +1691,8 @@ slm_rmc_handle_rename(struct pscrpc_request *rq)
 	if (chfg[1].fg_fid != FID_ANY &&
 	    slm_fcmh_get(&chfg[1], &c) == 0) {
 		mp->rc = mdsio_fcmh_refreshattr(c, &mp->srr_clattr);
+		/* the clobbered file lost a link or is gone */
+		slm_coh_revoke_attrs(c, rq->rq_export);
 		fcmh_op_done(c);
 	} else
 		mp->srr_clattr.sst_fid = FID_ANY;
@@ -1509,8 +1823,11 @@ slm_rmc_handle_setattr(struct pscrpc_request *rq)
 
 	if (f) {
 		FCMH_LOCK_ENSURE(f);
-		if (mp->rc == 0 || mp->rc == -SLERR_BMAP_PTRUNC_STARTED)
+		if (mp->rc == 0 || mp->rc == -SLERR_BMAP_PTRUNC_STARTED) {
 			mp->attr = f->fcmh_sstb;
+			FCMH_ULOCK(f);
+			slm_coh_revoke_attrs(f, rq->rq_export);
+		}
 		fcmh_op_done(f);
 	}
 	return (0);
@@ -1782,28 +2099,31 @@ slm_rmc_handle_symlink(struct pscrpc_request *rq)
 	return (slm_symlink(rq, mq, mp, SRMC_BULK_PORTAL));
 }
 
-int
-slm_rmc_handle_unlink(struct pscrpc_request *rq, int isfile)
+/*
+ * Handle an UNLINK or RMDIR from CLI, either on its own or as part of a
+ * batch.
+ * @exp: export of the client, to register a callback on.
+ */
+static void
+slm_rmc_unlink(struct pscrpc_export *exp, struct srm_unlink_req *mq,
+    struct srm_unlink_rep *mp, int isfile)
 {
 	struct sl_fidgen fg, oldfg, chfg;
 	struct fidc_membh *p = NULL;
 	struct fidc_membh *c = NULL;
-	struct srm_unlink_req *mq;
-	struct srm_unlink_rep *mp;
 	struct srt_stat	attr;
 	uint32_t xattrsize;
 	int rc, vfsid;
 
 	chfg.fg_fid = FID_ANY;
 
-	SL_RSX_ALLOCREP(rq, mq, mp);
 	mp->rc = slfid_to_vfsid(mq->pfid, &vfsid);
 	if (mp->rc)
 		PFL_GOTOERR(out, mp->rc);
 
 	if (mq->pfid == SLFID_ROOT && slm_global_mount) {
 		mp->rc = -EACCES;
-		return (0);
+		return;
 	}
 
 	fg.fg_fid = mq->pfid;
@@ -1841,7 +2161,9 @@ slm_rmc_handle_unlink(struct pscrpc_request *rq, int isfile)
 		    mq->name, &rootcreds, mdslog_namespace);
 	mds_unreserve_slot(1);
 
-	mp->rc = slm_fcmh_coherent_callback(p, rq->rq_export, &mp->lease);
+	if (mp->rc == 0)
+		mp->rc = slm_fcmh_coherent_callback(p, exp,
+		    &mp->lease);
 
  out:
 	if (mp->rc == 0) {
@@ -1858,7 +2180,9 @@ slm_rmc_handle_unlink(struct pscrpc_request *rq, int isfile)
 			mp->valid = 0;
 			mp->cattr.sst_fg = oldfg;
 			slm_coh_delete_file(c);
-		}
+		} else
+			/* the link count has changed */
+			slm_coh_revoke_attrs(c, exp);
 	}
 
 	if (p)
@@ -1868,6 +2192,34 @@ slm_rmc_handle_unlink(struct pscrpc_request *rq, int isfile)
 
 	psclog_diag("%s parent="SLPRI_FID" name=%s rc=%d",
 	    isfile ? "unlink" : "rmdir", mq->pfid, mq->name, mp->rc);
+}
+
+int
+slm_rmc_handle_unlink(struct pscrpc_request *rq, int isfile)
+{
+	struct srm_unlink_req *mq;
+	struct srm_unlink_rep *mp;
+
+	SL_RSX_ALLOCREP(rq, mq, mp);
+	slm_rmc_unlink(rq->rq_export, mq, mp, isfile);
+	return (0);
+}
+
+/*
+ * Handle one UNLINK contained in a batch from a client that replied
+ * to unlink(2) before asking us.
+ */
+int
+slm_rmc_batch_handle_unlink(struct slrpc_batch_rep *bp, void *req,
+    void *rep)
+{
+	OPSTAT_INCR("unlink-batch");
+	/*
+	 * Journal slots are reserved one item at a time: the item
+	 * count comes from the client and reserving for all of them
+	 * up front would let one batch starve the journal.
+	 */
+	slm_rmc_unlink(bp->bp_exp, req, rep, 1);
 	return (0);
 }
 
@@ -2178,6 +2530,7 @@ slm_rmc_handle_getreplst(struct pscrpc_request *rq)
 int
 slm_rmc_handler(struct pscrpc_request *rq)
 {
+	struct slrpc_cservice *csvc;
 	int rc = 0;
 
 	if (rq->rq_reqmsg->opc != SRMT_CONNECT) {
@@ -2207,6 +2560,9 @@ slm_rmc_handler(struct pscrpc_request *rq)
 	case SRMT_GETBMAP:
 		rc = slm_rmc_handle_getbmap(rq);
 		break;
+	case SRMT_GETBMAPS:
+		rc = slm_rmc_handle_getbmaps(rq);
+		break;
 	case SRMT_RELEASEBMAP:
 		rc = mds_handle_rls_bmap(rq, 0);
 		break;
@@ -2239,11 +2595,25 @@ slm_rmc_handler(struct pscrpc_request *rq)
 	case SRMT_PING:
 		rc = slm_rmc_handle_ping(rq);
 		break;
+	case SRMT_BATCH_RQ:
+		csvc = slm_getclcsvc(rq->rq_export, 0);
+		if (csvc == NULL) {
+			rc = -PFLERR_NOTCONN;
+			break;
+		}
+		rc = slrpc_batch_handle_request(csvc, rq,
+		    slm_rmc_batch_req_handlers);
+		if (rc)
+			sl_csvc_decref(csvc);
+		break;
 
 	/* file system messages */
 	case SRMT_CREATE:
 		rc = slm_rmc_handle_create(rq);
 		break;
+	case SRMT_RESERVE_FID:
+		rc = slm_rmc_handle_reserve_fid(rq);
+		break;
 	case SRMT_GETATTR:
 		rc = slm_rmc_handle_getattr(rq);
 		break;
@@ -2308,13 +2678,49 @@ slm_rmc_handler(struct pscrpc_request *rq)
 	return (rc);
 }
 
+void
+slm_rmc_init(void)
+{
+	struct slrpc_batch_req_handler *h;
+
+	h = &slm_rmc_batch_req_handlers[SRMT_GETATTR];
+	h->bqh_cbf = slm_rmc_batch_handle_getattr;
+	h->bqh_qlen = sizeof(struct srm_getattr_req);
+	h->bqh_plen = sizeof(struct srm_getattr_rep);
+	h->bqh_rcv_ptl = SRMC_BULK_PORTAL;
+	h->bqh_snd_ptl = SRCM_BULK_PORTAL;
+
+	h = &slm_rmc_batch_req_handlers[SRMT_CREATE];
+	h->bqh_cbf = slm_rmc_batch_handle_create;
+	h->bqh_qlen = sizeof(struct srm_create_req);
+	h->bqh_plen = sizeof(struct srm_create_rep);
+	h->bqh_rcv_ptl = SRMC_BULK_PORTAL;
+	h->bqh_snd_ptl = SRCM_BULK_PORTAL;
+
+	h = &slm_rmc_batch_req_handlers[SRMT_UNLINK];
+	h->bqh_cbf = slm_rmc_batch_handle_unlink;
+	h->bqh_qlen = sizeof(struct srm_unlink_req);
+	h->bqh_plen = sizeof(struct srm_unlink_rep);
+	h->bqh_rcv_ptl = SRMC_BULK_PORTAL;
+	h->bqh_snd_ptl = SRCM_BULK_PORTAL;
+
+	h = &slm_rmc_batch_req_handlers[SRMT_EXTENDBMAPLS];
+	h->bqh_cbf = slm_rmc_batch_handle_extendbmapls;
+	h->bqh_startf = slm_rmc_batch_extendbmapls_start;
+	h->bqh_qlen = sizeof(struct srm_leasebmapext_req);
+	h->bqh_plen = sizeof(struct srm_leasebmapext_rep);
+	h->bqh_rcv_ptl = SRMC_BULK_PORTAL;
+	h->bqh_snd_ptl = SRCM_BULK_PORTAL;
+}
+
 /* called from sl_exp_getpri_cli() */
 static struct slrpc_cservice *
 mexpc_allocpri(struct pscrpc_export *exp)
 {
-	struct sl_exp_cli *expc;
+	struct slm_exp_cli *mexpc;
 
-	expc = exp->exp_private = PSCALLOC(sizeof(*expc));
+	mexpc = exp->exp_private = PSCALLOC(sizeof(*mexpc));
+	INIT_SPINLOCK(&mexpc->mexpc_lock);
 	return (slm_getclcsvc(exp, 0));
 }
 
@@ -148,6 +148,8 @@ mds_file_update(sl_ios_id_t iosid, struct srt_update_rec *recp)
 		else
 			mds_inox_write(vfsid, ih, NULL, NULL);
 		FCMH_ULOCK(f);
+
+		slm_coh_revoke_attrs(f, NULL);
 	}
 
  out:
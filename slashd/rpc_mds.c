@@ -103,6 +103,8 @@ slm_rpc_initsvc(void)
 		srcm->srcm_page = PSCALLOC(SRM_REPLST_PAGESIZ);
 		pscthr_setready(thr);
 	}
+
+	slm_rmc_init();
 }
 
 void
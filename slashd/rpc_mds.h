@@ -45,6 +45,25 @@ struct pscrpc_export;
 #define SLM_RMC_REPSZ			1024
 #define SLM_RMC_SVCNAME			"slmrmc"
 
+#define SLM_RESERVE_FID_MAX		1024	/* FIDs per RESERVE_FID */
+#define SLM_EXP_NFIDRES			4	/* ranges remembered per client */
+
+struct slm_fidres {
+	slfid_t			 fr_start;
+	slfid_t			 fr_end;	/* exclusive */
+};
+
+/*
+ * MDS private data of a client export.  The generic part comes first
+ * as sl_exp_hldrop_cli() frees it through a struct sl_exp_cli pointer.
+ */
+struct slm_exp_cli {
+	struct sl_exp_cli	 mexpc_expc;
+	psc_spinlock_t		 mexpc_lock;
+	int			 mexpc_fidres_next;
+	struct slm_fidres	 mexpc_fidres[SLM_EXP_NFIDRES];
+};
+
 enum slm_fwd_op {
 	SLM_FORWARD_CREATE,
 	SLM_FORWARD_MKDIR,
@@ -74,8 +93,10 @@ enum slm_fwd_op {
 void	slm_rpc_initsvc(void);
 
 int	slm_rmc_handle_lookup(struct pscrpc_request *);
+int	slm_rmc_handle_reserve_fid(struct pscrpc_request *);
 
 int	slm_rmc_handler(struct pscrpc_request *);
+void	slm_rmc_init(void);
 int	slm_rmi_handler(struct pscrpc_request *);
 int	slm_rmm_handler(struct pscrpc_request *);
 int	slm_rmm_forward_namespace(int, struct sl_fidgen *,
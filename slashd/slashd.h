@@ -47,6 +47,7 @@ struct slm_sth;
 struct bmap_mds_lease;
 extern int slm_lease_timeout;
 extern int slm_callback_timeout;
+extern int slm_attr_lease;
 
 #define CALLBACK_TIMEO_MAX             240     /* max/default callback timeout */
 #define CALLBACK_TIMEO_MIN             40      /* minimum callback timeout */
@@ -315,6 +316,7 @@ void	slmrcmthr_main(struct psc_thread *);
 slfid_t	slm_get_curr_slashfid(void);
 void	slm_set_curr_slashfid(slfid_t);
 int	slm_get_next_slashfid(slfid_t *);
+int	slm_get_next_slashfids(int, slfid_t *);
 
 int	slm_fcmh_coherent_callback(struct fidc_membh *, struct pscrpc_export *, int32_t *);
 
@@ -322,6 +324,7 @@ int	slm_ptrunc_prepare(struct fidc_membh *, struct srt_stat *, int);
 
 int	mdscoh_req(struct bmap_mds_lease *);
 void	slm_coh_delete_file(struct fidc_membh *);
+void	slm_coh_revoke_attrs(struct fidc_membh *, struct pscrpc_export *);
 
 void	slm_mdfs_scan(void);
 int	slm_wkcb_wr_brepl(void *);